@@ -12,6 +12,10 @@
  *
  * @license Apache-2.0
  */
+#ifdef __linux__
+/* For accept4() */
+#define _GNU_SOURCE
+#endif
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -46,6 +50,9 @@
 #include "wish_local_discovery.h"
 #include "wish_connection_mgr.h"
 #include "wish_core_rpc.h"
+#include "core_service_ipc.h"
+#include "wish_stream.h"
+#include "wish_batch.h"
 #include "wish_identity.h"
 #include "wish_time.h"
 #include "wish_debug.h"
@@ -77,25 +84,83 @@ void error(const char *msg)
     abort();
 }
 
+bool socket_write_again(void);
+
 int write_to_socket(wish_connection_t* connection, unsigned char* buffer, int len) {
-    int retval = 0;
     int sockfd = *((int *) connection->send_arg);
-    int n = write(sockfd,buffer,len); /* FIXME add support for partial write here. Now we fail if there is not enough space in the OS's TCP buffer. */
+    int kept_len = wish_connection_tx_buffered(connection, NULL);
+    int n = 0;
     
-    if (n < 0) {
-         printf("ERROR writing to socket: %s", strerror(errno));
-         retval = 1;
+    if (kept_len >= WISH_PORT_TX_OUT_MAX) {
+        /* The remote end is not reading. Refuse the whole frame, so that
+         * nothing of it is on the wire. */
+        printf("Not writing to socket, %i bytes waiting already\n", kept_len);
+        return 1;
+    }
+    
+    if (kept_len == 0) {
+        /* Earlier frames are written, write what the socket takes now */
+        n = write(sockfd, buffer, len);
+        if (n < 0) {
+            if (!socket_write_again()) {
+                printf("ERROR writing to socket: %s\n", strerror(errno));
+                return 1;
+            }
+            n = 0;
+        }
+    }
+    
+    /* The rest is written when the socket is writable */
+    if (n < len && wish_connection_tx_keep(connection, buffer + n, len - n)) {
+        /* Part of the frame may be on the wire, the connection cannot go
+         * on. The socket is then readable, and closed in the main loop. */
+        printf("Could not keep unsent data, closing connection\n");
+        shutdown(sockfd, SHUT_RDWR);
+        return 1;
     }
 
 #ifdef WISH_CORE_DEBUG
     connection->bytes_out += len;
 #endif
     
-    return retval;
+    return 0;
+}
+
+/* Write what the socket did not take earlier. Returns non-zero if the
+ * connection is lost. */
+static int write_kept_to_socket(wish_connection_t* connection) {
+    int sockfd = *((int *) connection->send_arg);
+    const uint8_t* data = NULL;
+    int len = wish_connection_tx_buffered(connection, &data);
+    if (len == 0) {
+        return 0;
+    }
+    
+    int n = write(sockfd, data, len);
+    if (n < 0) {
+        if (socket_write_again()) {
+            return 0;
+        }
+        printf("ERROR writing to socket: %s\n", strerror(errno));
+        return 1;
+    }
+    wish_connection_tx_written(connection, n);
+    return 0;
 }
 
 #define LOCAL_DISCOVERY_UDP_PORT 9090
 
+/* Milliseconds from an arbitrary starting point, not affected by changes of the wall clock time */
+static uint64_t monotonic_ms(void) {
+#ifdef _WIN32
+    return GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
 void socket_set_nonblocking(int sockfd) {
 #ifdef _WIN32
     unsigned long value = 1;
@@ -113,6 +178,57 @@ void socket_set_nonblocking(int sockfd) {
 #endif
 }
 
+/* Accept a connection from the listening socket, and set the new socket
+ * non-blocking. On Linux this is done in one syscall with accept4().
+ * Returns the new socket, or -1 with errno set as by accept() */
+int socket_accept_nonblocking(int listenfd, struct sockaddr* addr, socklen_t* addr_len) {
+#ifdef __linux__
+    return accept4(listenfd, addr, addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int sockfd = accept(listenfd, addr, addr_len);
+    if (sockfd >= 0) {
+        socket_set_nonblocking(sockfd);
+    }
+    return sockfd;
+#endif
+}
+
+/* Returns true if accept() failed only because there was nothing more
+ * to accept at this time, or because the client gave up before we got
+ * to it. Any other error is unexpected. */
+bool socket_accept_again(void) {
+#ifdef _WIN32
+    int err = WSAGetLastError();
+    return err == WSAEWOULDBLOCK || err == WSAECONNRESET || err == WSAEINTR;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED || errno == EINTR;
+#endif
+}
+
+/* Returns true if a write to a non-blocking socket failed only because
+ * the socket buffer is full at this time. Any other error means that
+ * the connection is lost. */
+bool socket_write_again(void) {
+#ifdef _WIN32
+    int err = WSAGetLastError();
+    return err == WSAEWOULDBLOCK || err == WSAEINTR;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+/* Allow several sockets, for example of several event loop threads or
+ * processes, to listen to the same port, if WISH_PORT_WITH_REUSEPORT is
+ * defined and the platform supports it. Call before bind(). */
+void socket_set_reuseport(int sockfd) {
+#if defined(WISH_PORT_WITH_REUSEPORT) && defined(SO_REUSEPORT)
+    const socket_opt_t option = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &option, sizeof(option)) < 0) {
+        perror("setsockopt SO_REUSEPORT");
+    }
+#endif
+}
+
 
 
 /* When the wish connection "i" is connecting and connect succeeds
@@ -309,6 +425,7 @@ uint16_t app_port = 9094;
 extern int app_serverfd; /* Defined in app_server.c */
 extern int app_fds[];
 extern enum app_state app_states[];
+extern enum app_transport_state app_transport_states[];
 #endif
 
 
@@ -554,6 +671,7 @@ void setup_wish_server(wish_core_t* core) {
     
     const socket_opt_t option = 1;
     setsockopt(serverfd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+    socket_set_reuseport(serverfd);
     socket_set_nonblocking(serverfd);
 
     struct sockaddr_in server_addr;
@@ -567,8 +685,7 @@ void setup_wish_server(wish_core_t* core) {
         printf("setup_wish_server: Trying to bind port %d failed.\n", server_addr.sin_port);
         abort();
     }
-    int connection_backlog = 1;
-    if (listen(serverfd, connection_backlog) < 0) {
+    if (listen(serverfd, WISH_PORT_LISTEN_BACKLOG) < 0) {
         perror("listen()");
     }
 }
@@ -690,6 +807,12 @@ int main(int argc, char** argv) {
     wish_fs_set_close(my_fs_close);
     wish_fs_set_rename(my_fs_rename);
     wish_fs_set_remove(my_fs_remove);
+    wish_fs_set_sync(my_fs_sync);
+    wish_fs_set_sync_dir(my_fs_sync_dir);
+    wish_fs_set_map(my_fs_map);
+    wish_fs_set_unmap(my_fs_unmap);
+
+    wish_dns_cache_set_get_stats(port_dns_cache_get_stats);
 
     // Will provide some random, but not to be considered cryptographically secure
     seed_random_init();
@@ -750,12 +873,14 @@ int main(int argc, char** argv) {
 #ifdef WITH_APP_TCP_SERVER
     if (as_app_server) {
         setup_app_server(core, app_port);
+        /* Let the core pace its output by what the Apps have not read */
+        core_service_ipc_set_queued(app_connection_tx_queued);
     }
 #endif
 
     while (1) {
         port_select_reset();
-        port_dns_poll_resolvers();
+        port_dns_select_resolvers();
         
         if (as_server) {
             port_select_fd_set_readable(serverfd);
@@ -781,7 +906,9 @@ int main(int argc, char** argv) {
                     /* Don't do anything as the resolver is resolving. relay->sockfd is not valid as it has not yet been initted! */
                 }
                 else if (relay->curr_state != WISH_RELAY_CLIENT_INITIAL) {
-                    if (relay->sockfd != -1) {
+                    /* Only poll for reading if there is room in the rx buffer, as
+                     * read() of zero bytes would look like a disconnect */
+                    if (relay->sockfd != -1 && ring_buffer_space(&(relay->rx_ringbuf)) > 0) {
                         port_select_fd_set_readable(relay->sockfd);
                     }
                 }
@@ -794,8 +921,19 @@ int main(int argc, char** argv) {
     
             int i;
             for (i = 0; i < NUM_APP_CONNECTIONS; i++) {
-                if (app_states[i] == APP_CONNECTION_CONNECTED) {
-                    port_select_fd_set_readable(app_fds[i]);
+                if (app_states[i] != APP_CONNECTION_CONNECTED) {
+                    continue;
+                }
+                if (app_transport_states[i] == APP_TRANSPORT_CLOSING) {
+                    /* The App sent something bad, or could not be written to */
+                    app_connection_cleanup(core, i);
+                    close(app_fds[i]);
+                    continue;
+                }
+                port_select_fd_set_readable(app_fds[i]);
+                if (app_connection_tx_pending(i)) {
+                    /* Frames are waiting for room in the socket */
+                    port_select_fd_set_writable(app_fds[i]);
                 }
             }
         }
@@ -820,11 +958,27 @@ int main(int argc, char** argv) {
                 port_select_fd_set_writable(sockfd);
             }
             else {
-                port_select_fd_set_readable(sockfd);
+                if (wish_core_get_rx_buffer_free(core, ctx) > 0) {
+                    port_select_fd_set_readable(sockfd);
+                }
+                else {
+                    /* Receive buffer is full: leave the data in the
+                     * socket, so that TCP flow control slows down the
+                     * sender until we have processed what we have */
+                }
+                if (wish_stream_tx_pending(ctx) || wish_connection_tx_buffered(ctx, NULL) > 0) {
+                    /* Stream data, or the rest of earlier frames, is waiting to be sent */
+                    port_select_fd_set_writable(sockfd);
+                }
             }
         }
 
-        int select_ret = port_select();
+        /* Wake up for the next core timer, but at least every 100 ms */
+        int select_ret = port_select(wish_time_next_timeout_ms(core, 100));
+
+        if (select_ret >= 0) {
+            port_dns_poll_resolvers();
+        }
 
         if (select_ret > 0) {
 
@@ -869,11 +1023,12 @@ int main(int argc, char** argv) {
                         /* Don't do anything as the resolver is resolving. relay->sockfd is not valid as it has not yet been initted! */
                     }
                     else if (relay->curr_state != WISH_RELAY_CLIENT_INITIAL && relay->sockfd != -1 && port_select_fd_is_readable(relay->sockfd)) { /* Note: Before select() we added fd to be checked for readability, if the relay fd was in some other state than its initial state. Now we need to check writability under the same condition */
-                        uint8_t byte;   /* That's right, we read just one
-                            byte at a time! */
-                        int read_len = read(relay->sockfd, &byte, 1);
+                        /* Read everything there is room for in one go, the
+                         * relay client processes all complete commands */
+                        uint8_t buf[RELAY_CLIENT_RX_RB_LEN];
+                        int read_len = read(relay->sockfd, buf, ring_buffer_space(&(relay->rx_ringbuf)));
                         if (read_len > 0) {
-                            wish_relay_client_feed(core, relay, &byte, 1);
+                            wish_relay_client_feed(core, relay, buf, read_len);
                             wish_relay_client_periodic(core, relay);
                         }
                         else if (read_len == 0) {
@@ -894,15 +1049,21 @@ int main(int argc, char** argv) {
 
 #ifdef WITH_APP_TCP_SERVER
             if (as_app_server) {
-                if (port_select_fd_is_readable(app_serverfd)) {
-                    /* New connection to app server port */
+                /* New connections to app server port. Accept all pending
+                 * connections, but at most one backlog's worth per loop
+                 * iteration, so that the established connections get served too. */
+                int accepted = 0;
+                while (port_select_fd_is_readable(app_serverfd) && accepted < WISH_PORT_LISTEN_BACKLOG) {
                     //printf("Detected incoming App connection\n");
-                    int newsockfd = accept(app_serverfd, NULL, NULL);
+                    int newsockfd = socket_accept_nonblocking(app_serverfd, NULL, NULL);
                     if (newsockfd < 0) {
+                        if (socket_accept_again()) {
+                            break;
+                        }
                         perror("on accept");
                         abort();
                     }
-                    socket_set_nonblocking(newsockfd);
+                    accepted++;
                     int i = 0;
                     /* Find a vacant app connection "slot" */
                     for (i = 0; i < NUM_APP_CONNECTIONS; i++) {
@@ -926,6 +1087,10 @@ int main(int argc, char** argv) {
                         /* If the app state is something else than "app connected", then don't do anything. */
                         continue;
                     }
+                    if (port_select_fd_is_writable(app_fds[i])) {
+                        /* Write what is queued for the App */
+                        app_connection_flush(core, i);
+                    }
                     if (port_select_fd_is_readable(app_fds[i])) {
                         /* Existing App connection has become readable */
                         size_t buffer_len = 100;
@@ -969,8 +1134,8 @@ int main(int argc, char** argv) {
                     int rb_free = wish_core_get_rx_buffer_free(core, ctx);
                     if (rb_free == 0) {
                         /* Cannot read at this time because ring buffer
-                         * is full */
-                        printf("ring buffer full\n");
+                         * is full. Not expected, as the socket is not
+                         * polled for reading when the buffer is full. */
                         continue;
                     }
                     if (rb_free < 0) {
@@ -1003,10 +1168,25 @@ int main(int argc, char** argv) {
                         continue;
                     }
                 }
-                if (port_select_fd_is_writable(sockfd)) {
+                if (port_select_fd_is_writable(sockfd) && ctx->curr_transport_state != TRANSPORT_STATE_CONNECTING) {
+                    /* Socket was selected for writability because of
+                     * pending data. Write the rest of earlier frames,
+                     * and then the next round of stream chunks. */
+                    if (write_kept_to_socket(ctx)) {
+                        close(sockfd);
+                        free(ctx->send_arg);
+                        wish_core_signal_tcp_event(core, ctx, TCP_DISCONNECTED);
+                        continue;
+                    }
+                    if (wish_connection_tx_buffered(ctx, NULL) == 0) {
+                        wish_stream_schedule(core, ctx);
+                    }
+                }
+                else if (port_select_fd_is_writable(sockfd)) {
                     /* The Wish connection socket is now writable. This
                      * means that a previous connect succeeded. (because
-                     * normally we don't select for socket writability!)
+                     * normally we only select for socket writability when connecting,
+                     * or when there is stream data to send)
                      * */
                     socket_opt_t connect_error = 0;
                     socklen_t connect_error_len = sizeof(connect_error);
@@ -1047,14 +1227,31 @@ int main(int argc, char** argv) {
 
             /* Check for incoming Wish connections to our server */
             if (as_server) {
-                if (port_select_fd_is_readable(serverfd)) {
+                /* Drain the backlog: accept until there are no more
+                 * pending connections, or WISH_PORT_LISTEN_BACKLOG
+                 * connections have been handled in this round */
+                int accept_cnt = 0;
+                while (port_select_fd_is_readable(serverfd) && accept_cnt++ < WISH_PORT_LISTEN_BACKLOG) {
                     //printf("Detected incoming connection!\n");
-                    int newsockfd = accept(serverfd, NULL, NULL);
+                    struct sockaddr_in remote_addr;
+                    socklen_t remote_addr_len = sizeof(remote_addr);
+                    int newsockfd = socket_accept_nonblocking(serverfd, (struct sockaddr*) &remote_addr, &remote_addr_len);
                     if (newsockfd < 0) {
+                        if (socket_accept_again()) {
+                            /* Backlog is empty, or the client gave up before we got to it */
+                            break;
+                        }
                         perror("on accept");
                         abort();
                     }
-                    socket_set_nonblocking(newsockfd);
+                    
+                    uint8_t remote_ip[4];
+                    memcpy(remote_ip, &remote_addr.sin_addr.s_addr, 4);
+                    if (!wish_connections_admit_incoming(core, remote_ip)) {
+                        close(newsockfd);
+                        continue;
+                    }
+                    
                     /* Start the wish core with null IDs. 
                      * The actual IDs will be established during handshake
                      * */
@@ -1069,6 +1266,8 @@ int main(int argc, char** argv) {
                         int *fd_ptr = malloc(sizeof(int));
                         *fd_ptr = newsockfd;
                         /* New wish connection can be accepted */
+                        memcpy(connection->remote_ip_addr, remote_ip, 4);
+                        connection->remote_port = ntohs(remote_addr.sin_port);
                         wish_core_register_send(core, connection, write_to_socket, fd_ptr);
                         //WISHDEBUG(LOG_CRITICAL, "Accepted TCP connection %d", newsockfd);
                         wish_core_signal_tcp_event(core, connection, TCP_CLIENT_CONNECTED);
@@ -1108,12 +1307,19 @@ int main(int argc, char** argv) {
             }
         }
 
-        static time_t periodic_timestamp = 0;
-        if (time(NULL) > periodic_timestamp) {
-            /* 1-second periodic interval */
-            periodic_timestamp = time(NULL);
-            wish_time_report_periodic(core);
+        /* Run the core timers which have expired */
+        static uint64_t timestamp_ms = 0;
+        uint64_t now_ms = monotonic_ms();
+        if (timestamp_ms == 0) {
+            timestamp_ms = now_ms;
         }
+        if (now_ms > timestamp_ms) {
+            wish_time_report_elapsed_ms(core, (uint32_t) (now_ms - timestamp_ms));
+            timestamp_ms = now_ms;
+        }
+
+        /* Send the messages which were coalesced during this iteration */
+        wish_batch_flush_all(core);
     }
 
     return 0;
@@ -39,6 +39,7 @@
 #include <time.h>
 #include <fcntl.h>
 #include <errno.h>
+#include "utlist.h"
 
 #include "wish_connection.h"
 #include "wish_event.h"
@@ -58,6 +59,7 @@
 
 #include "fs_port.h"
 #include "wish_relay_client.h"
+#include "wish_fragment.h"
 
 
 #include "app_server.h"
@@ -65,6 +67,8 @@
 
 /* Prototypes */
 void socket_set_nonblocking(int sockfd);
+void socket_set_reuseport(int sockfd);
+bool socket_write_again(void);
 
 int app_serverfd = 0;
 
@@ -73,9 +77,29 @@ int app_fds[NUM_APP_CONNECTIONS];
 enum app_state app_states[NUM_APP_CONNECTIONS];
 ring_buffer_t app_rx_ring_bufs[NUM_APP_CONNECTIONS];
 
-uint16_t app_transport_expect_bytes[NUM_APP_CONNECTIONS];
+uint32_t app_transport_expect_bytes[NUM_APP_CONNECTIONS];
 enum app_transport_state app_transport_states[NUM_APP_CONNECTIONS];
 
+/* True for App connections which use 32-bit frame lengths (APP_PREAMBLE_PLAIN_LARGE) */
+static bool app_large_frames[NUM_APP_CONNECTIONS];
+/* The frame being received from the App, and the number of bytes received so far */
+static uint8_t *app_rx_frames[NUM_APP_CONNECTIONS];
+static uint32_t app_rx_frame_lens[NUM_APP_CONNECTIONS];
+
+/* A frame to the App which its socket did not take yet */
+struct app_tx_frame {
+    uint8_t *data;
+    size_t len;
+    /* The number of bytes written so far */
+    size_t sent;
+    struct app_tx_frame *next;
+};
+
+/* The frames waiting for the App socket to become writable, in order,
+ * and the number of bytes in them not yet written */
+static struct app_tx_frame *app_tx_queues[NUM_APP_CONNECTIONS];
+static size_t app_tx_queued[NUM_APP_CONNECTIONS];
+
 struct app_entry {
     uint8_t wsid[WISH_WSID_LEN];
 };
@@ -104,6 +128,7 @@ void setup_app_server(wish_core_t* core, uint16_t app_port) {
     int option = 1;
     setsockopt(app_serverfd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
 #endif
+    socket_set_reuseport(app_serverfd);
     socket_set_nonblocking(app_serverfd);
     struct sockaddr_in server_addr;
     memset(&server_addr, 0, sizeof (server_addr));
@@ -115,8 +140,7 @@ void setup_app_server(wish_core_t* core, uint16_t app_port) {
         perror("ERROR on binding");
         abort();
     }
-    int connection_backlog = 1;
-    if (listen(app_serverfd, connection_backlog) < 0) {
+    if (listen(app_serverfd, WISH_PORT_LISTEN_BACKLOG) < 0) {
         perror("listen()");
     }
 
@@ -147,6 +171,35 @@ bool is_app_via_tcp(wish_core_t* core, const uint8_t wsid[WISH_WSID_LEN]) {
     return retval;
 }
 
+/* Write as much of the frame as the socket takes. Returns the number of
+ * bytes written, or -1 if the connection is lost. */
+static ssize_t app_socket_send(int i, const uint8_t *buf, size_t len) {
+#ifdef __APPLE__
+    ssize_t write_ret = send(app_fds[i], buf, len, SO_NOSIGPIPE);
+#else
+#ifdef _WIN32
+    ssize_t write_ret = send(app_fds[i], (const char *) buf, len, 0);
+#else
+    ssize_t write_ret = send(app_fds[i], buf, len, MSG_NOSIGNAL);
+#endif
+#endif
+    if (write_ret < 0) {
+        return socket_write_again() ? 0 : -1;
+    }
+    return write_ret;
+}
+
+static void app_tx_queue_clear(int i) {
+    struct app_tx_frame *frame = NULL;
+    struct app_tx_frame *tmp = NULL;
+    LL_FOREACH_SAFE(app_tx_queues[i], frame, tmp) {
+        LL_DELETE(app_tx_queues[i], frame);
+        free(frame->data);
+        free(frame);
+    }
+    app_tx_queued[i] = 0;
+}
+
 void send_core_to_app_via_tcp(wish_core_t* core, const uint8_t wsid[WISH_ID_LEN], const uint8_t *data, size_t len) {
     /* Find app index */
     int i = 0;
@@ -154,37 +207,115 @@ void send_core_to_app_via_tcp(wish_core_t* core, const uint8_t wsid[WISH_ID_LEN]
         if (memcmp(apps[i].wsid, wsid, WISH_ID_LEN) == 0) {
             /* Found our app connection */
             
-            uint16_t frame_len =  ((len & 0xff) << 8) | (len >> 8);
+            if (app_transport_states[i] == APP_TRANSPORT_CLOSING) {
+                /* The connection is closed in the main loop */
+                return;
+            }
+            
+            /* The frame length is big endian, 16 bits, or 32 bits for apps using large frames */
+            size_t header_len = app_large_frames[i] ? 4 : 2;
             
-            char* p = (char*)&frame_len;
-            //printf("Found app connection, going to send %lu bytes, setting frame len to 0x%02x%02x\n", len, p[0] & 0xff, p[1] & 0xff);
+            if (!app_large_frames[i] && len > 0xffff) {
+                printf("App connection: Message of len %zu does not fit in a frame, app does not support large frames\n", len);
+                return;
+            }
 
-            char buf_c[65535];
-            char* buf = buf_c;
+            if (app_tx_queued[i] + header_len + len > APP_TX_QUEUE_MAX) {
+                printf("App connection: App is not reading, %zu bytes queued, closing\n", app_tx_queued[i]);
+                app_transport_states[i] = APP_TRANSPORT_CLOSING;
+                return;
+            }
+
+            uint8_t* buf = malloc(header_len+len);
+            if (buf == NULL) {
+                printf("App connection: Could not allocate frame of len %zu, closing\n", len);
+                app_transport_states[i] = APP_TRANSPORT_CLOSING;
+                return;
+            }
             
-            memcpy(buf, p, 2);
-            memcpy(buf+2, data, len);
+            if (app_large_frames[i]) {
+                buf[0] = (len >> 24) & 0xff;
+                buf[1] = (len >> 16) & 0xff;
+                buf[2] = (len >> 8) & 0xff;
+                buf[3] = len & 0xff;
+            }
+            else {
+                buf[0] = (len >> 8) & 0xff;
+                buf[1] = len & 0xff;
+            }
+            memcpy(buf+header_len, data, len);
             
-#ifdef __APPLE__
-            ssize_t write_ret = send(app_fds[i], buf, 2+len, SO_NOSIGPIPE);
-#else
-#ifdef _WIN32
-            ssize_t write_ret = send(app_fds[i], buf, 2+len, 0);
-#else
-            ssize_t write_ret = send(app_fds[i], buf, 2+len, MSG_NOSIGNAL);
-#endif
-#endif
+            /* Write right away, unless earlier frames are waiting */
+            ssize_t sent = 0;
+            if (app_tx_queues[i] == NULL) {
+                sent = app_socket_send(i, buf, header_len+len);
+                if (sent < 0) {
+                    printf("App connection: Write error, closing\n");
+                    free(buf);
+                    app_transport_states[i] = APP_TRANSPORT_CLOSING;
+                    return;
+                }
+                if ((size_t) sent == header_len+len) {
+                    free(buf);
+                    return;
+                }
+            }
             
-            if (write_ret != 2+len) {
-                //printf("App connection: Write error! (c) Wanted %i got %zd\n", 2, write_ret);
-                //close(app_fds[i]);
+            /* Queue the rest of the frame, it is written when the socket is writable */
+            struct app_tx_frame *frame = malloc(sizeof(struct app_tx_frame));
+            if (frame == NULL) {
+                printf("App connection: Could not queue frame, closing\n");
+                free(buf);
+                app_transport_states[i] = APP_TRANSPORT_CLOSING;
                 return;
             }
+            frame->data = buf;
+            frame->len = header_len+len;
+            frame->sent = sent;
+            frame->next = NULL;
+            LL_APPEND(app_tx_queues[i], frame);
+            app_tx_queued[i] += frame->len - frame->sent;
+            return;
+        }
+    }
+}
+
+void app_connection_flush(wish_core_t* core, int i) {
+    while (app_tx_queues[i] != NULL) {
+        struct app_tx_frame *frame = app_tx_queues[i];
+        ssize_t sent = app_socket_send(i, frame->data + frame->sent, frame->len - frame->sent);
+        if (sent < 0) {
+            printf("App connection: Write error, closing\n");
+            app_tx_queue_clear(i);
+            app_transport_states[i] = APP_TRANSPORT_CLOSING;
             return;
         }
+        frame->sent += sent;
+        app_tx_queued[i] -= sent;
+        if (frame->sent < frame->len) {
+            /* The socket is full again */
+            return;
+        }
+        LL_DELETE(app_tx_queues[i], frame);
+        free(frame->data);
+        free(frame);
     }
 }
 
+bool app_connection_tx_pending(int i) {
+    return app_tx_queues[i] != NULL;
+}
+
+size_t app_connection_tx_queued(wish_core_t* core, const uint8_t wsid[WISH_WSID_LEN]) {
+    int i = 0;
+    for (i = 0; i < NUM_APP_CONNECTIONS; i++) {
+        if (app_states[i] == APP_CONNECTION_CONNECTED && memcmp(apps[i].wsid, wsid, WISH_WSID_LEN) == 0) {
+            return app_tx_queued[i];
+        }
+    }
+    return 0;
+}
+
 
 void app_connection_feed(wish_core_t* core, int i, uint8_t *buffer, size_t buffer_len) {
     //printf("Feeding %i bytes from app %i\n", (int) buffer_len, i);
@@ -205,15 +336,16 @@ again:
             ring_buffer_read(&app_rx_ring_bufs[i], preamble, 3);
             if (preamble[0] == 'W' 
                     && preamble[1] == '.' 
-                    && preamble[2] == 0x18) {
+                    && preamble[2] == APP_PREAMBLE_SECURE) {
                 printf("Error: App server secure handshake not implemented.\n");
                 app_transport_states[i] = APP_TRANSPORT_CLOSING;
                 break;
             }
             else if (preamble[0] == 'W' 
                     && preamble[1] == '.' 
-                    && preamble[2] == 0x19) {
+                    && (preamble[2] == APP_PREAMBLE_PLAIN || preamble[2] == APP_PREAMBLE_PLAIN_LARGE)) {
                 //printf("App server handshake OK\n");
+                app_large_frames[i] = (preamble[2] == APP_PREAMBLE_PLAIN_LARGE);
                 /* Handshake OK, FALLTHROUGH to next case */
                 app_transport_states[i] = APP_TRANSPORT_WAIT_FRAME_LEN;
             }
@@ -223,37 +355,65 @@ again:
             }
         }
         /* FALLTHROUGH */
-    case APP_TRANSPORT_WAIT_FRAME_LEN:
-        if (ring_buffer_length(&app_rx_ring_bufs[i]) >= 2) {
-            uint8_t len_bytes[2];
-            ring_buffer_read(&app_rx_ring_bufs[i], len_bytes, 2);
-            uint16_t expect_len = len_bytes[0] << 8 | len_bytes[1];
+    case APP_TRANSPORT_WAIT_FRAME_LEN: {
+        /* The frame length is big endian, 16 bits, or 32 bits for apps using large frames */
+        size_t header_len = app_large_frames[i] ? 4 : 2;
+        if (ring_buffer_length(&app_rx_ring_bufs[i]) >= header_len) {
+            uint8_t len_bytes[4];
+            ring_buffer_read(&app_rx_ring_bufs[i], len_bytes, header_len);
+            uint32_t expect_len = 0;
+            int j = 0;
+            for (j = 0; j < header_len; j++) {
+                expect_len = (expect_len << 8) | len_bytes[j];
+            }
             app_transport_expect_bytes[i] = expect_len;
             
             // skip frame payload if len is 0
             if (expect_len == 0) { goto again; }
             
-            app_transport_states[i] = APP_TRANSPORT_WAIT_PAYLOAD;
+            if (expect_len > WISH_PORT_MAX_MESSAGE_SZ) {
+                printf("app_server.c: Frame too large! %u (max: %i)\n", expect_len, WISH_PORT_MAX_MESSAGE_SZ);
+                app_transport_states[i] = APP_TRANSPORT_CLOSING;
+                break;
+            }
             
-            if (expect_len>APP_RX_RB_SZ) {
-                printf("app_server.c: Buffer too small! %i (expecting: %i)\n", APP_RX_RB_SZ, expect_len);
+            /* The frame is collected here, as it may be larger than the ring buffer */
+            app_rx_frames[i] = malloc(expect_len);
+            if (app_rx_frames[i] == NULL) {
+                printf("app_server.c: Could not allocate frame of len %u\n", expect_len);
+                app_transport_states[i] = APP_TRANSPORT_CLOSING;
+                break;
             }
+            app_rx_frame_lens[i] = 0;
             
-            if (ring_buffer_length(&app_rx_ring_bufs[i]) >= 
-                    app_transport_expect_bytes[i]) {
+            app_transport_states[i] = APP_TRANSPORT_WAIT_PAYLOAD;
+            
+            if (ring_buffer_length(&app_rx_ring_bufs[i]) > 0) {
                 goto again;
             }
         }
         break;
+    }
     case APP_TRANSPORT_WAIT_PAYLOAD: {
-        uint16_t expect_len = app_transport_expect_bytes[i];
-        if (ring_buffer_length(&app_rx_ring_bufs[i]) >= expect_len) {
-            uint8_t payload[expect_len];
-            uint16_t rb_read = ring_buffer_read(&app_rx_ring_bufs[i], payload, expect_len);
-            if (rb_read != expect_len) {
-                WISHDEBUG(LOG_CRITICAL, "rb_read mismatch, %i while expecting %i", rb_read, expect_len);
-                abort();
-            }
+        uint32_t expect_len = app_transport_expect_bytes[i];
+        uint8_t *payload = app_rx_frames[i];
+        
+        /* Move what is available of the frame from the ring buffer */
+        uint32_t missing_len = expect_len - app_rx_frame_lens[i];
+        uint16_t read_len = ring_buffer_length(&app_rx_ring_bufs[i]);
+        if (read_len > missing_len) {
+            read_len = missing_len;
+        }
+        uint16_t rb_read = ring_buffer_read(&app_rx_ring_bufs[i], payload + app_rx_frame_lens[i], read_len);
+        if (rb_read != read_len) {
+            WISHDEBUG(LOG_CRITICAL, "rb_read mismatch, %i while expecting %i", rb_read, read_len);
+            abort();
+        }
+        app_rx_frame_lens[i] += rb_read;
+        
+        if (app_rx_frame_lens[i] == expect_len) {
+            app_rx_frames[i] = NULL;
+            app_rx_frame_lens[i] = 0;
             app_transport_states[i] = APP_TRANSPORT_WAIT_FRAME_LEN;
             
             //printf("Received whole frame! len = %i\n", expect_len);
@@ -279,11 +439,13 @@ again:
             if ( bson_size(&bs) != expect_len ) {
                 WISHDEBUG(LOG_CRITICAL, "Payload size mismatch, %i while expecting %i", bson_size(&bs), expect_len);
                 app_transport_states[i] = APP_TRANSPORT_CLOSING;
+                free(payload);
                 break;
             }
 
             receive_app_to_core(core, apps[i].wsid, payload, expect_len);
-            if (ring_buffer_length(&app_rx_ring_bufs[i]) >= 2) {
+            free(payload);
+            if (ring_buffer_length(&app_rx_ring_bufs[i]) > 0) {
                 goto again;
             }
         }
@@ -311,8 +473,17 @@ void app_connection_cleanup(wish_core_t* core, int i) {
     app_states[i] = APP_CONNECTION_INITIAL;
     app_transport_states[i] = APP_TRANSPORT_INITIAL;
     app_login_complete[i] = false;
+    app_large_frames[i] = false;
     memset(apps[i].wsid, 0, WISH_ID_LEN);
 
+    /* Drop what was not written to the App */
+    app_tx_queue_clear(i);
+
+    /* Free a partially received frame */
+    free(app_rx_frames[i]);
+    app_rx_frames[i] = NULL;
+    app_rx_frame_lens[i] = 0;
+
     /* Empty the ring buffer so that no trashes are left */
     uint16_t len = ring_buffer_length(&app_rx_ring_bufs[i]);
     ring_buffer_skip(&app_rx_ring_bufs[i], len);
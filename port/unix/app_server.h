@@ -18,6 +18,17 @@
 
 #define APP_RX_RB_SZ 64*1024-1
 
+/* The most bytes queued for an App which does not read them; an App
+ * further behind than this is disconnected */
+#define APP_TX_QUEUE_MAX (2*WISH_PORT_MAX_MESSAGE_SZ)
+
+/* The third byte of the App connection preamble: the high nibble is the
+ * version, the low nibble the type of the App connection */
+#define APP_PREAMBLE_SECURE         0x18    /* Not implemented */
+#define APP_PREAMBLE_PLAIN          0x19    /* Frames have a 16-bit length */
+#define APP_PREAMBLE_PLAIN_LARGE    0x1A    /* Frames have a 32-bit length, 
+    for messages larger than 64 KiB (up to WISH_PORT_MAX_MESSAGE_SZ) */
+
 #include "wish_core.h"
 
 void setup_app_server(wish_core_t* core, uint16_t port);
@@ -39,3 +50,12 @@ void app_connection_cleanup(wish_core_t* core, int i);
 void send_core_to_app_via_tcp(wish_core_t* core, const uint8_t wsid[WISH_ID_LEN], const uint8_t *data, size_t len);
 
 bool is_app_via_tcp(wish_core_t* core, const uint8_t wsid[WISH_WSID_LEN]);
+
+/* Write what is queued for the App, when its socket is writable */
+void app_connection_flush(wish_core_t* core, int i);
+
+/* True if there are bytes queued for the App */
+bool app_connection_tx_pending(int i);
+
+/* The number of bytes sent to the App but not yet written to its socket */
+size_t app_connection_tx_queued(wish_core_t* core, const uint8_t wsid[WISH_WSID_LEN]);
@@ -0,0 +1,188 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+
+/* Startup benchmark: the time from start to a ready uid list
+ *
+ * Run in a directory of its own:
+ *
+ *   bench_startup create 10000   write an identity database of 10000 identities
+ *   bench_startup start          open the database and build the uid list, as
+ *                                wish_core_update_identities() does. The first
+ *                                open after create writes an index record.
+ *   bench_startup load           the same, and read every identity document,
+ *                                as the core did before it used the index
+ *
+ * Drop the page cache between runs to measure a cold start.
+ */
+#include "wish_port_config.h"
+#include "wish_debug.h"
+#include "wish_platform.h"
+#include "wish_identity_db.h"
+#include "bson.h"
+
+#include "fs_port.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* The number of identities written per batch */
+#define BENCH_BATCH 256
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void bench_identity(bson* bs, int n) {
+    uint8_t uid[WISH_ID_LEN];
+    uint8_t pubkey[WISH_PUBKEY_LEN];
+    char alias[32];
+    int i;
+
+    for (i = 0; i < WISH_ID_LEN; i++) {
+        uid[i] = wish_platform_rng();
+        pubkey[i] = wish_platform_rng();
+    }
+    snprintf(alias, sizeof(alias), "Contact %i", n);
+
+    bson_init(bs);
+    bson_append_string(bs, "alias", alias);
+    bson_append_binary(bs, "uid", (char*) uid, WISH_ID_LEN);
+    bson_append_binary(bs, "pubkey", (char*) pubkey, WISH_PUBKEY_LEN);
+    bson_append_start_array(bs, "hosts");
+    bson_append_finish_array(bs);
+    bson_append_start_array(bs, "transports");
+    bson_append_string(bs, "0", "wish://127.0.0.1:40000");
+    bson_append_finish_array(bs);
+    bson_finish(bs);
+}
+
+static int bench_create(int count) {
+    bson docs[BENCH_BATCH];
+    const uint8_t* data[BENCH_BATCH];
+    int written = 0;
+
+    wish_fs_remove(WISH_ID_DB_NAME);
+
+    if (!wish_identity_db_open()) {
+        printf("Could not create the identity database\n");
+        return 1;
+    }
+
+    while (written < count) {
+        int n = count - written < BENCH_BATCH ? count - written : BENCH_BATCH;
+        int i;
+
+        for (i = 0; i < n; i++) {
+            bench_identity(&docs[i], written + i);
+            data[i] = (const uint8_t*) bson_data(&docs[i]);
+        }
+
+        int ret = wish_identity_db_append_batch(data, n);
+
+        for (i = 0; i < n; i++) {
+            bson_destroy(&docs[i]);
+        }
+
+        if (ret != n) {
+            printf("Could not write identities\n");
+            return 1;
+        }
+
+        written += n;
+    }
+
+    if (wish_identity_db_sync()) {
+        printf("Could not sync the identity database\n");
+        return 1;
+    }
+
+    printf("Created %i identities\n", wish_identity_db_count());
+    return 0;
+}
+
+static int bench_start(bool load) {
+    double start = now_ms();
+
+    if (!wish_identity_db_open()) {
+        printf("Could not open the identity database\n");
+        return 1;
+    }
+
+    int count = wish_identity_db_count();
+    wish_uid_list_elem_t* list = malloc((count > 0 ? count : 1) * sizeof(wish_uid_list_elem_t));
+    if (list == NULL) {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    int i = 0;
+    wish_identity_db_entry_t* entry = NULL;
+    for (entry = wish_identity_db_first(); entry != NULL; entry = wish_identity_db_next(entry)) {
+        memcpy(list[i++].uid, entry->uid, WISH_ID_LEN);
+
+        if (load) {
+            uint8_t* doc = wish_identity_db_load(entry);
+            if (doc == NULL) {
+                printf("Could not load an identity\n");
+                return 1;
+            }
+            wish_platform_free(doc);
+        }
+    }
+
+    double ready = now_ms();
+
+    printf("Ready with %i identities in %.3f ms\n", i, ready - start);
+
+    free(list);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    wish_platform_set_malloc(malloc);
+    wish_platform_set_realloc(realloc);
+    wish_platform_set_free(free);
+
+    wish_platform_set_rng(random);
+    wish_platform_set_vprintf(vprintf);
+    wish_platform_set_vsprintf(vsprintf);
+
+    wish_fs_set_open(my_fs_open);
+    wish_fs_set_read(my_fs_read);
+    wish_fs_set_write(my_fs_write);
+    wish_fs_set_lseek(my_fs_lseek);
+    wish_fs_set_close(my_fs_close);
+    wish_fs_set_rename(my_fs_rename);
+    wish_fs_set_remove(my_fs_remove);
+    wish_fs_set_sync(my_fs_sync);
+    wish_fs_set_sync_dir(my_fs_sync_dir);
+    wish_fs_set_map(my_fs_map);
+    wish_fs_set_unmap(my_fs_unmap);
+
+    if (argc == 3 && strcmp(argv[1], "create") == 0) {
+        return bench_create(atoi(argv[2]));
+    } else if (argc == 2 && strcmp(argv[1], "start") == 0) {
+        return bench_start(false);
+    } else if (argc == 2 && strcmp(argv[1], "load") == 0) {
+        return bench_start(true);
+    }
+
+    printf("Usage: %s create <count> | start | load\n", argv[0]);
+    return 1;
+}
@@ -18,6 +18,13 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
 
 /* Unix port specific file I/O functions implemented using Posix sys
  * calls */
@@ -43,9 +50,90 @@ int32_t my_fs_close(wish_file_t fd) {
 }
 
 int32_t my_fs_rename(const char *oldpath, const char *newpath) {
+#ifdef _WIN32
+    /* rename() of the C library fails if newpath exists */
+    if (!MoveFileExA(oldpath, newpath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        return -1;
+    }
+    return 0;
+#else
     return rename(oldpath, newpath);
+#endif
 }
 
 int32_t my_fs_remove(const char *path) {
     return remove(path);
 }
+
+int32_t my_fs_sync(wish_file_t fd) {
+#ifdef _WIN32
+    return _commit(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
+int32_t my_fs_sync_dir(const char *path) {
+#ifdef _WIN32
+    /* The rename was written through */
+    return 0;
+#else
+    char dir[256];
+    const char* slash = strrchr(path, '/');
+    
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    }
+    else if (slash == path) {
+        strcpy(dir, "/");
+    }
+    else if ((size_t) (slash - path) < sizeof(dir)) {
+        memcpy(dir, path, slash - path);
+        dir[slash - path] = '\0';
+    }
+    else {
+        return -1;
+    }
+    
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+#endif
+}
+
+const void* my_fs_map(const char* path, size_t* len) {
+#ifdef _WIN32
+    return NULL;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    /* The mapping stays valid after closing the file */
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+
+    *len = st.st_size;
+    return addr;
+#endif
+}
+
+void my_fs_unmap(const void* addr, size_t len) {
+#ifndef _WIN32
+    munmap((void*) addr, len);
+#endif
+}
@@ -22,3 +22,7 @@ wish_offset_t my_fs_lseek(wish_file_t fd, wish_offset_t offset, int whence);
 int32_t my_fs_close(wish_file_t fd);
 int32_t my_fs_rename(const char *, const char *);
 int32_t my_fs_remove(const char *);
+int32_t my_fs_sync(wish_file_t fd);
+int32_t my_fs_sync_dir(const char *path);
+const void* my_fs_map(const char* path, size_t* len);
+void my_fs_unmap(const void* addr, size_t len);
@@ -8,9 +8,12 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "dns.h"
 #include "port_dns.h"
+#include "port_select.h"
 #include "port_relay_client.h"
 #include "wish_connection.h"
 #include "wish_connection_mgr.h"
@@ -102,13 +105,96 @@ error:
 	return 0;
 } /* dns_rr_addr_print() */
 
+#define PORT_DNS_QNAME_MAX 256
+
+/* An entry of the answer cache, shared by Wish connections and relay clients */
+struct port_dns_cache_entry {
+    char qname[PORT_DNS_QNAME_MAX];
+    /* True if the name does not exist or has no address */
+    bool negative;
+    wish_ip_addr_t ip;
+    /* The entry is valid until this time. 0 if the entry is unused */
+    time_t expires;
+};
+
+static struct port_dns_cache_entry dns_cache[WISH_PORT_DNS_CACHE_SZ];
+
+static struct wish_dns_cache_stats dns_cache_stats;
+
+/* Returns the valid cache entry for qname, or NULL */
+static struct port_dns_cache_entry *port_dns_cache_lookup(const char *qname) {
+    time_t now = time(NULL);
+    int i = 0;
+    for (i = 0; i < WISH_PORT_DNS_CACHE_SZ; i++) {
+        struct port_dns_cache_entry *entry = &dns_cache[i];
+        if (entry->expires == 0 || strncmp(entry->qname, qname, PORT_DNS_QNAME_MAX) != 0) {
+            continue;
+        }
+        if (entry->expires <= now) {
+            entry->expires = 0;
+            return NULL;
+        }
+        return entry;
+    }
+    return NULL;
+}
+
+/* Store an answer. The entry of the same name, an unused or expired
+ * entry, or else the entry closest to expiry is replaced. */
+static void port_dns_cache_store(const char *qname, bool negative, wish_ip_addr_t *ip, uint32_t ttl) {
+    if (ttl == 0 || strnlen(qname, PORT_DNS_QNAME_MAX) >= PORT_DNS_QNAME_MAX) {
+        return;
+    }
+
+    time_t now = time(NULL);
+    struct port_dns_cache_entry *victim = NULL;
+    int i = 0;
+    for (i = 0; i < WISH_PORT_DNS_CACHE_SZ; i++) {
+        struct port_dns_cache_entry *entry = &dns_cache[i];
+        if (entry->expires != 0 && strncmp(entry->qname, qname, PORT_DNS_QNAME_MAX) == 0) {
+            victim = entry;
+            break;
+        }
+        /* Unused entries have expires 0, so they are picked first */
+        if (victim == NULL || entry->expires < victim->expires) {
+            victim = entry;
+        }
+    }
+
+    memset(victim, 0, sizeof(struct port_dns_cache_entry));
+    strncpy(victim->qname, qname, PORT_DNS_QNAME_MAX - 1);
+    victim->negative = negative;
+    if (ip != NULL) {
+        memcpy(&victim->ip, ip, sizeof(wish_ip_addr_t));
+    }
+    victim->expires = now + ttl;
+}
+
+void port_dns_cache_get_stats(wish_core_t* core, struct wish_dns_cache_stats* stats) {
+    memcpy(stats, &dns_cache_stats, sizeof(struct wish_dns_cache_stats));
+    stats->entries = 0;
+
+    time_t now = time(NULL);
+    int i = 0;
+    for (i = 0; i < WISH_PORT_DNS_CACHE_SZ; i++) {
+        if (dns_cache[i].expires > now) {
+            stats->entries++;
+        }
+    }
+}
+
 /** This structure represents an on-going DNS resolving process of wish core.
  * Note that either wish_conn or relay client must always point to NULL */
 struct port_dns_resolver {
     struct dns_resolver *R;
+    /* The name being resolved, the answer is cached under this name */
+    char qname[PORT_DNS_QNAME_MAX];
     wish_connection_t* wish_conn; //If this is non-NULL then resolving is for a wish connection
     
     wish_relay_client_t *relay_client; //if this is non-NULL then resolving is for a relay client connection
+    /* The time when the resolver must be checked even if its socket is
+     * not ready, because the current query step times out. 0 means check now. */
+    time_t deadline;
     struct port_dns_resolver *next;
 };
 
@@ -144,34 +230,75 @@ static struct port_dns_resolver *port_dns_resolver_create(char *qname) {
     memset(port_resolver, 0, sizeof(struct port_dns_resolver));
     
     port_resolver->R = R;
+    strncpy(port_resolver->qname, qname, PORT_DNS_QNAME_MAX - 1);
     return port_resolver;
 }
 
-static void port_dns_resolver_signal_error(struct port_dns_resolver *resolver) {
-    if (resolver->wish_conn) {
+static void port_dns_signal_error(wish_connection_t *wish_conn, wish_relay_client_t *relay_client) {
+    if (wish_conn) {
         /* Note: Don't call wish_close_connection() here, as it will do (platform-dependent) things set up by wish_open_connection(), which has not been called in this case. */
-        wish_core_t *core = resolver->wish_conn->core;
-        if (resolver->wish_conn->context_state == WISH_CONTEXT_IN_MAKING) {
-            wish_core_signal_tcp_event(core, resolver->wish_conn, TCP_DISCONNECTED);
+        wish_core_t *core = wish_conn->core;
+        if (wish_conn->context_state == WISH_CONTEXT_IN_MAKING) {
+            wish_core_signal_tcp_event(core, wish_conn, TCP_DISCONNECTED);
         }
         else {
             /** Pre-condition fails. */
-            WISHDEBUG(LOG_CRITICAL, "Precondition fails; DNS resolving was in progress and failed, but the wish connection was not under connection phase. Resolver %p conn %p", resolver, resolver->wish_conn);
+            WISHDEBUG(LOG_CRITICAL, "Precondition fails; DNS resolving was in progress and failed, but the wish connection was not under connection phase. Conn %p", wish_conn);
             abort();
         }
     }
-    else if (resolver->relay_client) {
-        if (resolver->relay_client->curr_state == WISH_RELAY_CLIENT_RESOLVING) {
-            resolver->relay_client->curr_state = WISH_RELAY_CLIENT_WAIT_RECONNECT;
+    else if (relay_client) {
+        if (relay_client->curr_state == WISH_RELAY_CLIENT_RESOLVING) {
+            relay_client->curr_state = WISH_RELAY_CLIENT_WAIT_RECONNECT;
         }
         else {
             /** Pre-condition fails. */
-            WISHDEBUG(LOG_CRITICAL, "Precondition fails; DNS resolving was in progress and failed, but the relay client connection was not under connection phase. Resolver %p conn %p", resolver, resolver->relay_client);
+            WISHDEBUG(LOG_CRITICAL, "Precondition fails; DNS resolving was in progress and failed, but the relay client connection was not under connection phase. Relay client %p", relay_client);
             abort();
         }
     }
 }
 
+static void port_dns_resolver_signal_error(struct port_dns_resolver *resolver) {
+    port_dns_signal_error(resolver->wish_conn, resolver->relay_client);
+}
+
+/* Continue opening the connection (Wish connection or relay client) with the resolved address */
+static void port_dns_signal_resolved(wish_connection_t *wish_conn, wish_relay_client_t *relay_client, wish_ip_addr_t *ip) {
+    if (wish_conn) {
+        /* We were resolving for a normal wish connection.
+         * References to wish core, port and via relay are already initialized by wish_open_connection_dns */
+        wish_open_connection(wish_conn->core, wish_conn, ip, wish_conn->remote_port, wish_conn->via_relay);
+    }
+    else if (relay_client) {
+        /* We were resolving for a relay client connection */
+        port_relay_client_open(relay_client, ip);
+    }
+}
+
+/* Answer from the cache, if possible. Returns true if the name was
+ * found in the cache, and the connection was continued or failed. */
+static bool port_dns_cache_answer(const char *qname, wish_connection_t *wish_conn, wish_relay_client_t *relay_client) {
+    struct port_dns_cache_entry *entry = port_dns_cache_lookup(qname);
+    if (entry == NULL) {
+        dns_cache_stats.misses++;
+        return false;
+    }
+
+    if (entry->negative) {
+        dns_cache_stats.negative_hits++;
+        WISHDEBUG(LOG_CRITICAL, "Could not resolve the domain name %s (cached)", qname);
+        port_dns_signal_error(wish_conn, relay_client);
+    }
+    else {
+        dns_cache_stats.hits++;
+        /* Copy the address, as opening the connection may cause lookups which reuse the entry */
+        wish_ip_addr_t ip = entry->ip;
+        port_dns_signal_resolved(wish_conn, relay_client, &ip);
+    }
+    return true;
+}
+
 static void port_dns_resolver_delete(struct port_dns_resolver *resolver) {
     dns_res_close(resolver->R);
     LL_DELETE(resolver_list, resolver);
@@ -199,7 +326,10 @@ void port_dns_resolver_cancel_by_relay_client(wish_relay_client_t *rc) {
 }
 
 int port_dns_start_resolving_wish_conn(wish_connection_t *conn, char *qname) {
-    
+    if (port_dns_cache_answer(qname, conn, NULL)) {
+        return 0;
+    }
+
     struct port_dns_resolver *resolver = port_dns_resolver_create(qname);
     if (resolver != NULL) {
         resolver->wish_conn = conn;
@@ -226,6 +356,10 @@ int port_dns_start_resolving_wish_conn(wish_connection_t *conn, char *qname) {
 }
 
 int port_dns_start_resolving_relay_client(wish_relay_client_t *rc, char *qname) {
+    if (port_dns_cache_answer(qname, NULL, rc)) {
+        return 0;
+    }
+
     WISHDEBUG(LOG_CRITICAL, "Starting resolving %s (relay client)\n", qname);
     struct port_dns_resolver *resolver = port_dns_resolver_create(qname);
     if (resolver != NULL) {
@@ -241,6 +375,37 @@ int port_dns_start_resolving_relay_client(wish_relay_client_t *rc, char *qname)
     return 0;
 }
 
+void port_dns_select_resolvers(void) {
+    struct port_dns_resolver *resolver = NULL;
+
+    LL_FOREACH(resolver_list, resolver) {
+        int fd = dns_res_pollfd(resolver->R);
+        if (fd < 0) {
+            /* No query on the wire, the resolver is checked on every iteration */
+            continue;
+        }
+        short events = dns_res_events(resolver->R);
+        if (events & DNS_POLLIN) {
+            port_select_fd_set_readable(fd);
+        }
+        if (events & DNS_POLLOUT) {
+            port_select_fd_set_writable(fd);
+        }
+    }
+}
+
+/* Returns true if the resolver must be checked now */
+static bool port_dns_resolver_is_ready(struct port_dns_resolver *resolver) {
+    int fd = dns_res_pollfd(resolver->R);
+    if (fd < 0 || resolver->deadline == 0) {
+        return true;
+    }
+    if (port_select_fd_is_readable(fd) || port_select_fd_is_writable(fd)) {
+        return true;
+    }
+    return time(NULL) >= resolver->deadline;
+}
+
 int port_dns_poll_resolvers(void) {
     
     /* For each resolver in list of resolvers ... */
@@ -248,6 +413,12 @@ int port_dns_poll_resolvers(void) {
     
     LL_FOREACH_SAFE(resolver_list, resolver, tmp) {
         assert((resolver->wish_conn != NULL) ^ (resolver->relay_client != NULL));
+        if (!port_dns_resolver_is_ready(resolver) 
+                && dns_res_elapsed(resolver->R) <= (CONNECTION_DNS_RESOLVE_TIMEOUT)) {
+            /* Nothing to do for this resolver until its socket becomes ready */
+            continue;
+        }
+
         int error = dns_res_check(resolver->R);
     
         if (dns_res_elapsed(resolver->R) > (CONNECTION_DNS_RESOLVE_TIMEOUT)) {
@@ -257,10 +428,9 @@ int port_dns_poll_resolvers(void) {
             continue;
         }
         else if (error == EAGAIN) {
-            /* Continue polling */
-            /* FIXME: We should add the resolver's filedescriptor to the port's main select() call. 
-             * Now we might enter here for no reason at all, and on the other hand we could reduce latency if we immediately know when our DNS request needs handling */
-            //dns_res_poll(resolver->R, 1);
+            /* Waiting for the socket (see port_dns_select_resolvers()), or
+             * for the query step to time out so that it is retried */
+            resolver->deadline = time(NULL) + dns_res_timeout(resolver->R);
         }
         else if (error == 0) {
             /* Query finished */
@@ -273,6 +443,7 @@ int port_dns_poll_resolvers(void) {
             int len = 0;
             
             enum dns_rcode response_code = dns_p_rcode(ans);
+            bool resolved = false;
                         
             switch (response_code) {
                 case DNS_RC_NOERROR:
@@ -282,25 +453,14 @@ int port_dns_poll_resolvers(void) {
                             if ((len = dns_rr_addr_print(pretty, sizeof pretty, &rr, ans, &error))) {
                                 WISHDEBUG(LOG_CRITICAL, "Resolved to: %s (%p)", pretty, resolver);
                                 
+                                wish_ip_addr_t ip;
+                                wish_parse_transport_ip(pretty, 0, &ip);
+                                port_dns_cache_store(resolver->qname, false, &ip, 
+                                        rr.ttl < WISH_PORT_DNS_CACHE_MAX_TTL ? rr.ttl : WISH_PORT_DNS_CACHE_MAX_TTL);
+
                                 //Continue opening the connection with new info (connection or relay client)
-                                if (resolver->wish_conn) {
-                                    /* We were resolving for a normal wish connection */
-                                    wish_ip_addr_t ip;
-                                    wish_parse_transport_ip(pretty, 0, &ip);
-                                    
-                                    /* References to wish core, port and via relay are already initialized by wish_open_connection_dns */
-                                    wish_core_t *core = resolver->wish_conn->core;
-                                    uint16_t port = resolver->wish_conn->remote_port;
-                                    bool via_relay = resolver->wish_conn->via_relay;
-                                    
-                                    wish_open_connection(core, resolver->wish_conn, &ip, port, via_relay);
-                                }
-                                else if (resolver->relay_client) {
-                                    /* We were resolving for a relay client connection */
-                                    wish_ip_addr_t ip;
-                                    wish_parse_transport_ip(pretty, 0, &ip);
-                                    port_relay_client_open(resolver->relay_client, &ip);
-                                }                            
+                                port_dns_signal_resolved(resolver->wish_conn, resolver->relay_client, &ip);
+                                resolved = true;
                                 break; //while loop testing dns_rr_grep()
                             }
                             else {
@@ -310,11 +470,33 @@ int port_dns_poll_resolvers(void) {
                         }
 
                     }
-                    break;
-                case DNS_RC_NXDOMAIN:
+                    if (resolved) {
+                        break;
+                    }
+                    /* The name exists, but has no address: handle as NXDOMAIN */
+                    /* no break */
+                case DNS_RC_NXDOMAIN: {
+                    /* Cache the negative answer as long as the SOA record
+                     * of the zone in the authority section says: the
+                     * smaller of its TTL and its MINIMUM field (RFC 2308) */
+                    uint32_t ttl = WISH_PORT_DNS_NEGATIVE_TTL;
+                    struct dns_rr_i *soa_i = dns_rr_i_new(ans, .sort = 0);
+                    while (dns_rr_grep(&rr, 1, soa_i, ans, &error)) {
+                        struct dns_soa soa;
+                        if (rr.section == DNS_S_NS && rr.type == DNS_T_SOA && dns_soa_parse(&soa, &rr, ans) == 0) {
+                            ttl = rr.ttl < soa.minimum ? rr.ttl : soa.minimum;
+                            if (ttl > WISH_PORT_DNS_CACHE_MAX_TTL) {
+                                ttl = WISH_PORT_DNS_CACHE_MAX_TTL;
+                            }
+                            break;
+                        }
+                    }
+                    port_dns_cache_store(resolver->qname, true, NULL, ttl);
+
                     WISHDEBUG(LOG_CRITICAL, "Could not resolve the domain name (resolver %p)", resolver);
                     port_dns_resolver_signal_error(resolver);
                     break;
+                }
                 default:
                     WISHDEBUG(LOG_CRITICAL, "Unexpected DNS response code %i (resolver %p)", response_code, resolver);
                     port_dns_resolver_signal_error(resolver);
@@ -1,13 +1,45 @@
 #pragma once
 
 #include "wish_connection.h"
+#include "wish_connection_mgr.h"
+
+/* The number of host names in the DNS answer cache */
+#ifndef WISH_PORT_DNS_CACHE_SZ
+#define WISH_PORT_DNS_CACHE_SZ 32
+#endif
+
+/* The maximum time an address is cached, in seconds, even if the record's TTL is longer */
+#ifndef WISH_PORT_DNS_CACHE_MAX_TTL
+#define WISH_PORT_DNS_CACHE_MAX_TTL 3600
+#endif
+
+/* The time a "no such name" answer is cached, in seconds, if the answer
+ * does not carry the SOA record of the zone. With the SOA record, its
+ * TTL or MINIMUM field is used, up to WISH_PORT_DNS_CACHE_MAX_TTL. */
+#ifndef WISH_PORT_DNS_NEGATIVE_TTL
+#define WISH_PORT_DNS_NEGATIVE_TTL 60
+#endif
 
 int port_dns_start_resolving_wish_conn(wish_connection_t *conn, char *qname);
 
 int port_dns_start_resolving_relay_client(wish_relay_client_t *rc, char *qname);
 
+/**
+ * Add the sockets of the on-going resolvers to the file descriptor sets
+ * of the next port_select().
+ */
+void port_dns_select_resolvers(void);
+
+/**
+ * Advance the resolvers whose socket is ready after port_select(), or
+ * whose timeout has expired, and handle the finished ones. Must be
+ * called after port_select() and before port_select_reset().
+ */
 int port_dns_poll_resolvers(void);
 
 void port_dns_resolver_cancel_by_wish_connection(wish_connection_t *conn);
 
 void port_dns_resolver_cancel_by_relay_client(wish_relay_client_t *rc);
+
+/* Fill in the statistics of the answer cache, see wish_dns_cache_set_get_stats() */
+void port_dns_cache_get_stats(wish_core_t* core, struct wish_dns_cache_stats* stats);
@@ -50,10 +50,10 @@ void port_select_fd_set_writable(int fd) {
     update_max_fd(fd);
 }
 
-int port_select(void) {
+int port_select(uint32_t timeout_ms) {
     struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 100000;
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
     
     return select(max_fd, &rfds, &wfds, NULL, &tv); /* Note: exceptfds is NULL, because we do not expect to handle TCP out-of-band data from the sockets */
 }
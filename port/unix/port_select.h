@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdint.h>
+
 void port_select_reset(void);
 
 /** 
@@ -15,11 +17,11 @@ void port_select_fd_set_readable(int fd);
 void port_select_fd_set_writable(int fd);
 
 /**
- * Perform select, yeilding control the OS until something interesting happens with the watched file descriptors, or at most 100000 µs.
+ * Perform select, yeilding control the OS until something interesting happens with the watched file descriptors, or at most timeout_ms milliseconds.
  * @return The return value directly from select(). If greater than 0, something of interest happened, and you can use port_select_fd_is_readable() and port_select_fd_is_writable() to test the filedescriptors.
  * If return value is 0, then a timeout occurred before anything interesting happened. A return value less than 0 indicates an error, and the global errno is set.
  */
-int port_select(void);
+int port_select(uint32_t timeout_ms);
 
 /** 
  * Test if fd is readable (after select)
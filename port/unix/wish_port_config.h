@@ -23,20 +23,37 @@
  * */
 #define WISH_PORT_CONTEXT_POOL_SZ   512
 
+/** This specifies the listen backlog of the Wish server and App server
+ * ports, and the maximum number of connections accepted per event loop
+ * iteration */
+#define WISH_PORT_LISTEN_BACKLOG 64
+
+/** Define this to set SO_REUSEPORT on the listening sockets, so that
+ * several processes can share the Wish and App server ports */
+//#define WISH_PORT_WITH_REUSEPORT
+
+/** This specifies the maximum number of incoming connections in handshake at the same time */
+#define WISH_PORT_MAX_PENDING_HANDSHAKES 32
+
+/** This specifies the maximum number of incoming connections per source IP in 10 seconds */
+#define WISH_PORT_HANDSHAKE_RATE_PER_IP 10
+
 /** This specifies the maximum number of simultaneous app requests to core */
 #define WISH_PORT_APP_RPC_POOL_SZ ( 60 )
 
 /** This specifies the maximum size of the buffer where some RPC handlers build the reply (1400) */
 #define WISH_PORT_RPC_BUFFER_SZ ( 65*1024 )
 
+/** This specifies the maximum size of a message which is fragmented into several Wish frames, see wish_fragment.h */
+#define WISH_PORT_MAX_MESSAGE_SZ ( 4*1024*1024 )
+
+/** This specifies the maximum size of a batch of small messages which are coalesced into one Wish frame, see wish_batch.h (0 = disabled) */
+#define WISH_PORT_COALESCE_SZ ( 4*1024 )
+
 /** This defines the maximum number of entries in the Wish local discovery table (4).
  * You should make sure that in the worst case any message will fit into WISH_PORT_RPC_BUFFFER_SZ  */
 #define WISH_LOCAL_DISCOVERY_MAX ( 64 ) /* wld.list: 64 local discoveries should fit in 16k RPC buffer size */
 
-/** This defines the maximum number of uids in database (max number of identities + contacts) (4) 
-     You should make sure that in the worst case any message will fit into WISH_PORT_RPC_BUFFFER_SZ */
-#define WISH_PORT_MAX_UIDS ( 512 ) /* identity.list: 128 uid entries should fit into 16k RPC buffer */
-
 
 /** If this is defined, include support for the App TCP server */
 #define WITH_APP_TCP_SERVER
@@ -33,3 +33,11 @@ void send_core_to_app(wish_core_t* core, const uint8_t wsid[WISH_ID_LEN], const
 
 void core_service_ipc_init(wish_core_t* core);
 
+/* Set by ports which queue the data sent to apps: fn returns the number
+ * of bytes sent to the app wsid but not yet delivered to it */
+void core_service_ipc_set_queued(size_t (*fn)(wish_core_t* core, const uint8_t wsid[WISH_ID_LEN]));
+
+/* The number of bytes sent to the app wsid and not yet delivered, 0 if
+ * the port has not set a function for it */
+size_t core_service_ipc_queued(wish_core_t* core, const uint8_t wsid[WISH_ID_LEN]);
+
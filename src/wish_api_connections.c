@@ -12,6 +12,8 @@
  *
  * @license Apache-2.0
  */
+#include <string.h>
+
 #include "wish_api_connections.h"
 #include "wish_connection.h"
 #include "wish_connection_mgr.h"
@@ -286,6 +288,105 @@ void wish_api_connections_disconnect(rpc_server_req* req, const uint8_t* args) {
     }
 }
 
+/**
+ * connections.stats
+ * 
+ * Returns the frames and bytes sent on connection, per priority class,
+ * and the occupancy of the receive buffer:
+ * 
+ *     { control: { frames, bytes }, normal: { frames, bytes }, bulk: { frames, bytes },
+ *       rxBuffer: { used, size } }
+ * 
+ * @param req
+ * @param args [ id: number ]
+ */
+void wish_api_connections_stats(rpc_server_req* req, const uint8_t* args) {
+    wish_core_t* core = (wish_core_t*) req->server->context;
+    
+    wish_connection_t *db = wish_core_get_connection_pool(core);
+
+    bson_iterator it;
+    bson_find_from_buffer(&it, args, "0");
+    
+    if (bson_iterator_type(&it) != BSON_INT) {
+        rpc_server_error_msg(req, 343, "Invalid argument. Int index.");
+        return;
+    }
+
+    int idx = bson_iterator_int(&it);
+    
+    if (idx < 0 || idx >= WISH_CONTEXT_POOL_SZ || db[idx].context_state == WISH_CONTEXT_FREE) {
+        rpc_server_error_msg(req, 345, "No such connection.");
+        return;
+    }
+    
+    const char* class_names[WISH_TX_CLASSES] = { "control", "normal", "bulk" };
+
+    int buffer_len = 300;
+    uint8_t buffer[buffer_len];
+    
+    bson bs;
+    bson_init_buffer(&bs, buffer, buffer_len);
+    bson_append_start_object(&bs, "data");
+    
+    int i;
+    for (i = 0; i < WISH_TX_CLASSES; i++) {
+        bson_append_start_object(&bs, class_names[i]);
+        bson_append_long(&bs, "frames", (int64_t) db[idx].tx_stats[i].frames);
+        bson_append_long(&bs, "bytes", (int64_t) db[idx].tx_stats[i].bytes);
+        bson_append_finish_object(&bs);
+    }
+    
+    bson_append_start_object(&bs, "rxBuffer");
+    bson_append_int(&bs, "used", wish_core_get_rx_buffer_used(core, &db[idx]));
+    bson_append_int(&bs, "size", RX_RINGBUF_LEN);
+    bson_append_finish_object(&bs);
+    
+    bson_append_finish_object(&bs);
+    bson_finish(&bs);
+
+    if (bs.err) {
+        rpc_server_error_msg(req, 344, "Failed writing reponse.");
+        return;
+    }
+    
+    rpc_server_send(req, bson_data(&bs), bson_size(&bs));
+}
+
+/**
+ * connections.dnsCache
+ * 
+ * @param req
+ * @param args
+ */
+void wish_api_connections_dns_cache(rpc_server_req* req, const uint8_t* args) {
+    wish_core_t* core = (wish_core_t*) req->server->context;
+    
+    struct wish_dns_cache_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    wish_dns_cache_get_stats(core, &stats);
+
+    int buffer_len = 128;
+    uint8_t buffer[buffer_len];
+    
+    bson bs;
+    bson_init_buffer(&bs, buffer, buffer_len);
+    bson_append_start_object(&bs, "data");
+    bson_append_int(&bs, "entries", stats.entries);
+    bson_append_int(&bs, "hits", stats.hits);
+    bson_append_int(&bs, "negativeHits", stats.negative_hits);
+    bson_append_int(&bs, "misses", stats.misses);
+    bson_append_finish_object(&bs);
+    bson_finish(&bs);
+
+    if (bs.err) {
+        rpc_server_error_msg(req, 344, "Failed writing reponse.");
+        return;
+    }
+    
+    rpc_server_send(req, bson_data(&bs), bson_size(&bs));
+}
+
 /**
  * connections.disconnectAll
  * 
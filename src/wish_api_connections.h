@@ -32,6 +32,10 @@ extern "C" {
 
     void wish_api_connections_disconnect_all(rpc_server_req* req, const uint8_t* args);
     
+    void wish_api_connections_stats(rpc_server_req* req, const uint8_t* args);
+    
+    void wish_api_connections_dns_cache(rpc_server_req* req, const uint8_t* args);
+    
     void wish_api_connections_check_connections(rpc_server_req* req, const uint8_t* args);
 
     void wish_api_connections_apps(rpc_server_req* req, const uint8_t* args);
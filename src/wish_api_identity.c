@@ -23,6 +23,9 @@
 #include "core_service_ipc.h"
 #include "wish_relationship.h"
 #include "wish_dispatcher.h"
+#include "wish_commit.h"
+#include "wish_identity_db.h"
+#include "wish_time.h"
 #include "wish_platform.h"
 #include "wish_debug.h"
 #include "string.h"
@@ -30,6 +33,81 @@
 #include "bson_visit.h"
 
 
+/* A request whose reply is sent when the identity database has been committed */
+struct identity_commit_reply {
+    rpc_server_req req;
+    /* If true, data is the arguments of identity.get, which produces the reply */
+    bool get;
+    int data_len;
+    uint8_t data[];
+};
+
+/* Returns false if the app or the remote core which sent the request is gone */
+static bool identity_req_alive(wish_core_t* core, rpc_server_req* req) {
+    if (wish_service_exists(core, req->context) != NULL) {
+        return true;
+    }
+    
+    if (wish_connection_is_from_pool(core, req->ctx) != NULL) {
+        wish_connection_t *conn = req->ctx;
+        if (!wish_core_is_connected_luid_ruid(core, conn->luid, conn->ruid)) {
+            WISHDEBUG(LOG_CRITICAL, "Will not send, connection gone");
+            return false;
+        }
+        return true;
+    }
+    
+    WISHDEBUG(LOG_CRITICAL, "Will not send, req->ctx is not a connection from the core's pool");
+    return false;
+}
+
+static void identity_commit_cb(wish_core_t* core, void* cb_ctx, bool success) {
+    struct identity_commit_reply* reply = cb_ctx;
+    
+    if (!identity_req_alive(core, &reply->req)) {
+        /* Nobody to reply to */
+    } else if (!success) {
+        rpc_server_error_msg(&reply->req, 346, "Failed writing identity database.");
+    } else if (reply->get) {
+        wish_api_identity_get(&reply->req, reply->data);
+    } else {
+        rpc_server_send(&reply->req, reply->data, reply->data_len);
+    }
+    
+    wish_platform_free(reply);
+}
+
+/**
+ * Reply to req when the identities written by it are committed to the
+ * database, together with other writes made meanwhile (see wish_commit.h).
+ *
+ * @param get if true, data is the arguments for identity.get, which is
+ * run to produce the reply; otherwise data is the reply
+ */
+static void identity_reply_on_commit(wish_core_t* core, rpc_server_req* req, bool get, const uint8_t* data, int data_len) {
+    struct identity_commit_reply* reply = wish_platform_malloc(sizeof(struct identity_commit_reply) + data_len);
+    
+    if (reply == NULL) {
+        /* Reply right away, the write is committed later anyway */
+        WISHDEBUG(LOG_CRITICAL, "Memory allocation fail for commit reply");
+        if (get) {
+            wish_api_identity_get(req, data);
+        } else {
+            rpc_server_send(req, data, data_len);
+        }
+        wish_commit_request(core, WISH_COMMIT_IDENTITIES, NULL, NULL);
+        return;
+    }
+    
+    /* Copy the RPC request context, as the reply is sent later */
+    memcpy(&(reply->req), req, sizeof (rpc_server_req));
+    reply->get = get;
+    reply->data_len = data_len;
+    memcpy(reply->data, data, data_len);
+    
+    wish_commit_request(core, WISH_COMMIT_IDENTITIES, identity_commit_cb, reply);
+}
+
 /* This is the Call-back function invoked by the core's "app" RPC
  * server, when identity.export is received from a Wish app 
  *
@@ -107,6 +185,8 @@ void wish_api_identity_export(rpc_server_req* req, const uint8_t* args) {
  *       pubkey: Buffer(32)
  */
 void wish_api_identity_import(rpc_server_req* req, const uint8_t* args) {
+    wish_core_t* core = (wish_core_t*) req->server->context;
+    
     WISHDEBUG(LOG_DEBUG, "Core app RPC: identity_import");
 
     
@@ -167,7 +247,564 @@ void wish_api_identity_import(rpc_server_req* req, const uint8_t* args) {
     bson_append_finish_object(&bs);
     bson_finish(&bs);
     
-    rpc_server_send(req, bson_data(&bs), bson_size(&bs));
+    identity_reply_on_commit(core, req, false, bson_data(&bs), bson_size(&bs));
+}
+
+/* Returns true if every signature in the array it was made over data by
+ * the identity id itself, or by an identity in the database */
+static bool identity_import_signatures_valid(wish_core_t* core, wish_identity_t* id, const bin* data, bson_iterator* signatures) {
+    bson_iterator sit;
+    bson_iterator_subiterator(signatures, &sit);
+    
+    while (bson_iterator_next(&sit) != BSON_EOO) {
+        if (bson_iterator_type(&sit) != BSON_OBJECT) {
+            return false;
+        }
+        
+        bson sig;
+        bson_iterator_subobject(&sit, &sig);
+        
+        bson_iterator fit;
+        if (bson_find(&fit, &sig, "uid") != BSON_BINDATA || bson_iterator_bin_len(&fit) != WISH_UID_LEN) {
+            return false;
+        }
+        const uint8_t* signer_uid = (const uint8_t*) bson_iterator_bin_data(&fit);
+        
+        if (bson_find(&fit, &sig, "sign") != BSON_BINDATA || bson_iterator_bin_len(&fit) != WISH_SIGNATURE_LEN) {
+            return false;
+        }
+        bin signature = { .base = (char*) bson_iterator_bin_data(&fit), .len = bson_iterator_bin_len(&fit) };
+        
+        bin claim;
+        memset(&claim, 0, sizeof(bin));
+        if (bson_find(&fit, &sig, "claim") == BSON_BINDATA) {
+            claim.base = (char*) bson_iterator_bin_data(&fit);
+            claim.len = bson_iterator_bin_len(&fit);
+        }
+        
+        return_t ret = RET_FAIL;
+        
+        if (memcmp(signer_uid, id->uid, WISH_UID_LEN) == 0) {
+            ret = wish_identity_verify(core, id, data, &claim, &signature);
+        } else {
+            wish_identity_t signer;
+            if (wish_identity_load(signer_uid, &signer) == RET_SUCCESS) {
+                ret = wish_identity_verify(core, &signer, data, &claim, &signature);
+            }
+            wish_identity_destroy(&signer);
+        }
+        
+        if (ret != RET_SUCCESS) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+/* Read and verify one document of identity.importBatch. Returns 0 if the identity can be imported, or an error code */
+static int identity_import_batch_item(wish_core_t* core, bson_iterator* item, wish_identity_t* id) {
+    memset(id, 0, sizeof(wish_identity_t));
+    
+    bin data;
+    bson_iterator signatures;
+    bool signed_doc = false;
+    
+    if (bson_iterator_type(item) == BSON_BINDATA) {
+        data.base = (char*) bson_iterator_bin_data(item);
+        data.len = bson_iterator_bin_len(item);
+    } else if (bson_iterator_type(item) == BSON_OBJECT) {
+        bson cert;
+        bson_iterator_subobject(item, &cert);
+        
+        bson_iterator dit;
+        if (bson_find(&dit, &cert, "data") != BSON_BINDATA) {
+            return 76;
+        }
+        data.base = (char*) bson_iterator_bin_data(&dit);
+        data.len = bson_iterator_bin_len(&dit);
+        
+        if (bson_find(&signatures, &cert, "signatures") == BSON_ARRAY) {
+            signed_doc = true;
+        }
+    } else {
+        return 76;
+    }
+    
+    if (data.len < 5 || bson_size2(data.base) != data.len) {
+        return 76;
+    }
+    
+    bson doc;
+    bson_init_with_data(&doc, data.base);
+    
+    if (wish_identity_from_bson(id, &doc)) {
+        return 76;
+    }
+    
+    if (wish_identity_exists(id->uid) > 0) {
+        return 202;
+    }
+    
+    if (signed_doc && !identity_import_signatures_valid(core, id, &data, &signatures)) {
+        return 347;
+    }
+    
+    return 0;
+}
+
+static const char* identity_import_batch_error(int err) {
+    switch (err) {
+        case 76:
+            return "Expected Buffer, or { data: Buffer, signatures?: [...] }, containing an identity document.";
+        case 202:
+            return "Identity already exists.";
+        case 347:
+            return "Signature not valid.";
+        default:
+            return "Import failed.";
+    }
+}
+
+/**
+ * identity.importBatch
+ *
+ * App to core: { op: "identity.importBatch", args: [ [ Buffer | { data: Buffer, signatures?: Signature[] }, ... ] ], id: 5 }
+ * Response core to App:
+ *  { ack: 5, data: [ { alias: String, uid: Buffer(32) } | { err: Int, msg: String }, ... ] }
+ *
+ * Each element is a document as accepted by identity.import, or a
+ * document signed with identity.sign. Signed documents are imported
+ * only if every signature is valid, the signer being the identity
+ * itself or an identity already in the database. All documents are
+ * verified first, then the valid ones are saved with a single write,
+ * and the reply is sent when they are committed.
+ */
+void wish_api_identity_import_batch(rpc_server_req* req, const uint8_t* args) {
+    wish_core_t* core = (wish_core_t*) req->server->context;
+    
+    bson_iterator it;
+    if (bson_find_from_buffer(&it, args, "0") != BSON_ARRAY) {
+        rpc_server_error_msg(req, 76, "Expected argument 1 to be an array of documents.");
+        return;
+    }
+    
+    bson_iterator items;
+    int count = 0;
+    bson_iterator_subiterator(&it, &items);
+    while (bson_iterator_next(&items) != BSON_EOO) {
+        count++;
+    }
+    
+    if (count == 0) {
+        rpc_server_error_msg(req, 76, "Expected argument 1 to be an array of documents.");
+        return;
+    }
+    
+    wish_identity_t* ids = wish_platform_malloc(count * sizeof(wish_identity_t));
+    wish_identity_t* to_save = wish_platform_malloc(count * sizeof(wish_identity_t));
+    /* The error code of each document, 0 for the ones to save */
+    int* errors = wish_platform_malloc(count * sizeof(int));
+    
+    if (ids == NULL || to_save == NULL || errors == NULL) {
+        if (ids != NULL) { wish_platform_free(ids); }
+        if (to_save != NULL) { wish_platform_free(to_save); }
+        if (errors != NULL) { wish_platform_free(errors); }
+        rpc_server_error_msg(req, 344, "Out of memory");
+        return;
+    }
+    
+    int num_ok = 0;
+    int i = 0;
+    bson_iterator_subiterator(&it, &items);
+    for (i = 0; i < count && bson_iterator_next(&items) != BSON_EOO; i++) {
+        errors[i] = identity_import_batch_item(core, &items, &ids[i]);
+        
+        if (errors[i] == 0) {
+            /* The same identity twice in the batch */
+            int j = 0;
+            for (j = 0; j < num_ok; j++) {
+                if (memcmp(to_save[j].uid, ids[i].uid, WISH_UID_LEN) == 0) {
+                    errors[i] = 202;
+                    break;
+                }
+            }
+        }
+        
+        if (errors[i] == 0) {
+            /* A shallow copy, the identities are destroyed through ids */
+            memcpy(&to_save[num_ok++], &ids[i], sizeof(wish_identity_t));
+        }
+    }
+    
+    int ret = wish_save_identity_entries(to_save, num_ok);
+    wish_platform_free(to_save);
+    
+    bson bs;
+    bson_init(&bs);
+    bson_append_start_array(&bs, "data");
+    
+    for (i = 0; i < count; i++) {
+        char index[21];
+        BSON_NUMSTR(index, i);
+        bson_append_start_object(&bs, index);
+        if (errors[i] == 0) {
+            bson_append_string(&bs, "alias", ids[i].alias);
+            bson_append_binary(&bs, "uid", ids[i].uid, WISH_UID_LEN);
+        } else {
+            bson_append_int(&bs, "err", errors[i]);
+            bson_append_string(&bs, "msg", identity_import_batch_error(errors[i]));
+        }
+        bson_append_finish_object(&bs);
+        
+        wish_identity_destroy(&ids[i]);
+    }
+    
+    bson_append_finish_array(&bs);
+    bson_finish(&bs);
+    
+    wish_platform_free(ids);
+    wish_platform_free(errors);
+    
+    if (ret != 0) {
+        WISHDEBUG(LOG_CRITICAL, "wish_save_identity_entries return other than success (0): %d", ret);
+        rpc_server_error_msg(req, 346, "Failed writing identity database.");
+    } else if (bs.err) {
+        rpc_server_error_msg(req, 344, "Failed writing reponse.");
+    } else if (num_ok == 0) {
+        rpc_server_send(req, bson_data(&bs), bson_size(&bs));
+    } else {
+        identity_reply_on_commit(core, req, false, bson_data(&bs), bson_size(&bs));
+    }
+    
+    bson_destroy(&bs);
+    
+    if (ret == 0 && num_ok > 0) {
+        wish_core_update_identities(core);
+        wish_core_signals_emit_string(core, "identity");
+    }
+}
+
+/**
+ * identity.exportBatch
+ *
+ * App to core: { op: "identity.exportBatch", args: [ [ Buffer(32) uid, ... ] ], id: 5 }
+ * Response core to App:
+ *  { ack: 5, data: [ Document | null, ... ] }
+ *
+ * Each document is as returned by identity.export, null for a uid which
+ * is not in the database. Without arguments, all identities are
+ * exported. The reply grows with the export, as identity.list does.
+ */
+void wish_api_identity_export_batch(rpc_server_req* req, const uint8_t* args) {
+    wish_core_t* core = (wish_core_t*) req->server->context;
+    
+    wish_uid_list_elem_t* uid_list = NULL;
+    int num_uids = 0;
+    
+    bson_iterator it;
+    bson_type type = bson_find_from_buffer(&it, args, "0");
+    
+    if (type == BSON_ARRAY) {
+        bson_iterator uit;
+        bson_iterator_subiterator(&it, &uit);
+        while (bson_iterator_next(&uit) != BSON_EOO) {
+            if (bson_iterator_type(&uit) != BSON_BINDATA || bson_iterator_bin_len(&uit) != WISH_UID_LEN) {
+                rpc_server_error_msg(req, 8, "Expected argument 1 to be an array of Buffer(32)");
+                return;
+            }
+            num_uids++;
+        }
+        
+        if (num_uids > 0) {
+            uid_list = wish_platform_malloc(num_uids * sizeof(wish_uid_list_elem_t));
+            if (uid_list == NULL) {
+                rpc_server_error_msg(req, 344, "Out of memory");
+                return;
+            }
+        }
+        
+        int i = 0;
+        bson_iterator_subiterator(&it, &uit);
+        while (bson_iterator_next(&uit) != BSON_EOO && i < num_uids) {
+            memcpy(uid_list[i++].uid, bson_iterator_bin_data(&uit), WISH_UID_LEN);
+        }
+    } else if (type == BSON_EOO) {
+        num_uids = wish_load_uid_list_alloc(&uid_list);
+        if (num_uids < 0) {
+            rpc_server_error_msg(req, 997, "Could not load identity list");
+            return;
+        }
+    } else {
+        rpc_server_error_msg(req, 8, "Expected argument 1 to be an array of Buffer(32)");
+        return;
+    }
+    
+    bson bs;
+    bson_init(&bs);
+    bson_append_start_array(&bs, "data");
+    
+    int i = 0;
+    for (i = 0; i < num_uids && !bs.err; i++) {
+        char index[21];
+        BSON_NUMSTR(index, i);
+        
+        wish_identity_t id;
+        
+        if ( RET_SUCCESS != wish_identity_load(uid_list[i].uid, &id) ) {
+            wish_identity_destroy(&id);
+            bson_append_null(&bs, index);
+            continue;
+        }
+        
+        char export_buf[2048];
+        bin export = { .base = export_buf, .len = sizeof(export_buf) };
+        
+        return_t ret = wish_identity_export(core, &id, NULL, &export);
+        wish_identity_destroy(&id);
+        
+        if (ret != RET_SUCCESS) {
+            bson_append_null(&bs, index);
+            continue;
+        }
+        
+        bson doc;
+        bson_init_with_data(&doc, export.base);
+        bson_append_bson(&bs, index, &doc);
+    }
+    
+    bson_append_finish_array(&bs);
+    bson_finish(&bs);
+    
+    if (uid_list != NULL) {
+        wish_platform_free(uid_list);
+    }
+    
+    if (bs.err) {
+        WISHDEBUG(LOG_CRITICAL, "BSON error in identity.exportBatch");
+        rpc_server_error_msg(req, 344, "Failed writing reponse.");
+    } else {
+        rpc_server_send(req, bson_data(&bs), bson_size(&bs));
+    }
+    
+    bson_destroy(&bs);
+}
+
+/* The fields of identity.list results. All but alias are in the index of the identity database. */
+#define IDENTITY_FIELD_UID 1
+#define IDENTITY_FIELD_ALIAS 2
+#define IDENTITY_FIELD_PRIVKEY 4
+#define IDENTITY_FIELD_PUBKEY 8
+#define IDENTITY_FIELDS_DEFAULT (IDENTITY_FIELD_UID | IDENTITY_FIELD_ALIAS | IDENTITY_FIELD_PRIVKEY)
+
+/* Space left in a page of identity.list for the rest of the reply */
+#define IDENTITY_LIST_PAGE_MARGIN 1024
+
+/* A streaming identity.list, which emits a page per timer tick */
+struct identity_list_stream {
+    rpc_server_req req;
+    /* The uid of the last identity emitted */
+    uint8_t cursor[WISH_UID_LEN];
+    bool started;
+    int limit;
+    int fields;
+    int count;
+};
+
+/* Returns the IDENTITY_FIELD_* flags of an array of field names, or -1 for an unknown field */
+static int identity_list_fields(bson_iterator* it) {
+    int fields = 0;
+    bson_iterator fit;
+    bson_iterator_subiterator(it, &fit);
+    
+    while (bson_iterator_next(&fit) != BSON_EOO) {
+        if (bson_iterator_type(&fit) != BSON_STRING) {
+            return -1;
+        }
+        const char* field = bson_iterator_string(&fit);
+        
+        if (strcmp(field, "uid") == 0) {
+            fields |= IDENTITY_FIELD_UID;
+        } else if (strcmp(field, "alias") == 0) {
+            fields |= IDENTITY_FIELD_ALIAS;
+        } else if (strcmp(field, "privkey") == 0) {
+            fields |= IDENTITY_FIELD_PRIVKEY;
+        } else if (strcmp(field, "pubkey") == 0) {
+            fields |= IDENTITY_FIELD_PUBKEY;
+        } else {
+            return -1;
+        }
+    }
+    
+    return fields;
+}
+
+/* Append the fields of an identity as element key of bs. Only alias needs loading the identity. */
+static bool identity_list_append(bson* bs, const char* key, const wish_identity_db_entry_t* entry, int fields) {
+    wish_identity_t identity;
+    memset(&identity, 0, sizeof(wish_identity_t));
+    
+    if (fields & IDENTITY_FIELD_ALIAS) {
+        if ( RET_SUCCESS != wish_identity_load(entry->uid, &identity) ) {
+            WISHDEBUG(LOG_CRITICAL, "Could not load identity");
+            wish_identity_destroy(&identity);
+            return false;
+        }
+    }
+    
+    bson_append_start_object(bs, key);
+    if (fields & IDENTITY_FIELD_UID) {
+        bson_append_binary(bs, "uid", entry->uid, WISH_UID_LEN);
+    }
+    if (fields & IDENTITY_FIELD_ALIAS) {
+        bson_append_string(bs, "alias", identity.alias);
+    }
+    if (fields & IDENTITY_FIELD_PRIVKEY) {
+        bson_append_bool(bs, "privkey", entry->has_privkey);
+    }
+    if (fields & IDENTITY_FIELD_PUBKEY) {
+        bson_append_binary(bs, "pubkey", entry->pubkey, WISH_PUBKEY_LEN);
+    }
+    bson_append_finish_object(bs);
+    
+    wish_identity_destroy(&identity);
+    return true;
+}
+
+/**
+ * Append identities to the array being built in bs, from entry on, at
+ * most limit of them and as many as fit in an RPC reply.
+ *
+ * @return the entry after the last one appended, or NULL at the end of the list
+ */
+static wish_identity_db_entry_t* identity_list_page(bson* bs, wish_identity_db_entry_t* entry, int limit, int fields, int* count) {
+    int i = 0;
+    
+    while (entry != NULL && i < limit) {
+        if (i > 0 && bson_size(bs) > WISH_PORT_RPC_BUFFER_SZ - IDENTITY_LIST_PAGE_MARGIN) {
+            break;
+        }
+        
+        char index[21];
+        BSON_NUMSTR(index, i);
+        
+        if (identity_list_append(bs, index, entry, fields)) {
+            i++;
+        }
+        
+        entry = wish_identity_db_next(entry);
+    }
+    
+    *count = i;
+    return entry;
+}
+
+/* Returns the first entry after the cursor uid, or the first entry if there is no cursor */
+static bool identity_list_resume(const uint8_t* cursor, wish_identity_db_entry_t** entry) {
+    if (cursor == NULL) {
+        *entry = wish_identity_db_first();
+        return true;
+    }
+    
+    wish_identity_db_entry_t* last = wish_identity_db_find(cursor);
+    if (last == NULL) {
+        /* The identity at the cursor has been removed */
+        return false;
+    }
+    
+    *entry = wish_identity_db_next(last);
+    return true;
+}
+
+/* The milliseconds between checks whether the requester of a streaming identity.list has read the pages */
+#define IDENTITY_LIST_STREAM_WAIT_MS 10
+
+/* The number of bytes sent to the requester, an app or a remote core, but not yet delivered */
+static size_t identity_req_queued(wish_core_t* core, rpc_server_req* req) {
+    wish_app_entry_t* app = wish_service_exists(core, req->context);
+    if (app != NULL) {
+        return core_service_ipc_queued(core, app->wsid);
+    }
+    
+    wish_connection_t* conn = wish_connection_is_from_pool(core, req->ctx);
+    if (conn != NULL) {
+        return wish_connection_tx_buffered(conn, NULL);
+    }
+    return 0;
+}
+
+static void identity_list_stream_cb(wish_core_t* core, void* cb_ctx) {
+    struct identity_list_stream* stream = cb_ctx;
+    
+    if (!identity_req_alive(core, &stream->req)) {
+        wish_platform_free(stream);
+        return;
+    }
+    
+    if (identity_req_queued(core, &stream->req) > WISH_PORT_IDENTITY_LIST_STREAM_QUEUED) {
+        /* The earlier pages have not been read yet */
+        if (wish_core_time_set_timeout_ms(core, identity_list_stream_cb, stream, IDENTITY_LIST_STREAM_WAIT_MS).node == NULL) {
+            rpc_server_error_msg(&stream->req, 997, "Could not schedule the next page");
+            wish_platform_free(stream);
+        }
+        return;
+    }
+    
+    wish_identity_db_entry_t* entry = NULL;
+    
+    if (!wish_identity_db_open() || !identity_list_resume(stream->started ? stream->cursor : NULL, &entry)) {
+        rpc_server_error_msg(&stream->req, 348, "The identity list changed, list again.");
+        wish_platform_free(stream);
+        return;
+    }
+    
+    if (entry == NULL) {
+        /* The end of the list: the final reply is the number of identities */
+        uint8_t buf[64];
+        bson bs;
+        bson_init_buffer(&bs, buf, sizeof(buf));
+        bson_append_int(&bs, "data", stream->count);
+        bson_finish(&bs);
+        rpc_server_send(&stream->req, bson_data(&bs), bson_size(&bs));
+        wish_platform_free(stream);
+        return;
+    }
+    
+    bson bs;
+    bson_init(&bs);
+    bson_append_start_array(&bs, "data");
+    
+    int count = 0;
+    wish_identity_db_entry_t* next = identity_list_page(&bs, entry, stream->limit, stream->fields, &count);
+    
+    bson_append_finish_array(&bs);
+    bson_finish(&bs);
+    
+    if (bs.err) {
+        rpc_server_error_msg(&stream->req, 997, "BSON error in identity_list_handler");
+        bson_destroy(&bs);
+        wish_platform_free(stream);
+        return;
+    }
+    
+    rpc_server_emit(&stream->req, bson_data(&bs), bson_size(&bs));
+    bson_destroy(&bs);
+    
+    /* Remember the last identity of the page */
+    wish_identity_db_entry_t* last = entry;
+    while (last != NULL && wish_identity_db_next(last) != next) {
+        last = wish_identity_db_next(last);
+    }
+    if (last != NULL) {
+        memcpy(stream->cursor, last->uid, WISH_UID_LEN);
+    }
+    stream->started = true;
+    stream->count += count;
+    
+    if (wish_core_time_set_timeout_ms(core, identity_list_stream_cb, stream, 1).node == NULL) {
+        rpc_server_error_msg(&stream->req, 997, "Could not schedule the next page");
+        wish_platform_free(stream);
+    }
 }
 
 /* This is the Call-back function invoked by the core's "app" RPC
@@ -188,42 +825,146 @@ void wish_api_identity_import(rpc_server_req* req, const uint8_t* args) {
  *
  *       ]
  *
+ *  With options, the list is returned in pages:
+ *
+ *  identity.list({ limit?: number, cursor?: Buffer(32), fields?: string[], stream?: boolean })
+ *  Core to app: { ack: 2, data: { list: [ ... ], cursor?: Buffer(32) } }
+ *
+ *  A page has at most limit identities (WISH_PORT_IDENTITY_LIST_PAGE_SZ
+ *  by default), and as many as fit in an RPC reply. If there are more,
+ *  cursor is given: pass it to get the next page. If the identity at
+ *  the cursor has been removed meanwhile, the error 348 tells to start
+ *  over; a bad limit, cursor or fields is error 8. fields selects the
+ *  fields of the results, from uid, alias, privkey and pubkey; all but
+ *  alias are read without loading the identities. The default is uid,
+ *  alias and privkey.
+ *
+ *  With stream: true, the pages are emitted as signals { sig, data: [ ... ] },
+ *  and the final reply is the number of identities listed. The next page
+ *  waits while more than WISH_PORT_IDENTITY_LIST_STREAM_QUEUED bytes
+ *  sent to the requester are not delivered yet.
  */
 void wish_api_identity_list(rpc_server_req* req, const uint8_t* args) {
+    wish_core_t* core = (wish_core_t*) req->server->context;
     
-    int num_uids_in_db = wish_get_num_uid_entries();
-    wish_uid_list_elem_t uid_list[num_uids_in_db];
-    int num_uids = wish_load_uid_list(uid_list, num_uids_in_db);
-
-    bson bs; 
-    bson_init(&bs);
-    bson_append_start_array(&bs, "data");
+    if (!wish_identity_db_open()) {
+        rpc_server_error_msg(req, 997, "Could not load identity list");
+        return;
+    }
     
-    int i = 0;
-    for (i = 0; i < num_uids; i++) {
-        char num_str[8];
-        bson_numstr(num_str, i);
-        bson_append_start_object(&bs, num_str);
+    bson_iterator it;
+    
+    if (bson_find_from_buffer(&it, args, "0") != BSON_OBJECT) {
+        /* No options, list all identities */
+        bson bs; 
+        bson_init(&bs);
+        bson_append_start_array(&bs, "data");
         
-        wish_identity_t identity;
-
-        if ( RET_SUCCESS != wish_identity_load(uid_list[i].uid, &identity) ) {
-            WISHDEBUG(LOG_CRITICAL, "Could not load identity");
-            rpc_server_error_msg(req, 997, "Could not load identity");
-            wish_identity_destroy(&identity);
+        int i = 0;
+        wish_identity_db_entry_t* entry = NULL;
+        for (entry = wish_identity_db_first(); entry != NULL; entry = wish_identity_db_next(entry)) {
+            char num_str[8];
+            bson_numstr(num_str, i++);
+            
+            if (!identity_list_append(&bs, num_str, entry, IDENTITY_FIELDS_DEFAULT)) {
+                rpc_server_error_msg(req, 997, "Could not load identity");
+                bson_destroy(&bs);
+                return;
+            }
+        }
+        
+        bson_append_finish_array(&bs);
+        bson_finish(&bs);
+        
+        if (bs.err) {
+            WISHDEBUG(LOG_CRITICAL, "BSON error in identity_list_handler");
+            rpc_server_error_msg(req, 997, "BSON error in identity_list_handler");
+        } else {
+            rpc_server_send(req, bson_data(&bs), bson_size(&bs));
+        }
+        
+        bson_destroy(&bs);
+        return;
+    }
+    
+    bson opts;
+    bson_iterator_subobject(&it, &opts);
+    
+    int limit = WISH_PORT_IDENTITY_LIST_PAGE_SZ;
+    if (bson_find(&it, &opts, "limit") == BSON_INT) {
+        limit = bson_iterator_int(&it);
+        if (limit <= 0) {
+            rpc_server_error_msg(req, 8, "limit must be positive");
             return;
         }
-
-        bson_append_binary(&bs, "uid", identity.uid, WISH_UID_LEN);
-        bson_append_string(&bs, "alias", identity.alias);
-        bson_append_bool(&bs, "privkey", identity.has_privkey);
-
-        wish_identity_destroy(&identity);
+    }
+    
+    const uint8_t* cursor = NULL;
+    bson_type cursor_type = bson_find(&it, &opts, "cursor");
+    if (cursor_type == BSON_BINDATA && bson_iterator_bin_len(&it) == WISH_UID_LEN) {
+        cursor = (const uint8_t*) bson_iterator_bin_data(&it);
+    } else if (cursor_type != BSON_EOO && cursor_type != BSON_NULL) {
+        rpc_server_error_msg(req, 8, "cursor must be Buffer(32)");
+        return;
+    }
+    
+    int fields = IDENTITY_FIELDS_DEFAULT;
+    if (bson_find(&it, &opts, "fields") == BSON_ARRAY) {
+        fields = identity_list_fields(&it);
+        if (fields <= 0) {
+            rpc_server_error_msg(req, 8, "fields must be some of uid, alias, privkey and pubkey");
+            return;
+        }
+    }
+    
+    if (bson_find(&it, &opts, "stream") == BSON_BOOL && bson_iterator_bool(&it)) {
+        struct identity_list_stream* stream = wish_platform_malloc(sizeof(struct identity_list_stream));
+        if (stream == NULL) {
+            rpc_server_error_msg(req, 344, "Out of memory");
+            return;
+        }
+        memset(stream, 0, sizeof(struct identity_list_stream));
         
-        bson_append_finish_object(&bs);
+        /* Copy the RPC request context, as the pages are emitted later */
+        memcpy(&(stream->req), req, sizeof (rpc_server_req));
+        stream->limit = limit;
+        stream->fields = fields;
+        if (cursor != NULL) {
+            memcpy(stream->cursor, cursor, WISH_UID_LEN);
+            stream->started = true;
+        }
+        
+        identity_list_stream_cb(core, stream);
+        return;
+    }
+    
+    wish_identity_db_entry_t* entry = NULL;
+    if (!identity_list_resume(cursor, &entry)) {
+        rpc_server_error_msg(req, 348, "The identity list changed, list again.");
+        return;
     }
     
+    bson bs;
+    bson_init(&bs);
+    bson_append_start_object(&bs, "data");
+    bson_append_start_array(&bs, "list");
+    
+    int count = 0;
+    wish_identity_db_entry_t* first = entry;
+    wish_identity_db_entry_t* next = identity_list_page(&bs, entry, limit, fields, &count);
+    
     bson_append_finish_array(&bs);
+    
+    if (next != NULL && next != first) {
+        /* The cursor is the uid of the last identity of this page */
+        wish_identity_db_entry_t* last = first;
+        while (wish_identity_db_next(last) != next) {
+            last = wish_identity_db_next(last);
+        }
+        bson_append_binary(&bs, "cursor", last->uid, WISH_UID_LEN);
+    }
+    
+    bson_append_finish_object(&bs);
     bson_finish(&bs);
     
     if (bs.err) {
@@ -342,30 +1083,9 @@ void wish_api_identity_get(rpc_server_req* req, const uint8_t* args) {
  * @return 
  */
 static bool wish_identity_local_exists() {
-    
-    int num_uids_in_db = wish_get_num_uid_entries();
-    wish_uid_list_elem_t uid_list[num_uids_in_db];
-    int num_uids = wish_load_uid_list(uid_list, num_uids_in_db);
-
-    int i = 0;
-    for (i = 0; i < num_uids; i++) {
-        wish_identity_t identity;
-
-        if ( RET_SUCCESS != wish_identity_load(uid_list[i].uid, &identity) ) {
-            WISHDEBUG(LOG_CRITICAL, "Could not load identity");
-            wish_identity_destroy(&identity);
-            continue;
-        }
-
-        if (identity.has_privkey) {
-            wish_identity_destroy(&identity);
-            return true;
-        }
-        
-        wish_identity_destroy(&identity);
-    }
-    
-    return false;
+    /* The index knows which identities have a privkey, no need to load them */
+    wish_uid_list_elem_t local_id;
+    return wish_get_local_identity_list(&local_id, 1) > 0;
 }
 
 /**
@@ -419,8 +1139,8 @@ void wish_api_identity_create(rpc_server_req* req, const uint8_t* args) {
     bson_append_binary(&bs, "0", id.uid, WISH_UID_LEN);
     bson_finish(&bs);
 
-    // pass to identity get handler with uid as parameter
-    wish_api_identity_get(req, (char*) bson_data(&bs));
+    // pass to identity get handler with uid as parameter, once the identity is committed
+    identity_reply_on_commit(core, req, true, bson_data(&bs), bson_size(&bs));
     
     wish_core_update_identities(core);
 
@@ -559,8 +1279,8 @@ void wish_api_identity_update(rpc_server_req* req, const uint8_t* args) {
     bson_append_binary(&bs, "0", id.uid, WISH_UID_LEN);
     bson_finish(&bs);
 
-    // pass to identity get handler with uid as parameter
-    wish_api_identity_get(req, (char*) bson_data(&bs));
+    // pass to identity get handler with uid as parameter, once the identity is committed
+    identity_reply_on_commit(core, req, true, bson_data(&bs), bson_size(&bs));
 
     wish_core_update_identities(core);
 
@@ -630,21 +1350,8 @@ void wish_api_identity_remove(rpc_server_req* req, const uint8_t* args) {
             }
         }
         
-        if (wish_service_exists(core, req->context) == NULL) {
-            if (wish_connection_is_from_pool(core, req->ctx) != NULL) {
-                wish_connection_t *conn = req->ctx;
-                if (!wish_core_is_connected_luid_ruid(core, conn->luid, conn->ruid)) {
-                    WISHDEBUG(LOG_CRITICAL, "Will not send, connection gone");
-                    return;
-                }
-            }
-            else {
-                WISHDEBUG(LOG_CRITICAL, "Will not send, req->ctx is not a connection from the core's pool");
-                return;
-            }
-        }
-        
-        rpc_server_send(req, bson_data(&bs), bson_size(&bs));
+        /* The requester may be gone by now, which is checked before replying */
+        identity_reply_on_commit(core, req, false, bson_data(&bs), bson_size(&bs));
         
         wish_core_signals_emit_string(core, "identity");
         
@@ -728,8 +1435,8 @@ void wish_api_identity_permissions(rpc_server_req* req, const uint8_t* args) {
     bson_append_binary(&bs, "0", id.uid, WISH_UID_LEN);
     bson_finish(&bs);
 
-    // pass to identity get handler with uid as parameter
-    wish_api_identity_get(req, (char*) bson_data(&bs));
+    // pass to identity get handler with uid as parameter, once the identity is committed
+    identity_reply_on_commit(core, req, true, bson_data(&bs), bson_size(&bs));
 
     wish_core_update_identities(core);
 
@@ -1242,6 +1949,7 @@ void wish_api_identity_friend_request(rpc_server_req* req, const uint8_t* args)
         strncpy(new_id.transports[0], transport, WISH_MAX_TRANSPORT_LEN);
         
         wish_save_identity_entry(&new_id);
+        wish_commit_request(core, WISH_COMMIT_IDENTITIES, NULL, NULL);
         /* Flag the potential friend contact as an "unconfirmed friend request", and flag it also so that the wish core will not attempt normal connections to it for the time being.
          When the friend request connection is closed, if the the friend request is still not answered, remove the connect: false flag so that we may start attempting connections,
          whilst waiting for the remote end to some day accept the friend request. */
@@ -1496,23 +2204,15 @@ void wish_api_identity_friend_request_accept(rpc_server_req* req, const uint8_t*
 
     // Check if identity is already in db
 
-    int num_uids_in_db = wish_get_num_uid_entries();
-    wish_uid_list_elem_t uid_list[num_uids_in_db];
-    int num_uids = wish_load_uid_list(uid_list, num_uids_in_db);
-
-
     found = false;
-    i = 0;
-    for (i = 0; i < num_uids; i++) {
-        if ( memcmp(&uid_list[i].uid, ruid, WISH_ID_LEN) == 0 ) {
-            WISHDEBUG(LOG_CRITICAL, "Identity already in DB, we wont add it multiple times.");
-            found = true;
-            break;
-        }
+    if (wish_identity_exists((uint8_t*) ruid) > 0) {
+        WISHDEBUG(LOG_CRITICAL, "Identity already in DB, we wont add it multiple times.");
+        found = true;
     }
 
     if(!found) {
         wish_save_identity_entry(&elt->id);
+        wish_commit_request(core, WISH_COMMIT_IDENTITIES, NULL, NULL);
         wish_core_signals_emit_string(core, "identity");
     }
 
@@ -23,6 +23,17 @@ extern "C" {
 #include "wish_identity.h"
 
 #include "wish_core.h"
+
+/* Define the default number of identities per page of identity.list */
+#ifndef WISH_PORT_IDENTITY_LIST_PAGE_SZ
+#define WISH_PORT_IDENTITY_LIST_PAGE_SZ 100
+#endif
+
+/* Define the number of bytes not yet delivered to the requester above
+ * which a streaming identity.list waits before emitting the next page */
+#ifndef WISH_PORT_IDENTITY_LIST_STREAM_QUEUED
+#define WISH_PORT_IDENTITY_LIST_STREAM_QUEUED ( 64*1024 )
+#endif
     
     /* Identity API */
     
@@ -30,6 +41,10 @@ extern "C" {
 
     void wish_api_identity_import(rpc_server_req* req, const uint8_t* args);
 
+    void wish_api_identity_import_batch(rpc_server_req* req, const uint8_t* args);
+
+    void wish_api_identity_export_batch(rpc_server_req* req, const uint8_t* args);
+
     void wish_api_identity_list(rpc_server_req* req, const uint8_t* args);
 
     void wish_api_identity_get(rpc_server_req* req, const uint8_t* args);
@@ -17,7 +17,9 @@
 #include "core_service_ipc.h"
 #include "wish_service_registry.h"
 #include "wish_dispatcher.h"
+#include "wish_stream.h"
 #include "wish_debug.h"
+#include "wish_platform.h"
 #include "string.h"
 #include "bson_visit.h"
 
@@ -134,9 +136,13 @@ void wish_api_services_send(rpc_server_req* req, const uint8_t* args) {
          * (that is found in the rpc context)
          *  */
         
-        /* FIXME this is wasting stack space again */
+        /* The payload may be large, so the frame is not built on stack */
         size_t upcall_doc_max_len = (5+4*32+10) + payload_len + 100;
-        uint8_t upcall_doc[upcall_doc_max_len];
+        uint8_t* upcall_doc = wish_platform_malloc(upcall_doc_max_len);
+        if (upcall_doc == NULL) {
+            rpc_server_error_msg(req, 312, "Out of memory when creating frame for local service");
+            return;
+        }
         bson bs;
         bson_init_buffer(&bs, upcall_doc, upcall_doc_max_len);
         bson_append_string(&bs, "type", "frame");
@@ -159,6 +165,7 @@ void wish_api_services_send(rpc_server_req* req, const uint8_t* args) {
             send_core_to_app(core, rsid, bson_data(&bs), bson_size(&bs));
             rpc_server_send(req, NULL, 0);
         }
+        wish_platform_free(upcall_doc);
         return;
     }
     /* Destination is determined to be a remote service on a remote core. */
@@ -178,7 +185,11 @@ void wish_api_services_send(rpc_server_req* req, const uint8_t* args) {
          */
 
         size_t buf_len = 2*(WISH_WSID_LEN) + protocol_len + payload_len + 128;
-        uint8_t buf[buf_len];
+        uint8_t* buf = wish_platform_malloc(buf_len);
+        if (buf == NULL) {
+            rpc_server_error_msg(req, 506, "Out of memory when creating message to remote core.");
+            return;
+        }
         bson bs; 
         bson_init_buffer(&bs, buf, buf_len);
         bson_append_start_object(&bs, "req");
@@ -194,10 +205,21 @@ void wish_api_services_send(rpc_server_req* req, const uint8_t* args) {
 
         if (bs.err) {
             WISHDEBUG(LOG_CRITICAL, "BSON write error, args_buffer");
+            wish_platform_free(buf);
             return;
         }
         
-        int send_ret = wish_core_send_message(core, connection, bson_data(&bs), bson_size(&bs));
+        int send_ret = 0;
+        if (connection->remote_features & WISH_FEATURE_STREAM) {
+            /* Each local service sends on a stream of its own, so that
+             * a bulk transfer does not block other services or core traffic */
+            send_ret = wish_stream_send(core, connection, wsid, bson_data(&bs), bson_size(&bs));
+        }
+        else {
+            /* Messages which do not fit into one Wish frame are fragmented */
+            send_ret = wish_core_send_message(core, connection, bson_data(&bs), bson_size(&bs));
+        }
+        wish_platform_free(buf);
         
         if (send_ret != 0) {
             /* Sending failed. Propagate RPC error */
@@ -20,6 +20,7 @@
 #include "wish_local_discovery.h"
 #include "wish_connection_mgr.h"
 #include "wish_core_signals.h"
+#include "wish_commit.h"
 
 /**
  * Wish Local Discovery
@@ -253,6 +254,7 @@ void wish_api_wld_friend_request(rpc_server_req* req, const uint8_t* args) {
         memcpy(new_id.pubkey, db[i].pubkey, WISH_PUBKEY_LEN);
         wish_platform_snprintf(new_id.transports[0], WISH_MAX_TRANSPORT_LEN, "%d.%d.%d.%d:%d", db[i].transport_ip.addr[0], db[i].transport_ip.addr[1], db[i].transport_ip.addr[2], db[i].transport_ip.addr[3], db[i].transport_port);        
         wish_save_identity_entry(&new_id);
+        wish_commit_request(core, WISH_COMMIT_IDENTITIES, NULL, NULL);
         /* Flag the potential friend contact as an "unconfirmed friend request", and flag it also so that the wish core will not attempt normal connections to it for the time being.
          When the friend request connection is closed, if the the friend request is still not answered, remove the connect: false flag so that we may start attempting connections,
          whilst waiting for the remote end to some day accept the friend request. */
@@ -0,0 +1,180 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "wish_batch.h"
+#include "wish_fragment.h"
+#include "wish_compress.h"
+#include "wish_connection.h"
+#include "wish_connection_mgr.h"
+#include "wish_dispatcher.h"
+#include "wish_platform.h"
+#include "wish_debug.h"
+#include "bson.h"
+
+/* The number of bytes reserved for the BSON envelope of a batch */
+#define WISH_BATCH_OVERHEAD 32
+
+#if WISH_PORT_COALESCE_SZ + WISH_BATCH_OVERHEAD > WISH_FRAME_MAX_PAYLOAD_LEN
+#error WISH_PORT_COALESCE_SZ too large, a batch must fit in one frame
+#endif
+
+int wish_batch_add(wish_core_t* core, wish_connection_t* connection, const uint8_t* msg, int msg_len) {
+    if (WISH_PORT_COALESCE_SZ == 0
+            || (connection->remote_features & WISH_FEATURE_BATCH) == 0
+            || connection->curr_protocol_state != PROTO_STATE_WISH_RUNNING
+            || connection->context_state == WISH_CONTEXT_CLOSING
+            || msg_len > WISH_PORT_COALESCE_SZ) {
+        return 0;
+    }
+
+    if (connection->tx_batch == NULL) {
+        connection->tx_batch = wish_platform_malloc(WISH_PORT_COALESCE_SZ);
+        if (connection->tx_batch == NULL) {
+            return 0;
+        }
+        connection->tx_batch_len = 0;
+        connection->tx_batch_count = 0;
+    }
+
+    if (msg_len > WISH_PORT_COALESCE_SZ - connection->tx_batch_len) {
+        if (wish_batch_flush(core, connection)) {
+            /* The messages of the batch are lost, and the messages after
+             * them must not be delivered either */
+            WISHDEBUG(LOG_CRITICAL, "Sending batch failed, closing connection");
+            wish_close_connection(core, connection);
+            return -1;
+        }
+    }
+
+    memcpy(connection->tx_batch + connection->tx_batch_len, msg, msg_len);
+    connection->tx_batch_len += msg_len;
+    connection->tx_batch_count++;
+
+    return 1;
+}
+
+int wish_batch_flush(wish_core_t* core, wish_connection_t* connection) {
+    if (connection->tx_batch_len == 0) {
+        return 0;
+    }
+
+    /* Empty the batch before sending: wish_core_send_frame() flushes
+     * the batch first, and must find it empty */
+    int batch_len = connection->tx_batch_len;
+    int batch_count = connection->tx_batch_count;
+    connection->tx_batch_len = 0;
+    connection->tx_batch_count = 0;
+
+    const uint8_t* payload = connection->tx_batch;
+    int payload_len = batch_len;
+    uint8_t* frame = NULL;
+    bson bs;
+
+    /* A batch of one message is sent as the plain message */
+    if (batch_count > 1) {
+        size_t frame_len = batch_len + WISH_BATCH_OVERHEAD;
+        frame = wish_platform_malloc(frame_len);
+        if (frame == NULL) {
+            WISHDEBUG(LOG_CRITICAL, "Memory allocation fail when sending batch");
+            return 1;
+        }
+
+        bson_init_buffer(&bs, frame, frame_len);
+        bson_append_binary(&bs, "batch", connection->tx_batch, batch_len);
+        bson_finish(&bs);
+
+        if (bs.err) {
+            WISHDEBUG(LOG_CRITICAL, "BSON write error when building batch");
+            wish_platform_free(frame);
+            return 1;
+        }
+
+        payload = (const uint8_t*) bson_data(&bs);
+        payload_len = bson_size(&bs);
+    }
+
+    /* A batch of small messages compresses better than the messages one by one */
+    int compressed_len = 0;
+    uint8_t* compressed = wish_compress_message(connection, payload, payload_len, &compressed_len);
+
+    int ret = 0;
+    if (compressed != NULL) {
+        ret = wish_core_send_frame(core, connection, compressed, compressed_len);
+        wish_platform_free(compressed);
+    }
+    else {
+        ret = wish_core_send_frame(core, connection, payload, payload_len);
+    }
+
+    if (frame != NULL) {
+        wish_platform_free(frame);
+    }
+    return ret;
+}
+
+void wish_batch_flush_all(wish_core_t* core) {
+    int i = 0;
+    for (i = 0; i < WISH_CONTEXT_POOL_SZ; i++) {
+        wish_connection_t* connection = &(core->connection_pool[i]);
+        if (connection->tx_batch_len == 0) {
+            continue;
+        }
+        if (wish_batch_flush(core, connection)) {
+            WISHDEBUG(LOG_CRITICAL, "Sending batch failed, closing connection");
+            wish_close_connection(core, connection);
+        }
+    }
+}
+
+void wish_batch_feed(wish_core_t* core, wish_connection_t* connection, const uint8_t* msg, int envelopes) {
+    bson_iterator it;
+
+    bson_find_from_buffer(&it, msg, "batch");
+    const uint8_t* batch = bson_iterator_bin_data(&it);
+    int32_t batch_len = bson_iterator_bin_len(&it);
+
+    int32_t offset = 0;
+    while (offset < batch_len) {
+        int32_t msg_len = 0;
+        if (batch_len - offset >= 5) {
+            msg_len = bson_size2(batch + offset);
+        }
+        if (msg_len < 5 || msg_len > batch_len - offset) {
+            WISHDEBUG(LOG_CRITICAL, "Bad message in batch at offset %i, closing connection", offset);
+            wish_close_connection(core, connection);
+            return;
+        }
+
+        wish_core_process_inner_message(core, connection, (uint8_t*) batch + offset, envelopes | WISH_ENVELOPE_BATCH);
+
+        if (connection->context_state == WISH_CONTEXT_FREE) {
+            /* The connection was closed while processing the message */
+            return;
+        }
+        offset += msg_len;
+    }
+}
+
+void wish_batch_cleanup(wish_core_t* core, wish_connection_t* connection) {
+    if (connection->tx_batch != NULL) {
+        wish_platform_free(connection->tx_batch);
+        connection->tx_batch = NULL;
+    }
+    connection->tx_batch_len = 0;
+    connection->tx_batch_count = 0;
+}
@@ -0,0 +1,84 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+#pragma once
+
+/* Wish C - Coalescing of small messages into one Wish frame
+ *
+ * Small messages sent to the same connection during one iteration of
+ * the event loop are collected into a batch, and sent in one frame:
+ *
+ * { batch: Buffer }
+ *
+ * where batch is the BSON documents of the messages one after another.
+ * The porting layer must call wish_batch_flush_all() once per event
+ * loop iteration, which bounds the delay of a message to one
+ * iteration. A batch is also flushed when it is full, and before any
+ * other frame is sent on the connection, so the order of messages is
+ * preserved. A batch of one message is sent as the plain message.
+ *
+ * The messages are batched as they are, and the batch is compressed as
+ * a whole (wish_compress.h).
+ *
+ * Messages are batched only if WISH_PORT_COALESCE_SZ is non-zero, and
+ * the remote core announces WISH_FEATURE_BATCH in its handshake.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include "wish_core.h"
+#include "wish_connection.h"
+
+/* Define the maximum number of bytes of messages in one batch. 0 disables coalescing. */
+#ifndef WISH_PORT_COALESCE_SZ
+#define WISH_PORT_COALESCE_SZ 0
+#endif
+
+/**
+ * Add a message to the batch of the connection, if the message can be batched.
+ * If the batch is full, it is sent first. If sending it fails, the
+ * connection is closed, as the messages of the batch are lost.
+ *
+ * @return 1 if the message was added to the batch, 0 if it must be
+ * sent right away, or -1 if sending the batch failed
+ */
+int wish_batch_add(wish_core_t* core, wish_connection_t* connection, const uint8_t* msg, int msg_len);
+
+/**
+ * Send the batch of the connection, if there is one.
+ *
+ * @return 0 if the batch was sent or there was none, non-zero on failure
+ */
+int wish_batch_flush(wish_core_t* core, wish_connection_t* connection);
+
+/** Send the batches of all connections. Call once per event loop iteration. */
+void wish_batch_flush_all(wish_core_t* core);
+
+/**
+ * Feed an incoming batch ({ batch: Buffer }), taken out of the
+ * envelopes given as WISH_ENVELOPE_* flags. Each message is submitted
+ * to wish_core_process_inner_message().
+ */
+void wish_batch_feed(wish_core_t* core, wish_connection_t* connection, const uint8_t* msg, int envelopes);
+
+/** Release the batch of a connection without sending it */
+void wish_batch_cleanup(wish_core_t* core, wish_connection_t* connection);
+
+#ifdef __cplusplus
+}
+#endif
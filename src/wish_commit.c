@@ -0,0 +1,129 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "wish_commit.h"
+#include "wish_config.h"
+#include "wish_identity_db.h"
+#include "wish_time.h"
+#include "wish_platform.h"
+#include "wish_debug.h"
+#include "utlist.h"
+
+static void commit_timer(wish_core_t* core, void* ctx) {
+    /* The timer is done, a new request schedules a new one */
+    core->commit->timer.node = NULL;
+    wish_commit_flush(core);
+}
+
+void wish_commit_request(wish_core_t* core, int what, wish_commit_cb cb, void* cb_ctx) {
+    if (core->commit == NULL) {
+        core->commit = wish_platform_malloc(sizeof(wish_commit_t));
+        if (core->commit == NULL) {
+            WISHDEBUG(LOG_CRITICAL, "Memory allocation fail for commit");
+            if (cb != NULL) {
+                cb(core, cb_ctx, false);
+            }
+            return;
+        }
+        memset(core->commit, 0, sizeof(wish_commit_t));
+    }
+
+    wish_commit_t* commit = core->commit;
+    commit->pending |= what;
+
+    bool flush_now = false;
+    bool queued = false;
+
+    if (cb != NULL) {
+        wish_commit_waiter_t* waiter = wish_platform_malloc(sizeof(wish_commit_waiter_t));
+        if (waiter == NULL) {
+            WISHDEBUG(LOG_CRITICAL, "Memory allocation fail for commit waiter, committing now");
+            flush_now = true;
+        }
+        else {
+            waiter->cb = cb;
+            waiter->cb_ctx = cb_ctx;
+            LL_APPEND(commit->waiters, waiter);
+            queued = true;
+        }
+    }
+
+    if (core->timer_wheel == NULL) {
+        /* Called from wish_core_init(), before the timers are set up */
+        flush_now = true;
+    }
+
+    if (!flush_now && commit->timer.node == NULL) {
+        commit->timer = wish_core_time_set_timeout_ms(core, commit_timer, NULL, WISH_PORT_COMMIT_WINDOW_MS);
+        if (commit->timer.node == NULL) {
+            flush_now = true;
+        }
+    }
+
+    if (flush_now) {
+        int ret = wish_commit_flush(core);
+        if (cb != NULL && !queued) {
+            cb(core, cb_ctx, ret == 0);
+        }
+    }
+}
+
+int wish_commit_flush(wish_core_t* core) {
+    wish_commit_t* commit = core->commit;
+    if (commit == NULL) {
+        return 0;
+    }
+
+    if (commit->timer.node != NULL) {
+        wish_core_time_cancel(core, commit->timer);
+        commit->timer.node = NULL;
+    }
+
+    /* Take the waiters and the pending data, as the callbacks may request a new commit */
+    int pending = commit->pending;
+    wish_commit_waiter_t* waiters = commit->waiters;
+    commit->pending = 0;
+    commit->waiters = NULL;
+
+    int ret = 0;
+
+    if (pending & WISH_COMMIT_CONFIG) {
+        if (wish_core_config_write(core) < 0) {
+            /* Try again with the next commit */
+            commit->pending |= WISH_COMMIT_CONFIG;
+            ret = -1;
+        }
+    }
+
+    if (pending & WISH_COMMIT_IDENTITIES) {
+        if (wish_identity_db_sync()) {
+            commit->pending |= WISH_COMMIT_IDENTITIES;
+            ret = -1;
+        }
+    }
+
+    wish_commit_waiter_t* waiter = NULL;
+    wish_commit_waiter_t* tmp = NULL;
+    LL_FOREACH_SAFE(waiters, waiter, tmp) {
+        LL_DELETE(waiters, waiter);
+        waiter->cb(core, waiter->cb_ctx, ret == 0);
+        wish_platform_free(waiter);
+    }
+
+    return ret;
+}
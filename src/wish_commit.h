@@ -0,0 +1,92 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+#pragma once
+
+/* Wish C - Group commit of identity and configuration writes
+ *
+ * Identity records are appended to the identity database when they are
+ * written, but made durable only by a commit. A commit is requested
+ * after each write, and done WISH_PORT_COMMIT_WINDOW_MS after the first
+ * request: the writes made within the window, for example a bulk
+ * identity.import, are synced with a single flush.
+ *
+ * A commit syncs the identity database, and writes the configuration
+ * if it has changed. The configuration is written to a new file, which
+ * is synced and then renamed over the old one.
+ *
+ * The requester may pass a callback, which is called when the commit
+ * is done. The RPC handlers which modify identities use it to send the
+ * reply only once the change is durable.
+ *
+ * Before the timers are set up in wish_core_init(), commits are done
+ * right away.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include "wish_core.h"
+
+/* Define the time to collect writes before committing them, in milliseconds */
+#ifndef WISH_PORT_COMMIT_WINDOW_MS
+#define WISH_PORT_COMMIT_WINDOW_MS 20
+#endif
+
+/* Flags for wish_commit_request() */
+#define WISH_COMMIT_IDENTITIES 1
+#define WISH_COMMIT_CONFIG 2
+
+/**
+ * Called when a commit is done.
+ *
+ * @param success false if some of the data could not be written
+ */
+typedef void (*wish_commit_cb)(wish_core_t* core, void* cb_ctx, bool success);
+
+typedef struct wish_commit_waiter {
+    wish_commit_cb cb;
+    void* cb_ctx;
+    struct wish_commit_waiter* next;
+} wish_commit_waiter_t;
+
+typedef struct wish_commit {
+    /* The WISH_COMMIT_* flags of the data to write in the next commit */
+    int pending;
+    /* The timer of the next commit, its node is NULL if none is scheduled */
+    wish_timer_handle_t timer;
+    wish_commit_waiter_t* waiters;
+} wish_commit_t;
+
+/**
+ * Request a commit of the data in what (WISH_COMMIT_* flags). If a
+ * commit is already scheduled, the data is written with it.
+ *
+ * @param cb called when the commit is done, may be NULL
+ */
+void wish_commit_request(wish_core_t* core, int what, wish_commit_cb cb, void* cb_ctx);
+
+/**
+ * Do the scheduled commit now, and call the callbacks waiting for it.
+ *
+ * @return 0 on success
+ */
+int wish_commit_flush(wish_core_t* core);
+
+#ifdef __cplusplus
+}
+#endif
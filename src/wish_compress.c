@@ -0,0 +1,340 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "wish_compress.h"
+#include "wish_fragment.h"
+#include "wish_connection.h"
+#include "wish_connection_mgr.h"
+#include "wish_dispatcher.h"
+#include "wish_platform.h"
+#include "wish_debug.h"
+#include "bson.h"
+
+/* Static dictionary: BSON elements which appear in most messages
+ * between cores. The most common elements are last, as they are then
+ * closest to the data and get the shortest match offsets. */
+static const uint8_t dict[] =
+    "\x02" "name\0"
+    "\x10" "err\0" "\x10" "end\0" "\x10" "ack\0" "\x10" "sig\0"
+    "\x03" "res\0" "\x10" "id\0"
+    "\x02" "op\0" "\x08\0\0\0" "signals\0"
+    "\x02" "op\0" "\x06\0\0\0" "peers\0"
+    "\x08" "online\0"
+    "\x02" "type\0" "\x06\0\0\0" "frame\0"
+    "\x03" "req\0" "\x02" "op\0" "\x05\0\0\0" "send\0" "\x04" "args\0"
+    "\x05" "0\0" "\x20\0\0\0\0" "\x05" "1\0" "\x20\0\0\0\0" "\x02" "2\0" "\x05" "3\0"
+    "\x03" "peer\0"
+    "\x05" "luid\0" "\x20\0\0\0\0"
+    "\x05" "ruid\0" "\x20\0\0\0\0"
+    "\x05" "rhid\0" "\x20\0\0\0\0"
+    "\x05" "rsid\0" "\x20\0\0\0\0"
+    "\x02" "protocol\0"
+    "\x05" "data\0";
+
+/* The terminating null character of the string literal is not part of the dictionary */
+#define DICT_LEN ((int) sizeof(dict) - 1)
+
+#define LZ4_MIN_MATCH       4
+#define LZ4_MAX_OFFSET      0xffff
+/* LZ4 block format: the last match must start at least 12 bytes
+ * before the end, and the last 5 bytes are always literals */
+#define LZ4_MF_LIMIT        12
+#define LZ4_LAST_LITERALS   5
+
+#define LZ4_HASH_LOG        12
+#define LZ4_HASH_SZ         (1 << LZ4_HASH_LOG)
+
+/* The number of bytes reserved for the BSON envelope of a compressed message */
+#define WISH_COMPRESS_OVERHEAD 32
+
+static uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz4_hash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/* Write an LZ4 length continuation (after the 15 in the token). Returns the new output position or -1 */
+static int lz4_write_len(uint8_t* dst, int op, int dst_len, int len) {
+    while (len >= 255) {
+        if (op >= dst_len) { return -1; }
+        dst[op++] = 255;
+        len -= 255;
+    }
+    if (op >= dst_len) { return -1; }
+    dst[op++] = (uint8_t) len;
+    return op;
+}
+
+/* Write one sequence: literals, and a match unless match_len is 0. Returns the new output position or -1 */
+static int lz4_write_sequence(uint8_t* dst, int op, int dst_len, const uint8_t* literals, int literal_len, int offset, int match_len) {
+    if (op >= dst_len) { return -1; }
+    int token_pos = op++;
+    uint8_t token = 0;
+
+    if (literal_len >= 15) {
+        token = 15 << 4;
+        op = lz4_write_len(dst, op, dst_len, literal_len - 15);
+        if (op < 0) { return -1; }
+    } else {
+        token = literal_len << 4;
+    }
+
+    if (literal_len > dst_len - op) { return -1; }
+    memcpy(dst + op, literals, literal_len);
+    op += literal_len;
+
+    if (match_len > 0) {
+        if (dst_len - op < 2) { return -1; }
+        dst[op++] = offset & 0xff;
+        dst[op++] = (offset >> 8) & 0xff;
+
+        int len = match_len - LZ4_MIN_MATCH;
+        if (len >= 15) {
+            token |= 15;
+            op = lz4_write_len(dst, op, dst_len, len - 15);
+            if (op < 0) { return -1; }
+        } else {
+            token |= len;
+        }
+    }
+
+    dst[token_pos] = token;
+    return op;
+}
+
+/* The byte at position i of the dictionary followed by src */
+static uint8_t lz4_base_byte(const uint8_t* src, int i) {
+    return i < DICT_LEN ? dict[i] : src[i - DICT_LEN];
+}
+
+/* The 4 bytes at position i of the dictionary followed by src */
+static uint32_t lz4_base_read32(const uint8_t* src, int i) {
+    if (i >= DICT_LEN) {
+        return read32(src + i - DICT_LEN);
+    }
+    if (i + 4 <= DICT_LEN) {
+        return read32(dict + i);
+    }
+    uint8_t b[4];
+    int j;
+    for (j = 0; j < 4; j++) {
+        b[j] = lz4_base_byte(src, i + j);
+    }
+    return read32(b);
+}
+
+int wish_lz4_compress(const uint8_t* src, int src_len, uint8_t* dst, int dst_len) {
+    /* Positions count from the start of the dictionary, which is
+     * thought to be in front of the data, so that matches can refer to
+     * it with ordinary offsets. Neither is copied. */
+    int base_len = DICT_LEN + src_len;
+    int32_t* table = wish_platform_malloc(LZ4_HASH_SZ * sizeof(int32_t));
+    if (table == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "Memory allocation fail in compressor");
+        return 0;
+    }
+
+    int i;
+    for (i = 0; i < LZ4_HASH_SZ; i++) {
+        table[i] = -1;
+    }
+    for (i = 0; i + LZ4_MIN_MATCH <= DICT_LEN; i++) {
+        table[lz4_hash(read32(dict + i))] = i;
+    }
+
+    int ip = DICT_LEN;
+    int anchor = DICT_LEN;
+    int op = 0;
+    int match_limit = base_len - LZ4_LAST_LITERALS;
+
+    while (ip < base_len - LZ4_MF_LIMIT) {
+        uint32_t v = read32(src + ip - DICT_LEN);
+        uint32_t h = lz4_hash(v);
+        int ref = table[h];
+        table[h] = ip;
+
+        if (ref < 0 || ip - ref > LZ4_MAX_OFFSET || lz4_base_read32(src, ref) != v) {
+            ip++;
+            continue;
+        }
+
+        int match_len = LZ4_MIN_MATCH;
+        while (ip + match_len < match_limit && lz4_base_byte(src, ref + match_len) == src[ip - DICT_LEN + match_len]) {
+            match_len++;
+        }
+
+        op = lz4_write_sequence(dst, op, dst_len, src + anchor - DICT_LEN, ip - anchor, ip - ref, match_len);
+        if (op < 0) { break; }
+
+        ip += match_len;
+        anchor = ip;
+    }
+
+    if (op >= 0) {
+        op = lz4_write_sequence(dst, op, dst_len, src + anchor - DICT_LEN, base_len - anchor, 0, 0);
+    }
+
+    wish_platform_free(table);
+
+    return op < 0 ? 0 : op;
+}
+
+int wish_lz4_decompress(const uint8_t* src, int src_len, uint8_t* dst, int dst_len) {
+    int ip = 0;
+    int op = 0;
+
+    while (ip < src_len) {
+        uint8_t token = src[ip++];
+
+        int literal_len = token >> 4;
+        if (literal_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= src_len) { return 1; }
+                b = src[ip++];
+                literal_len += b;
+            } while (b == 255);
+        }
+        if (literal_len > src_len - ip || literal_len > dst_len - op) { return 1; }
+        memcpy(dst + op, src + ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+
+        if (ip == src_len) {
+            /* The last sequence has only literals */
+            break;
+        }
+
+        if (src_len - ip < 2) { return 1; }
+        int offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op + DICT_LEN) { return 1; }
+
+        int match_len = token & 15;
+        if (match_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= src_len) { return 1; }
+                b = src[ip++];
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += LZ4_MIN_MATCH;
+        if (match_len > dst_len - op) { return 1; }
+
+        /* Byte by byte, as the match may overlap the output, and may
+         * start in the dictionary (negative ref) */
+        int ref = op - offset;
+        int i;
+        for (i = 0; i < match_len; i++, ref++) {
+            dst[op++] = ref < 0 ? dict[DICT_LEN + ref] : dst[ref];
+        }
+    }
+
+    return op == dst_len ? 0 : 1;
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+uint8_t* wish_compress_message(wish_connection_t* connection, const uint8_t* msg, int msg_len, int* compressed_len) {
+    if ((connection->remote_features & WISH_FEATURE_COMPRESS) == 0
+            || connection->curr_protocol_state != PROTO_STATE_WISH_RUNNING
+            || msg_len < WISH_PORT_COMPRESS_THRESHOLD) {
+        return NULL;
+    }
+
+    /* Anything which does not fit here is not worth sending compressed */
+    int buffer_len = msg_len;
+    uint8_t* buffer = wish_platform_malloc(buffer_len);
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    /* The message is compressed right into its place in the BSON
+     * document { z: Buffer, len: int32 }, which is then written around
+     * it, so that no other copy of the message is needed:
+     *
+     * size: int32, 0x05 "z\0" z_len: int32, subtype: 0x00, z: z_len bytes,
+     * 0x10 "len\0" len: int32, 0x00 */
+    const int z_pos = 4 + 3 + 4 + 1;
+    const int tail_len = 5 + 4 + 1;
+
+    int z_len = wish_lz4_compress(msg, msg_len, buffer + z_pos, buffer_len - WISH_COMPRESS_OVERHEAD);
+    if (z_len == 0) {
+        wish_platform_free(buffer);
+        return NULL;
+    }
+
+    int doc_len = z_pos + z_len + tail_len;
+    put32(buffer, doc_len);
+    memcpy(buffer + 4, "\x05" "z", 3);
+    put32(buffer + 7, z_len);
+    buffer[11] = BSON_BIN_BINARY;
+    memcpy(buffer + z_pos + z_len, "\x10" "len", 5);
+    put32(buffer + z_pos + z_len + 5, msg_len);
+    buffer[doc_len - 1] = 0;
+
+    *compressed_len = doc_len;
+    return buffer;
+}
+
+void wish_compress_feed(wish_core_t* core, wish_connection_t* connection, const uint8_t* msg, int envelopes) {
+    bson_iterator it;
+
+    if (bson_find_from_buffer(&it, msg, "len") != BSON_INT) {
+        WISHDEBUG(LOG_CRITICAL, "Compressed message without length, closing connection");
+        wish_close_connection(core, connection);
+        return;
+    }
+    int32_t len = bson_iterator_int(&it);
+
+    bson_find_from_buffer(&it, msg, "z");
+    const uint8_t* z = bson_iterator_bin_data(&it);
+    int32_t z_len = bson_iterator_bin_len(&it);
+
+    if (len < 5 || len > WISH_PORT_MAX_MESSAGE_SZ) {
+        WISHDEBUG(LOG_CRITICAL, "Bad compressed message len %i, closing connection", len);
+        wish_close_connection(core, connection);
+        return;
+    }
+
+    uint8_t* message = wish_platform_malloc(len);
+    if (message == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "Memory allocation fail for compressed message of len %i, discarding it", len);
+        return;
+    }
+
+    if (wish_lz4_decompress(z, z_len, message, len) || bson_size2(message) != len) {
+        WISHDEBUG(LOG_CRITICAL, "Decompressing message failed, closing connection");
+        wish_platform_free(message);
+        wish_close_connection(core, connection);
+        return;
+    }
+
+    wish_core_process_inner_message(core, connection, message, envelopes | WISH_ENVELOPE_COMPRESSED);
+    wish_platform_free(message);
+}
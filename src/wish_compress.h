@@ -0,0 +1,86 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+#pragma once
+
+/* Wish C - Compression of messages between cores
+ *
+ * Messages of at least WISH_PORT_COMPRESS_THRESHOLD bytes are
+ * compressed before encryption, and sent as
+ *
+ * { z: Buffer, len: int32 }
+ *
+ * where z is the message compressed in LZ4 block format, and len is
+ * the length of the original message. The compressor and the
+ * decompressor are primed with a static dictionary of BSON elements
+ * common in Wish messages (luid, ruid, rhid, rsid, protocol...), so
+ * that also small messages compress well. The dictionary is part of
+ * the protocol: changing it requires a new feature bit.
+ *
+ * A message is sent compressed only if the remote core announces
+ * WISH_FEATURE_COMPRESS in its handshake, and if compression makes it
+ * smaller.
+ *
+ * A compressed message may contain a batch, but never another
+ * compressed message, fragment or stream message; the messages in a
+ * batch are not compressed one by one. So at most one decompressed
+ * message is held at a time.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "wish_core.h"
+#include "wish_connection.h"
+
+/* Define the length of the smallest message which is compressed */
+#ifndef WISH_PORT_COMPRESS_THRESHOLD
+#define WISH_PORT_COMPRESS_THRESHOLD 128
+#endif
+
+/**
+ * Compress a message for sending on the connection.
+ *
+ * @return the compressed message ({ z, len }) allocated with
+ * wish_platform_malloc, or NULL if the message should be sent as it is
+ * (remote does not support compression, message below threshold, or
+ * compression does not make it smaller)
+ */
+uint8_t* wish_compress_message(wish_connection_t* connection, const uint8_t* msg, int msg_len, int* compressed_len);
+
+/**
+ * Feed an incoming compressed message ({ z, len }), taken out of the
+ * envelopes given as WISH_ENVELOPE_* flags. The decompressed message is
+ * submitted to wish_core_process_inner_message().
+ */
+void wish_compress_feed(wish_core_t* core, wish_connection_t* connection, const uint8_t* msg, int envelopes);
+
+/**
+ * Compress src into dst in LZ4 block format, using the static dictionary.
+ *
+ * @return the compressed length, or 0 if the result does not fit in dst_len bytes
+ */
+int wish_lz4_compress(const uint8_t* src, int src_len, uint8_t* dst, int dst_len);
+
+/**
+ * Decompress an LZ4 block which was compressed with wish_lz4_compress().
+ *
+ * @return 0 if exactly dst_len bytes were decompressed to dst, non-zero on error
+ */
+int wish_lz4_decompress(const uint8_t* src, int src_len, uint8_t* dst, int dst_len);
+
+#ifdef __cplusplus
+}
+#endif
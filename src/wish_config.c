@@ -19,6 +19,7 @@
 #include "bson.h"
 #include "string.h"
 #include "wish_relay_client.h"
+#include "wish_commit.h"
 
 #include "utlist.h"
 
@@ -108,10 +109,15 @@ int wish_core_config_load(wish_core_t* core) {
 }
 
 int wish_core_config_save(wish_core_t* core) {
+    wish_commit_request(core, WISH_COMMIT_CONFIG, NULL, NULL);
+    return 0;
+}
+
+int wish_core_config_write(wish_core_t* core) {
     wish_file_t fd;
     int32_t ret = 0;
-    wish_fs_remove(WISH_CORE_CONFIG_DB_NAME);
-    fd = wish_fs_open(WISH_CORE_CONFIG_DB_NAME);
+    wish_fs_remove(WISH_CORE_CONFIG_TMP_NAME);
+    fd = wish_fs_open(WISH_CORE_CONFIG_TMP_NAME);
     if (fd < 0) {
         /* error */
         WISHDEBUG(LOG_CRITICAL, "could not open configuration db");
@@ -157,13 +163,20 @@ int wish_core_config_save(wish_core_t* core) {
 
     bson_destroy(&bs);
     
-    if (ret <= 0) {
+    if (ret <= 0 || wish_fs_sync(fd)) {
         /* error */
         WISHDEBUG(LOG_CRITICAL, "error writing configuration");
+        wish_fs_close(fd);
+        wish_fs_remove(WISH_CORE_CONFIG_TMP_NAME);
         return -3;
     }
     wish_fs_close(fd);
 
+    if (wish_fs_replace(WISH_CORE_CONFIG_TMP_NAME, WISH_CORE_CONFIG_DB_NAME)) {
+        WISHDEBUG(LOG_CRITICAL, "could not replace configuration db");
+        return -4;
+    }
+
     return ret;
 
 }
\ No newline at end of file
@@ -19,13 +19,19 @@ extern "C" {
 #endif
 
 #define WISH_CORE_CONFIG_DB_NAME "wish.conf"
+#define WISH_CORE_CONFIG_TMP_NAME "wish.conf.tmp"
     
 #include "wish_core.h"
     
 int wish_core_config_load(wish_core_t* core);
 
+/* Schedule writing the configuration with the next commit, see wish_commit.h */
 int wish_core_config_save(wish_core_t* core);
 
+/* Write the configuration to a new file, sync it and rename it over the
+ * old one. Returns the number of bytes written, or a negative value on error */
+int wish_core_config_write(wish_core_t* core);
+
 int wish_core_config_store(wish_core_t* core, const char* key, int len, bson* document);
 
 bson* wish_core_config_find(wish_core_t* core, bson* query);
@@ -40,6 +40,13 @@
 #include "wish_core_rpc.h"
 #include "wish_core_app_rpc.h"
 #include "wish_connection_mgr.h"
+#include "wish_fragment.h"
+#include "wish_stream.h"
+#include "wish_compress.h"
+#include "wish_batch.h"
+#include "wish_race.h"
+#include "wish_time.h"
+#include "wish_identity_db.h"
 
 #include "utlist.h"
 
@@ -248,7 +255,7 @@ bool wish_core_is_connected_luid_ruid(wish_core_t* core, uint8_t *luid, uint8_t
 
 
 /* Feed raw data into wish core */
-void wish_core_feed(wish_core_t* core, wish_connection_t* connection, unsigned char* data, int len) {
+int wish_core_feed(wish_core_t* core, wish_connection_t* connection, unsigned char* data, int len) {
     WISHDEBUG(LOG_INFO, "Got data, len %d ", len);
     int i = 0;
     for (i = 0; i < len; i++) {
@@ -256,16 +263,19 @@ void wish_core_feed(wish_core_t* core, wish_connection_t* connection, unsigned c
     }
 
     uint16_t rb_space = ring_buffer_space(&(connection->rx_ringbuf));
-    if (rb_space >= len) {
+    if (rb_space < len) {
+        /* Take what fits, the caller keeps the rest until we have
+         * processed data and made room */
+        WISHDEBUG(LOG_DEBUG, "Ring buffer has %hu free bytes, accepting %hu of %d", rb_space, rb_space, len);
+        len = rb_space;
+    }
+    if (len > 0) {
         /* Save the data in the rx circular buffer */
         ring_buffer_write(&(connection->rx_ringbuf), data, len);
         /* Update timestamp to indicate some data was received */
         connection->latest_input_timestamp = wish_time_get_relative(core);
-    } else {
-        /* There is no space for the data... */
-        WISHDEBUG(LOG_CRITICAL, "No space in ring buffer, for message of len = %d. The ringbuffer currently has %hu free bytes. Not going any further", len, rb_space);
-        wish_close_connection(core, connection);
     }
+    return len;
 }
 
 /* Check if the connection attempt by a remote client presenting these
@@ -339,7 +349,7 @@ again:
                 connection->expect_bytes = (bytes[0] << 8) | bytes[1];
                 WISHDEBUG(LOG_INFO, "Now expecting %d bytes of payload", connection->expect_bytes);
                 connection->curr_transport_state = TRANSPORT_STATE_WAIT_PAYLOAD;
-                if (ring_buffer_length(&(connection->rx_ringbuf)) >= connection->expect_bytes) {
+                if (ring_buffer_length(&(connection->rx_ringbuf)) > 0) {
                     /* There is more data to be read, so signal that
                      * function can continue */
                     goto again;
@@ -347,25 +357,39 @@ again:
             }
             break;
         case TRANSPORT_STATE_WAIT_PAYLOAD:
+            /* The payload is moved out of the ring buffer as it
+             * arrives, so that a frame may be larger than the ring
+             * buffer, and the ring buffer is freed for more input */
             expect_payload_len = connection->expect_bytes;
-            if (ring_buffer_length(&(connection->rx_ringbuf)) >= expect_payload_len) {
-                uint8_t* buf = (uint8_t*) wish_platform_malloc(connection->expect_bytes);
-                if (buf != NULL) {
-                    ring_buffer_read(&(connection->rx_ringbuf), buf, connection->expect_bytes);
-                    wish_core_handle_payload(core, connection, buf, connection->expect_bytes);
-                    wish_platform_free(buf);
-                    connection->curr_transport_state = TRANSPORT_STATE_WAIT_FRAME_LEN;
-                    if (ring_buffer_length(&(connection->rx_ringbuf)) >= 2) {
-                        /* There is more data to be read */
-                        goto again;
-                    }
-                }
-                else {
+            if (connection->rx_frame_buf == NULL) {
+                connection->rx_frame_buf = (uint8_t*) wish_platform_malloc(expect_payload_len);
+                connection->rx_frame_len = 0;
+                if (connection->rx_frame_buf == NULL) {
                     WISHDEBUG(LOG_CRITICAL, 
                         "Could not allocate memory for payload");
+                    break;
                 }
-           }
-           break;
+            }
+            {
+                int missing = expect_payload_len - connection->rx_frame_len;
+                int available = ring_buffer_length(&(connection->rx_ringbuf));
+                int read_len = available < missing ? available : missing;
+                ring_buffer_read(&(connection->rx_ringbuf), connection->rx_frame_buf + connection->rx_frame_len, read_len);
+                connection->rx_frame_len += read_len;
+            }
+            if (connection->rx_frame_len == expect_payload_len) {
+                uint8_t* buf = connection->rx_frame_buf;
+                connection->rx_frame_buf = NULL;
+                connection->rx_frame_len = 0;
+                wish_core_handle_payload(core, connection, buf, expect_payload_len);
+                wish_platform_free(buf);
+                connection->curr_transport_state = TRANSPORT_STATE_WAIT_FRAME_LEN;
+                if (ring_buffer_length(&(connection->rx_ringbuf)) >= 2) {
+                    /* There is more data to be read */
+                    goto again;
+                }
+            }
+            break;
         case TRANSPORT_STATE_SERVER_WAIT_INITIAL:
             /* This is the initial state in server mode. 
              * Wait for the handshake to appear in the ringbugger */
@@ -541,12 +565,57 @@ void wish_core_register_send(wish_core_t* core, wish_connection_t* connection, i
     connection->send_arg = arg;
 }
 
+int wish_connection_tx_keep(wish_connection_t* connection, const uint8_t* data, int len) {
+    if (connection->tx_out_len + len > connection->tx_out_size) {
+        int size = connection->tx_out_size > 0 ? connection->tx_out_size : len;
+        while (size < connection->tx_out_len + len) {
+            size *= 2;
+        }
+        uint8_t* buf = wish_platform_realloc(connection->tx_out_buf, size);
+        if (buf == NULL) {
+            WISHDEBUG(LOG_CRITICAL, "Memory allocation fail when keeping %i bytes to send", len);
+            return 1;
+        }
+        connection->tx_out_buf = buf;
+        connection->tx_out_size = size;
+    }
+    memcpy(connection->tx_out_buf + connection->tx_out_len, data, len);
+    connection->tx_out_len += len;
+    return 0;
+}
+
+int wish_connection_tx_buffered(wish_connection_t* connection, const uint8_t** data) {
+    if (data != NULL) {
+        *data = connection->tx_out_buf;
+    }
+    return connection->tx_out_len;
+}
+
+void wish_connection_tx_written(wish_connection_t* connection, int len) {
+    if (len >= connection->tx_out_len) {
+        /* All written, release the buffer until the transport is full again */
+        wish_platform_free(connection->tx_out_buf);
+        connection->tx_out_buf = NULL;
+        connection->tx_out_len = 0;
+        connection->tx_out_size = 0;
+        return;
+    }
+    memmove(connection->tx_out_buf, connection->tx_out_buf + len, connection->tx_out_len - len);
+    connection->tx_out_len -= len;
+}
+
 void wish_core_signal_tcp_event(wish_core_t* core, wish_connection_t* connection,  enum tcp_event ev) {
     WISHDEBUG(LOG_DEBUG, "TCP Event for connection id %d", connection->connection_id);
     switch (ev) {
     case TCP_CONNECTED: {
         WISHDEBUG(LOG_DEBUG, "Event TCP_CONNECTED");
 
+        if (!wish_race_transport_connected(core, connection)) {
+            /* Another transport to the same contact is already in handshake */
+            wish_close_connection(core, connection);
+            break;
+        }
+
         connection->outgoing = true;
         
         /* Start the whole show by sending the handshake bytes */
@@ -643,6 +712,18 @@ void wish_core_signal_tcp_event(wish_core_t* core, wish_connection_t* connection
         /* Delete any outstanding RPC request contexts */
         wish_cleanup_core_rpc_server(core, connection);
 
+        /* Free a message which was being reassembled from fragments */
+        wish_fragment_cleanup(core, connection);
+
+        /* Free the streams, and any data queued on them */
+        wish_stream_cleanup(core, connection);
+
+        /* Drop messages waiting to be coalesced, they cannot be sent anymore */
+        wish_batch_cleanup(core, connection);
+
+        /* Let the race go on with the other transports */
+        wish_race_connection_closed(core, connection);
+
         /* If the connection were to be closed when its protocol state is
          * PROTO_SERVER_STATE_DH, then we must free the server_dhm_context
          * here. Normally it is done when handling input from peer,
@@ -665,6 +746,16 @@ void wish_core_signal_tcp_event(wish_core_t* core, wish_connection_t* connection
             wish_platform_free(service);
         }
 
+        /* Free a partially received frame */
+        if (connection->rx_frame_buf != NULL) {
+            wish_platform_free(connection->rx_frame_buf);
+        }
+
+        /* Drop what the transport did not take, it cannot be sent anymore */
+        if (connection->tx_out_buf != NULL) {
+            wish_platform_free(connection->tx_out_buf);
+        }
+
         /* Empty the ring buffer */
         ring_buffer_skip(&(connection->rx_ringbuf), 
             ring_buffer_length(&(connection->rx_ringbuf)));
@@ -910,7 +1001,7 @@ void wish_core_handle_payload(wish_core_t* core, wish_connection_t* connection,
             }
 
             wish_debug_print_array(LOG_DEBUG, "Signature:", signature, ED25519_SIGNATURE_LEN);
-            wish_core_send_message(core, connection, signature, ED25519_SIGNATURE_LEN);
+            wish_core_send_message_class(core, connection, signature, ED25519_SIGNATURE_LEN, WISH_TX_CLASS_CONTROL);
 
             /* Then, check that we can read a frame whose length
              * corresponds to the server hash */
@@ -963,15 +1054,11 @@ void wish_core_handle_payload(wish_core_t* core, wish_connection_t* connection,
         /* Remote ID has been verified, lets start setting up Wish */
         {
 
-            const int plaintxt_len = 256;
-            unsigned char plaintxt[plaintxt_len];
-            /* Length of part of incoming payload containing cipher text */
-            int ciphertxt_len = len - AES_GCM_AUTH_TAG_LEN;
-            /* Pointer to the beginning of the auth_tag */
-            uint8_t* auth_tag = payload + ciphertxt_len;
+            /* The handshake is decrypted in place, the plain text
+             * starts at the beginning of payload */
+            uint8_t* plaintxt = payload;
 
-            if (wish_core_decrypt(core, connection, payload, ciphertxt_len, auth_tag,
-                AES_GCM_AUTH_TAG_LEN, plaintxt, plaintxt_len)) {
+            if (wish_core_decrypt_in_place(core, connection, payload, len)) {
 
                 WISHDEBUG(LOG_CRITICAL, "Decrypt fails in Wish handshake");
                 wish_close_connection(core, connection);
@@ -1016,32 +1103,19 @@ void wish_core_handle_payload(wish_core_t* core, wish_connection_t* connection,
 
             /* Length of part of incoming payload containing cipher text */
             int ciphertxt_len = len - AES_GCM_AUTH_TAG_LEN;
-            int plaintxt_len = ciphertxt_len;
-            /* Pointer to the beginning of the auth_tag */
-            uint8_t* auth_tag = payload + ciphertxt_len;
 
-            wish_debug_print_array(LOG_TRIVIAL, "Auth tag", auth_tag, AES_GCM_AUTH_TAG_LEN);
-
-            uint8_t* plaintxt = (uint8_t*) wish_platform_malloc(plaintxt_len);
-            if (plaintxt == NULL) {
-                WISHDEBUG(LOG_CRITICAL, "Could not allocate memory");
-                wish_close_connection(core, connection);
-                break;
-            }
-
-            int ret = wish_core_decrypt(core, connection, payload, ciphertxt_len, 
-                auth_tag, AES_GCM_AUTH_TAG_LEN, plaintxt, plaintxt_len);
+            /* The frame is decrypted where it sits, and the plain text
+             * is handed directly to the message processor */
+            int ret = wish_core_decrypt_in_place(core, connection, payload, len);
 
             if (ret) {
                 WISHDEBUG(LOG_CRITICAL, 
                     "There was an error while decrypting Wish message");
-                wish_platform_free(plaintxt);
                 wish_close_connection(core, connection);
                 break;
             }
-            wish_debug_print_array(LOG_TRIVIAL, "Plaintext", plaintxt, len);
-            wish_core_process_message(core, connection, plaintxt);
-            wish_platform_free(plaintxt);
+            wish_debug_print_array(LOG_TRIVIAL, "Plaintext", payload, ciphertxt_len);
+            wish_core_process_message(core, connection, payload);
         }
         break;
     case PROTO_SERVER_STATE_DH:
@@ -1108,7 +1182,7 @@ void wish_core_handle_payload(wish_core_t* core, wish_connection_t* connection,
             ed25519_sign(signature, connection->server_hash, SHA256_HASH_LEN,
                 local_privkey);
 
-            wish_core_send_message(core, connection, signature, ED25519_SIGNATURE_LEN);
+            wish_core_send_message_class(core, connection, signature, ED25519_SIGNATURE_LEN, WISH_TX_CLASS_CONTROL);
 
             connection->curr_protocol_state 
                 = PROTO_SERVER_STATE_VERIFY_CLIENT_HASH;
@@ -1178,7 +1252,7 @@ void wish_core_handle_payload(wish_core_t* core, wish_connection_t* connection,
             
             WISHDEBUG(LOG_DEBUG, "We have generated BSON message of len %d", bson_size(&bs));
 
-            if (wish_core_send_message(core, connection, handshake_msg, bson_size(&bs))) {
+            if (wish_core_send_message_class(core, connection, handshake_msg, bson_size(&bs), WISH_TX_CLASS_CONTROL)) {
                 /* Send error. Skip sending this time */
                 WISHDEBUG(LOG_CRITICAL, "Send fails in server state wish send handshake");
                 break;
@@ -1191,28 +1265,18 @@ void wish_core_handle_payload(wish_core_t* core, wish_connection_t* connection,
     case PROTO_SERVER_STATE_WISH_HANDSHAKE_READ_REPLY:
         WISHDEBUG(LOG_DEBUG, "In server handshake read reply phase");
         {
-            uint8_t* plaintxt = (uint8_t*) wish_platform_malloc(len);
-            if (plaintxt == NULL) {
-                WISHDEBUG(LOG_CRITICAL, "Out of memory in server handshake read reply phase");
-                wish_close_connection(core, connection);
-                break;
-            }
+            uint8_t* plaintxt = payload;
             int ciphertxt_len = len-AES_GCM_AUTH_TAG_LEN;
-             /* Pointer to the beginning of the auth_tag */
-            uint8_t* auth_tag = payload + ciphertxt_len;
 
-
-            int ret = wish_core_decrypt(core, connection, payload, ciphertxt_len, 
-                auth_tag, AES_GCM_AUTH_TAG_LEN, plaintxt, len);
+            int ret = wish_core_decrypt_in_place(core, connection, payload, len);
 
             if (ret) {
                 WISHDEBUG(LOG_CRITICAL, "There was an error while decrypting Wish message");
-                wish_platform_free(plaintxt);
                 wish_close_connection(core, connection);
                 break;
             }
 
-            wish_debug_print_array(LOG_TRIVIAL, "Got handshake reply OK", plaintxt, len);
+            wish_debug_print_array(LOG_TRIVIAL, "Got handshake reply OK", plaintxt, ciphertxt_len);
 
             bson_iterator it;
             
@@ -1220,14 +1284,12 @@ void wish_core_handle_payload(wish_core_t* core, wish_connection_t* connection,
             if (bson_find_from_buffer(&it, plaintxt, "host") != BSON_BINDATA) {
                 WISHDEBUG(LOG_CRITICAL, "We could not get the host field from client handshake");
                 bson_visit("We could not get the host field from client handshake", plaintxt);
-                wish_platform_free(plaintxt);
                 return;
             }
             
             if (bson_iterator_bin_len(&it) != WISH_WHID_LEN) {
                 WISHDEBUG(LOG_CRITICAL, "We could not get the host field from client handshake, invalid len");
                 bson_visit("We could not get the host field from client handshake, invalid len", plaintxt);
-                wish_platform_free(plaintxt);
                 return;
             }
 
@@ -1238,10 +1300,11 @@ void wish_core_handle_payload(wish_core_t* core, wish_connection_t* connection,
                 memcpy(connection->rhid, host_id, WISH_WHID_LEN);
             } else {
                 WISHDEBUG(LOG_CRITICAL, "Bad hostid length in client handshake");
-                wish_platform_free(plaintxt);
                 return;
             }
             
+            wish_core_update_features_from_handshake(core, connection, plaintxt);
+
             /* Update transports if we have a normal connection */
             if (connection->friend_req_connection == false) {
                 wish_core_update_transports_from_handshake(core, connection, plaintxt);
@@ -1266,7 +1329,6 @@ void wish_core_handle_payload(wish_core_t* core, wish_connection_t* connection,
                 }
             }
             /* Finished processing the handshake */
-            wish_platform_free(plaintxt);         
         }
         break;
     case PROTO_STATE_INITIAL:
@@ -1296,6 +1358,63 @@ uint16_t uint16_native2be(uint16_t in) {
  * @return 0, if sending succeeds, else non-zero for an error
  */
 int wish_core_send_message(wish_core_t* core, wish_connection_t* connection, const uint8_t* payload_clrtxt, int payload_len) {
+    return wish_core_send_message_class(core, connection, payload_clrtxt, payload_len, WISH_TX_CLASS_NORMAL);
+}
+
+/**
+ * @return 0, if sending succeeds, else non-zero for an error
+ */
+int wish_core_send_message_class(wish_core_t* core, wish_connection_t* connection, const uint8_t* payload_clrtxt, int payload_len, enum wish_tx_class tx_class) {
+    if (tx_class != WISH_TX_CLASS_CONTROL) {
+        int batched = wish_batch_add(core, connection, payload_clrtxt, payload_len);
+        if (batched > 0) {
+            /* The message is sent with others later in this event loop
+             * iteration. The batch is compressed as a whole. */
+            return 0;
+        }
+        if (batched < 0) {
+            /* The earlier batch was lost, and the connection closed */
+            return 1;
+        }
+    }
+
+    int compressed_len = 0;
+    uint8_t* compressed = wish_compress_message(connection, payload_clrtxt, payload_len, &compressed_len);
+    if (compressed != NULL) {
+        payload_clrtxt = compressed;
+        payload_len = compressed_len;
+    }
+
+    int ret = 0;
+    if (payload_len > WISH_FRAME_MAX_PAYLOAD_LEN) {
+        ret = wish_fragment_send(core, connection, payload_clrtxt, payload_len, tx_class);
+    }
+    else {
+        ret = wish_core_send_frame_class(core, connection, payload_clrtxt, payload_len, tx_class);
+    }
+
+    if (compressed != NULL) {
+        wish_platform_free(compressed);
+    }
+    return ret;
+}
+
+/**
+ * @return 0, if sending succeeds, else non-zero for an error
+ */
+int wish_core_send_frame(wish_core_t* core, wish_connection_t* connection, const uint8_t* payload_clrtxt, int payload_len) {
+    return wish_core_send_frame_class(core, connection, payload_clrtxt, payload_len, WISH_TX_CLASS_NORMAL);
+}
+
+/**
+ * @return 0, if sending succeeds, else non-zero for an error
+ */
+int wish_core_send_frame_class(wish_core_t* core, wish_connection_t* connection, const uint8_t* payload_clrtxt, int payload_len, enum wish_tx_class tx_class) {
+    if (payload_len > WISH_FRAME_MAX_PAYLOAD_LEN) {
+        WISHDEBUG(LOG_CRITICAL, "Payload of len %d does not fit in a frame", payload_len);
+        return 1;
+    }
+
     if (connection->context_state == WISH_CONTEXT_FREE) {
         WISHDEBUG(LOG_CRITICAL, "Attempt to send data on a connection which is not connected");
         return 1;
@@ -1306,6 +1425,16 @@ int wish_core_send_message(wish_core_t* core, wish_connection_t* connection, con
         return 1;
     }
     
+    /* Messages coalesced earlier must go out before this frame. This
+     * also lets a control frame overtake nothing but the batch, which
+     * is sent first. */
+    if (connection->tx_batch_len > 0 && wish_batch_flush(core, connection)) {
+        /* The batch is lost, so this frame must not be delivered either */
+        WISHDEBUG(LOG_CRITICAL, "Sending batch failed, closing connection");
+        wish_close_connection(core, connection);
+        return 1;
+    }
+    
     mbedtls_gcm_context aes_gcm_ctx;
     mbedtls_gcm_init(&aes_gcm_ctx);
     WISHDEBUG(LOG_DEBUG, "send payload len %d", payload_len);
@@ -1353,6 +1482,8 @@ int wish_core_send_message(wish_core_t* core, wish_connection_t* connection, con
         /* Sending not failed */
         WISHDEBUG(LOG_DEBUG, "Sent %d", frame_len);
         update_nonce(connection->aes_gcm_iv_out+4);
+        connection->tx_stats[tx_class].frames++;
+        connection->tx_stats[tx_class].bytes += frame_len;
     }
     else {
         WISHDEBUG(LOG_CRITICAL, "Porting layer send function reported failure");
@@ -1414,6 +1545,23 @@ size_t plaintxt_len) {
     return 0;
 }
 
+int wish_core_decrypt_in_place(wish_core_t* core, wish_connection_t* ctx, uint8_t* frame, size_t frame_len) {
+    if (frame_len < AES_GCM_AUTH_TAG_LEN) {
+        WISHDEBUG(LOG_CRITICAL, "Frame too short to contain auth tag, len=%i", frame_len);
+        return WISH_CORE_DECRYPT_FAIL;
+    }
+
+    /* Length of part of the frame containing cipher text */
+    size_t ciphertxt_len = frame_len - AES_GCM_AUTH_TAG_LEN;
+    /* Pointer to the beginning of the auth_tag */
+    uint8_t* auth_tag = frame + ciphertxt_len;
+
+    /* mbedtls GCM allows the output buffer to be the same as the input
+     * buffer, so the plain text can overwrite the cipher text */
+    return wish_core_decrypt(core, ctx, frame, ciphertxt_len, auth_tag, 
+            AES_GCM_AUTH_TAG_LEN, frame, ciphertxt_len);
+}
+
 /* This function returns the wish context associated with the provided
  * remote IP, remote port, local IP, local port. If no matching wish
  * context is found, return NULL. */
@@ -1466,7 +1614,9 @@ void wish_core_init(wish_core_t* core) {
     
     wish_core_get_host_id(core, id);
     
-    core->time_db = NULL;
+    wish_time_init(core);
+    
+    wish_identity_db_init(core);
     
     core->wish_server_port = core->wish_server_port == 0 ? 37009 : core->wish_server_port;
     
@@ -1502,6 +1652,10 @@ int wish_core_get_rx_buffer_free(wish_core_t* core, wish_connection_t* connectio
     return ring_buffer_space(&(connection->rx_ringbuf));
 }
 
+int wish_core_get_rx_buffer_used(wish_core_t* core, wish_connection_t* connection) {
+    return ring_buffer_length(&(connection->rx_ringbuf));
+}
+
 
 void wish_connections_close_all(wish_core_t* core) {
     int i = 0;
@@ -81,6 +81,32 @@ enum tcp_event {
     TCP_RELAY_SESSION_CONNECTED,
 };
 
+/* Optional protocol features, announced by each core as a bit field in
+ * the Wish handshake: { features: int32 } */
+#define WISH_FEATURE_FRAGMENT   0x1   /* Accepts fragmented messages, see wish_fragment.h */
+#define WISH_FEATURE_STREAM     0x2   /* Accepts multiplexed streams, see wish_stream.h */
+#define WISH_FEATURE_COMPRESS   0x4   /* Accepts compressed messages, see wish_compress.h */
+#define WISH_FEATURE_BATCH      0x8   /* Accepts batches of messages, see wish_batch.h */
+
+/* Priority classes of outgoing messages. Control messages (handshake,
+ * ping, pong) are sent immediately. Normal messages may be coalesced
+ * for the rest of the event loop iteration, see wish_batch.h. Bulk data
+ * is queued on streams, see wish_stream.h. A frame is never queued
+ * behind data of a lower class. */
+enum wish_tx_class {
+    WISH_TX_CLASS_CONTROL,
+    WISH_TX_CLASS_NORMAL,
+    WISH_TX_CLASS_BULK,
+    WISH_TX_CLASSES  /* The number of classes */
+};
+
+/* Counters of frames sent in one priority class. 64 bits, so that they
+ * do not wrap on a long-lived connection with bulk traffic. */
+struct wish_tx_stats {
+    uint64_t frames;
+    uint64_t bytes;
+};
+
 #define SHA256_HASH_LEN 32
 #define ED25519_SIGNATURE_LEN 64
 
@@ -107,6 +133,13 @@ enum wish_context_state {
 
 #define RX_RINGBUF_LEN (WISH_PORT_RX_RB_SZ)
 
+/* Define the maximum number of bytes kept for a connection whose
+ * transport is not writable, see wish_connection_tx_keep(). It must
+ * leave room for the frames of the largest message. */
+#ifndef WISH_PORT_TX_OUT_MAX
+#define WISH_PORT_TX_OUT_MAX ( 2*WISH_PORT_MAX_MESSAGE_SZ )
+#endif
+
 #include "wish_identity.h"
 
 typedef struct wish_context wish_connection_t;
@@ -145,6 +178,10 @@ struct wish_context {
     uint8_t remote_ip_addr[4];     /* remote party's IP address */
     ring_buffer_t rx_ringbuf;
     uint8_t rx_ringbuf_backing[RX_RINGBUF_LEN];
+    /* The payload of the frame being received, moved out of rx_ringbuf
+     * as it arrives */
+    uint8_t* rx_frame_buf;
+    int rx_frame_len;
     /* Client hash and server hash are saved here because of convenience
      * They could be "downgraded" to pointers pointing to buffers allocated from
      * heap */
@@ -168,11 +205,36 @@ struct wish_context {
      * contexts which are opened for accepting an incoming connection
      * via the a relay server */
     wish_relay_client_t *relay;
+    /* The race this outgoing connection is part of, see wish_race.h. NULL if none. */
+    struct wish_connection_race* race;
     /** This flag must be set to true when you open a connection to a
      * peer in order to send a friend request */
     bool friend_req_connection;
     const char* friend_req_meta;
     wish_remote_app* apps;
+    /* Bit field of WISH_FEATURE_* flags announced by the remote core
+     * in its handshake */
+    uint32_t remote_features;
+    /* Reassembly of a fragmented incoming message, see wish_fragment.h.
+     * rx_fragment_total is 0 when no message is being reassembled. */
+    uint8_t* rx_fragment_buf;
+    int32_t rx_fragment_len;
+    int32_t rx_fragment_total;
+    /* Multiplexed streams, see wish_stream.h. Outgoing streams are
+     * numbered by us, incoming streams by the remote core. */
+    struct wish_stream* tx_streams;
+    struct wish_stream* rx_streams;
+    int32_t tx_stream_next_id;
+    /* Small outgoing messages waiting to be sent in one frame, see wish_batch.h */
+    uint8_t* tx_batch;
+    int tx_batch_len;
+    int tx_batch_count;
+    /* Frames sent, per priority class */
+    struct wish_tx_stats tx_stats[WISH_TX_CLASSES];
+    /* The bytes of frames which the transport did not take yet, see wish_connection_tx_keep() */
+    uint8_t* tx_out_buf;
+    int tx_out_len;
+    int tx_out_size;
 #ifdef WISH_CORE_DEBUG
     int bytes_in;
     int bytes_out;
@@ -190,8 +252,13 @@ struct wish_peer {
 /* Start an instance of wish communication */
 wish_connection_t* wish_connection_init(wish_core_t* core, const uint8_t* luid, const uint8_t* ruid);
 
-/* Feed raw data into wish core */
-void wish_core_feed(wish_core_t* core, wish_connection_t* h, unsigned char* data, int len);
+/* Feed raw data into wish core.
+ *
+ * Returns the number of bytes accepted. This is less than len when the
+ * receive ring buffer is full; the caller must then keep the rest, and
+ * stop reading from the transport until wish_core_process_data() has
+ * made room (see wish_core_get_rx_buffer_free()). */
+int wish_core_feed(wish_core_t* core, wish_connection_t* h, unsigned char* data, int len);
 
 /* This function will process data saved into the ringbuffer by function
  * wish_core_feed. 
@@ -210,6 +277,27 @@ unsigned char*, int), void* arg);
 
 void wish_core_signal_tcp_event(wish_core_t* core, wish_connection_t* h, enum tcp_event);
 
+/**
+ * Keep the bytes of a frame which the transport cannot write now. The
+ * port's send function calls this on a short write, and then reports
+ * the frame as sent. While bytes are kept, the send function must keep
+ * the next frames too instead of writing them, so that the frames stay
+ * in order, and refuse frames once WISH_PORT_TX_OUT_MAX bytes are kept.
+ * The port writes the kept bytes when the transport is writable, see
+ * wish_connection_tx_buffered() and wish_connection_tx_written().
+ * Streams send no chunks while bytes are kept.
+ *
+ * @return 0 on success, non-zero if memory allocation fails. The
+ * connection cannot go on then, as part of a frame may have been written.
+ */
+int wish_connection_tx_keep(wish_connection_t* connection, const uint8_t* data, int len);
+
+/** Returns the number of bytes kept for writing, and sets *data to them unless data is NULL */
+int wish_connection_tx_buffered(wish_connection_t* connection, const uint8_t** data);
+
+/** Drop the first len of the kept bytes, once the port has written them */
+void wish_connection_tx_written(wish_connection_t* connection, int len);
+
 void wish_core_handle_payload(wish_core_t* core, wish_connection_t* ctx, uint8_t* payload, int len);
 
 /* Decrypt a "Wish frame" - 
@@ -218,16 +306,56 @@ int wish_core_decrypt(wish_core_t* core, wish_connection_t* ctx, uint8_t* cipher
 ciphertxt_len, uint8_t* auth_tag, size_t auth_tag_len, uint8_t* plaintxt,
 size_t plaintxt_len );
 
+/**
+ * Decrypt a "Wish frame" in place.
+ *
+ * The frame consists of the cipher text immediately followed by the
+ * AES GCM auth tag, just as it is read from the wire. The plain text
+ * overwrites the cipher text, so the returned plain text starts at
+ * frame and is frame_len - AES_GCM_AUTH_TAG_LEN bytes long.
+ *
+ * @return 0 on success, WISH_CORE_DECRYPT_FAIL if the frame could not
+ * be decrypted or authenticated
+ */
+int wish_core_decrypt_in_place(wish_core_t* core, wish_connection_t* ctx, uint8_t* frame, size_t frame_len);
+
 /**
  * Send a payload using the Wish connection.
  * 
  * Send data over wish connection. It will encrypt the payload, and construct a f
- * rame with payload length, the encrypted payload and auth_tag.
+ * rame with payload length, the encrypted payload and auth_tag. Payloads
+ * are compressed if the remote core supports it, and payloads which do
+ * not fit into one frame are sent as fragments.
  *
  * @return 0, if sending succeeded, non-zero if fail. This is directly
  * the return value of the platform-specific sending function
  */
 int wish_core_send_message(wish_core_t* core, wish_connection_t* ctx, const uint8_t* payload_clrtxt, int payload_len);
+
+/**
+ * Send a payload using the Wish connection, in the given priority class.
+ *
+ * wish_core_send_message() sends in WISH_TX_CLASS_NORMAL. Use
+ * WISH_TX_CLASS_CONTROL for messages which must not be delayed, such
+ * as ping and pong.
+ *
+ * @return 0, if sending succeeded (or the message was queued), non-zero if fail.
+ */
+int wish_core_send_message_class(wish_core_t* core, wish_connection_t* ctx, const uint8_t* payload_clrtxt, int payload_len, enum wish_tx_class tx_class);
+
+/**
+ * Send a payload in exactly one Wish frame.
+ *
+ * The payload must not be longer than WISH_FRAME_MAX_PAYLOAD_LEN.
+ * Normally you should use wish_core_send_message(), which will
+ * fragment payloads which do not fit into one frame.
+ *
+ * @return 0, if sending succeeded, non-zero if fail.
+ */
+int wish_core_send_frame(wish_core_t* core, wish_connection_t* ctx, const uint8_t* payload_clrtxt, int payload_len);
+
+/** Send a payload in exactly one Wish frame, counted in the given priority class */
+int wish_core_send_frame_class(wish_core_t* core, wish_connection_t* ctx, const uint8_t* payload_clrtxt, int payload_len, enum wish_tx_class tx_class);
     
 uint16_t uint16_native2be(uint16_t);
 
@@ -279,3 +407,8 @@ void wish_core_init(wish_core_t* core);
  * This function returns the number of bytes free in the ring buffer 
  */
 int wish_core_get_rx_buffer_free(wish_core_t* core, wish_connection_t* connection);
+
+/*
+ * This function returns the number of bytes waiting to be processed in the ring buffer
+ */
+int wish_core_get_rx_buffer_used(wish_core_t* core, wish_connection_t* connection);
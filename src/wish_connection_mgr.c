@@ -23,70 +23,41 @@
 #include "bson.h"
 #include "bson_visit.h"
 #include "wish_connection_mgr.h"
+#include "wish_race.h"
+#include "wish_reconnect.h"
 #include "string.h"
 
+static void (*dns_cache_get_stats_fn)(wish_core_t* core, struct wish_dns_cache_stats* stats);
+
+void wish_dns_cache_set_get_stats(void (*fn)(wish_core_t* core, struct wish_dns_cache_stats* stats)) {
+    dns_cache_get_stats_fn = fn;
+}
+
+void wish_dns_cache_get_stats(wish_core_t* core, struct wish_dns_cache_stats* stats) {
+    memset(stats, 0, sizeof(struct wish_dns_cache_stats));
+    if (dns_cache_get_stats_fn != NULL) {
+        dns_cache_get_stats_fn(core, stats);
+    }
+}
+
 void wish_connections_init(wish_core_t* core) {
     core->connection_pool = wish_platform_malloc(sizeof(wish_connection_t)*WISH_CONTEXT_POOL_SZ);
     memset(core->connection_pool, 0, sizeof(wish_connection_t)*WISH_CONTEXT_POOL_SZ);
     core->next_conn_id = 1;
     
+    core->admission_db = wish_platform_malloc(sizeof(struct wish_admission_entry)*WISH_PORT_ADMISSION_TABLE_SZ);
+    memset(core->admission_db, 0, sizeof(struct wish_admission_entry)*WISH_PORT_ADMISSION_TABLE_SZ);
+    
     wish_core_time_set_interval(core, &check_connection_liveliness, NULL, 1);
+    
+    wish_race_init(core);
+    wish_reconnect_init(core);
 }
 
 void wish_connections_check(wish_core_t* core) {
-    int num_uids_in_db = wish_get_num_uid_entries();
-    wish_uid_list_elem_t uid_list[num_uids_in_db];
-    int num_uids = wish_load_uid_list(uid_list, num_uids_in_db);
-
-    int i = 0;
-
-    int j;
-    for (j = 0; j < num_uids; j++) {
-        if (i == j) { continue; }
-        if( wish_core_is_connected_luid_ruid(core, uid_list[0].uid, uid_list[j].uid) ) { continue; }
-        
-        wish_identity_t id;
-        if (wish_identity_load(uid_list[j].uid, &id) != RET_SUCCESS) {
-            WISHDEBUG(LOG_CRITICAL, "Failed loading identity");
-            wish_identity_destroy(&id);
-            return;
-        }
-        
-        /* Check if we should connect, meta: { connect: false } */
-        
-        if (wish_identity_get_meta_connect(&id) == false) {
-            WISHDEBUG(LOG_CRITICAL, "check connections: will not connect, %s flagged as 'do not connect'", id.alias);
-            wish_identity_destroy(&id);
-            continue;
-        }
-        
-        /* Check if we should connect, permissions: { banned: true } */
-        if (wish_identity_is_banned(&id) == true) {
-            WISHDEBUG(LOG_CRITICAL, "check connections, will not connect, %s is flagged as 'banned'", id.alias);
-            wish_identity_destroy(&id);
-            continue;
-        }
-        
-#if 0
-        /* Check if we should connect to a , meta: { unconfirmedFriendRequest: true } */
-        if (wish_identity_has_meta_unconfirmed_friend_request_flag(&id) == true) {
-            WISHDEBUG(LOG_CRITICAL, "check connections, will not connect, %s is flagged as 'outgoingFriendRequest'", id.alias);
-            wish_identity_destroy(&id);
-            continue;
-        }        
-#endif        
-                
-        for (int cnt = 0; cnt < WISH_MAX_TRANSPORTS; cnt++) {
-            int url_len = strnlen(id.transports[cnt], WISH_MAX_TRANSPORT_LEN);
-            if (url_len > 0) {
-                char* url = id.transports[cnt];
-                //WISHDEBUG(LOG_CRITICAL, "  Should connect %02x %02x > %02x %02x to %s", uid_list[0].uid[0], uid_list[0].uid[1], uid_list[j].uid[0], uid_list[j].uid[1], url);
-
-                wish_connections_connect_transport(core, uid_list[0].uid, uid_list[j].uid, url);
-            }
-        }
-        wish_identity_destroy(&id);
-    }
+    /* Pick up new and removed contacts, and retry all contacts right away */
+    wish_reconnect_sync(core);
+    wish_reconnect_hint_all(core);
 }
 
 /* This function will check the connections and send a 'ping' if they
@@ -114,7 +85,7 @@ void check_connection_liveliness(wish_core_t* core, void* ctx) {
                 
                 bson_finish(&ping);
                 
-                wish_core_send_message(core, connection, bson_data(&ping), bson_size(&ping));
+                wish_core_send_message_class(core, connection, bson_data(&ping), bson_size(&ping), WISH_TX_CLASS_CONTROL);
                 connection->ping_sent_timestamp = core->core_time;
             }
 
@@ -151,6 +122,71 @@ void check_connection_liveliness(wish_core_t* core, void* ctx) {
     }
 }
 
+/* An incoming connection which has not yet completed the handshake.
+ * Outgoing connections have outgoing == false until connected, but
+ * they are then in one of the connecting states. */
+static bool is_incoming_handshake(wish_connection_t* connection) {
+    return connection->context_state == WISH_CONTEXT_IN_MAKING
+        && !connection->outgoing
+        && !connection->via_relay
+        && connection->curr_transport_state != TRANSPORT_STATE_INITIAL
+        && connection->curr_transport_state != TRANSPORT_STATE_CONNECTING
+        && connection->curr_transport_state != TRANSPORT_STATE_RESOLVING;
+}
+
+bool wish_connections_admit_incoming(wish_core_t* core, const uint8_t remote_ip[4]) {
+    int pending = 0;
+    int i = 0;
+    for (i = 0; i < WISH_CONTEXT_POOL_SZ; i++) {
+        if (is_incoming_handshake(&(core->connection_pool[i]))) {
+            pending++;
+        }
+    }
+    
+    if (pending >= WISH_PORT_MAX_PENDING_HANDSHAKES) {
+        WISHDEBUG(LOG_CRITICAL, "Admission: %i handshakes in progress, refusing connection from %u.%u.%u.%u", 
+                pending, remote_ip[0], remote_ip[1], remote_ip[2], remote_ip[3]);
+        return false;
+    }
+    
+    /* Find the entry of remote_ip, or else the entry whose interval started first (unused entries have 0) */
+    struct wish_admission_entry* entry = NULL;
+    struct wish_admission_entry* oldest = &(core->admission_db[0]);
+    for (i = 0; i < WISH_PORT_ADMISSION_TABLE_SZ; i++) {
+        struct wish_admission_entry* e = &(core->admission_db[i]);
+        if (e->window_start != 0 && memcmp(e->ip, remote_ip, 4) == 0) {
+            entry = e;
+            break;
+        }
+        if (e->window_start < oldest->window_start) {
+            oldest = e;
+        }
+    }
+    
+    /* Note: core_time may be 0 right after startup, hence the +1 to keep the entry marked as used */
+    wish_time_t now = core->core_time + 1;
+    
+    if (entry == NULL) {
+        entry = oldest;
+        memcpy(entry->ip, remote_ip, 4);
+        entry->window_start = now;
+        entry->count = 0;
+    }
+    else if (now >= entry->window_start + WISH_HANDSHAKE_RATE_INTERVAL) {
+        entry->window_start = now;
+        entry->count = 0;
+    }
+    
+    if (entry->count >= WISH_PORT_HANDSHAKE_RATE_PER_IP) {
+        WISHDEBUG(LOG_CRITICAL, "Admission: rate limit exceeded, refusing connection from %u.%u.%u.%u", 
+                remote_ip[0], remote_ip[1], remote_ip[2], remote_ip[3]);
+        return false;
+    }
+    
+    entry->count++;
+    return true;
+}
+
 return_t wish_connections_connect_transport(wish_core_t* core, uint8_t *luid, uint8_t *ruid, char* transport) {
     
     wish_identity_t lu;
@@ -171,27 +207,32 @@ return_t wish_connections_connect_transport(wish_core_t* core, uint8_t *luid, ui
     
     if (connection != NULL) {
         //WISHDEBUG(LOG_CRITICAL, "Connection attempt: %s > %s (%u.%u.%u.%u:%hu)", lu.alias, ru.alias, ip->addr[0], ip->addr[1], ip->addr[2], ip->addr[3], port);
-        
-        wish_ip_addr_t ip;
-        uint16_t port;
-        size_t transport_len = strnlen(transport, WISH_MAX_TRANSPORT_LEN);
-        
-        return_t parse_ret = wish_parse_transport_ip_port(transport, transport_len, &ip, &port);
+        return wish_connections_open_transport(core, connection, transport);
+    }
+    
+    return RET_SUCCESS;
+}
+
+return_t wish_connections_open_transport(wish_core_t* core, wish_connection_t* connection, const char* transport) {
+    wish_ip_addr_t ip;
+    uint16_t port;
+    size_t transport_len = strnlen(transport, WISH_MAX_TRANSPORT_LEN);
+    
+    return_t parse_ret = wish_parse_transport_ip_port(transport, transport_len, &ip, &port);
+    if (parse_ret == RET_SUCCESS) {
+        /* Connect using the ip address, as the tranport clearly is an ip. */
+        wish_open_connection(core, connection, &ip, port, false);
+    }
+    else {
+        char host[WISH_MAX_TRANSPORT_LEN] = { 0 };
+        parse_ret = wish_parse_transport_host_port(transport, transport_len, host, &port);
         if (parse_ret == RET_SUCCESS) {
-            /* Connect using the ip address, as the tranport clearly is an ip. */
-            wish_open_connection(core, connection, &ip, port, false);
+            wish_open_connection_dns(core, connection, host, port, false);
         }
         else {
-            char host[WISH_MAX_TRANSPORT_LEN] = { 0 };
-            parse_ret = wish_parse_transport_host_port(transport, transport_len, host, &port);
-            if (parse_ret == RET_SUCCESS) {
-                wish_open_connection_dns(core, connection, host, port, false);
-            }
-            else {
-                WISHDEBUG(LOG_CRITICAL, "Cannot connect, the transport parsing fails for IP and hostname.");
-                wish_close_connection(core, connection);
-                return RET_FAIL;
-            }
+            WISHDEBUG(LOG_CRITICAL, "Cannot connect, the transport parsing fails for IP and hostname.");
+            wish_close_connection(core, connection);
+            return RET_FAIL;
         }
     }
     
@@ -33,6 +33,44 @@
 /** Timeout of a friend request connection */
 #define FRIEND_REQ_TIMEOUT 300 /* Seconds */
 
+/* Admission control of incoming connections, see wish_connections_admit_incoming() */
+
+/** The maximum number of incoming connections which may be in handshake at the same time */
+#ifndef WISH_PORT_MAX_PENDING_HANDSHAKES
+#define WISH_PORT_MAX_PENDING_HANDSHAKES 16
+#endif
+
+/** The maximum number of incoming connections accepted from one IP address per WISH_HANDSHAKE_RATE_INTERVAL */
+#ifndef WISH_PORT_HANDSHAKE_RATE_PER_IP
+#define WISH_PORT_HANDSHAKE_RATE_PER_IP 5
+#endif
+
+#define WISH_HANDSHAKE_RATE_INTERVAL 10 /* seconds */
+
+/** The number of source IP addresses for which the handshake rate is tracked */
+#ifndef WISH_PORT_ADMISSION_TABLE_SZ
+#define WISH_PORT_ADMISSION_TABLE_SZ 32
+#endif
+
+/* Statistics of the port's DNS answer cache */
+struct wish_dns_cache_stats {
+    /* The number of names currently cached */
+    int32_t entries;
+    /* Lookups answered from the cache with an address */
+    int32_t hits;
+    /* Lookups answered from the cache with "no such name" */
+    int32_t negative_hits;
+    /* Lookups which had to be resolved */
+    int32_t misses;
+};
+
+struct wish_admission_entry {
+    uint8_t ip[4];
+    /* Start of the current rate interval, 0 if entry is unused */
+    wish_time_t window_start;
+    int count;
+};
+
 /* Wish connection manager interface.
  * These functions will usually be implemented in port-specific code */
 
@@ -43,6 +81,13 @@ void wish_connections_init(wish_core_t* core);
 int wish_open_connection(wish_core_t* core, wish_connection_t* connection, wish_ip_addr_t *ip, uint16_t port, bool via_relay);
 
 int wish_open_connection_dns(wish_core_t* core, wish_connection_t* connection, char* host, uint16_t port, bool via_relay);
+
+/* Set by ports which cache DNS answers: fn fills in the statistics of the cache */
+void wish_dns_cache_set_get_stats(void (*fn)(wish_core_t* core, struct wish_dns_cache_stats* stats));
+
+/* Get the statistics of the DNS answer cache. Ports without a cache
+ * report all zeros. */
+void wish_dns_cache_get_stats(wish_core_t* core, struct wish_dns_cache_stats* stats);
     
 int wish_send_advertizement(wish_core_t* core, uint8_t *ad, size_t ad_len);
 
@@ -51,10 +96,28 @@ void wish_close_connection(wish_core_t* core, wish_connection_t* connection);
 
 void wish_connections_close_all(wish_core_t* core);
 
+/* Sync the reconnect scheduler with the identity database, and retry
+ * connecting to all contacts right away. Call when the network has
+ * changed; the scheduler otherwise reconnects by itself. */
 void wish_connections_check(wish_core_t* core);
 
 void check_connection_liveliness(wish_core_t* core, void* ctx);
 
+/**
+ * Decide if an incoming connection from remote_ip may be accepted.
+ *
+ * The porting layer should call this after accepting a TCP connection
+ * to the Wish server port, before wish_connection_init(), and close
+ * the socket right away if the connection is not admitted. This keeps
+ * reconnect storms and scanners from tying up connection contexts and
+ * DH computations.
+ *
+ * @return true if the connection is admitted; false if there are
+ * already WISH_PORT_MAX_PENDING_HANDSHAKES incoming connections in
+ * handshake, or remote_ip has exceeded WISH_PORT_HANDSHAKE_RATE_PER_IP
+ */
+bool wish_connections_admit_incoming(wish_core_t* core, const uint8_t remote_ip[4]);
+
 /**
  * Get the local host IP addr formatted as a C string. The retuned
  * address should be the one which is the subnet having the host's
@@ -74,4 +137,7 @@ void wish_set_host_port(wish_core_t* core, uint16_t port);
 
 return_t wish_connections_connect_transport(wish_core_t* core, uint8_t *luid, uint8_t *ruid, char* transport);
 
+/* Open the transport of a connection returned by wish_connection_init(). If the transport cannot be parsed, the connection is closed and RET_FAIL returned. */
+return_t wish_connections_open_transport(wish_core_t* core, wish_connection_t* connection, const char* transport);
+
 void wish_close_parallel_connections(wish_core_t* core, void *connection);
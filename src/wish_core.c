@@ -14,27 +14,37 @@
  */
 #include "wish_core.h"
 #include "wish_identity.h"
+#include "wish_platform.h"
+#include "wish_local_discovery.h"
+#include "wish_debug.h"
 
 #include "string.h"
 
 int wish_core_update_identities(wish_core_t* core) {
     
-    core->num_ids = wish_get_num_uid_entries();
-    //printf("Number of identities in db: %i\n", num_ids);
-
-    /* Load local user database (UID list) */
-    memset(core->uid_list, 0, sizeof(core->uid_list));
-    core->loaded_num_ids = wish_load_uid_list(core->uid_list, core->num_ids);
+    /* Load local user database (UID list). The list is built from the
+     * index of the identity database, which is read with a single pass
+     * over the file when the database is opened; no identity is loaded. */
+    wish_uid_list_elem_t* uid_list = NULL;
+    int num_ids = wish_load_uid_list_alloc(&uid_list);
     
-    //printf("Number of loaded identities: %i\n", core->loaded_num_ids);
+    if (num_ids < 0) {
+        WISHDEBUG(LOG_CRITICAL, "Could not load the uid list, keeping the old one");
+        return -1;
+    }
     
-    int i = 0;
-    for (i = 0; i < core->num_ids; i++) {
-        wish_identity_t id;
-        memset(&id, 0, sizeof (wish_identity_t));
-        return_t load_retval = wish_identity_load(core->uid_list[i].uid, &id);
-        wish_identity_destroy(&id);
+    if (core->uid_list != NULL) {
+        wish_platform_free(core->uid_list);
     }
     
+    core->uid_list = uid_list;
+    core->num_ids = num_ids;
+    core->loaded_num_ids = num_ids;
+    
+    /* Identities may have been added, replaced or removed */
+    wish_ldiscover_invalidate(core, NULL);
+    
+    //printf("Number of loaded identities: %i\n", core->loaded_num_ids);
+    
     return 0;
 }
@@ -68,15 +68,35 @@ struct wish_core;
 typedef uint32_t wish_time_t;
 #define WISH_TIME_T_MAX UINT32_MAX
 
+/* Milliseconds since core startup */
+typedef uint64_t wish_time_ms_t;
+
+/* A timer, see wish_time.h */
 typedef struct wish_timer_db {
     void (*cb)(struct wish_core* core, void* ctx);
     void *cb_ctx;
-    wish_time_t time;
-    wish_time_t interval;
+    /* The expiry time, and the interval of a periodic timer, in milliseconds */
+    wish_time_ms_t time;
+    wish_time_ms_t interval;
     bool singleShot;
+    /* False once the timer has been cancelled, or a single shot timer has run */
+    bool active;
+    /* Changed each time the node is taken from the pool */
+    uint32_t id;
+    /* The wheel slot the timer is in, NULL while its callback is running */
+    struct wish_timer_db** slot;
+    struct wish_timer_db* prev;
     struct wish_timer_db* next;
 } wish_timer_db_t;
 
+/* A timer, as returned when it is set. The node may have been reused
+ * for another timer once this one has run or has been cancelled; the
+ * id tells them apart. A zeroed handle refers to no timer. */
+typedef struct wish_timer_handle {
+    wish_timer_db_t* node;
+    uint32_t id;
+} wish_timer_handle_t;
+
 typedef int wish_connection_id_t;
 
 typedef enum wish_discovery_type {
@@ -98,10 +118,12 @@ typedef struct wish_claim_t {
 
 struct wish_context;
 struct wish_ldiscover_t;
+struct wish_ldiscover_advert;
 struct wish_relationship_t;
 struct wish_relay_client_ctx;
 struct wish_acl;
 struct wish_directory;
+struct wish_commit;
 
 /**
  * Wish Core object
@@ -119,7 +141,8 @@ typedef struct wish_core {
     /* Identities */
     int num_ids;
     int loaded_num_ids;
-    wish_uid_list_elem_t uid_list[WISH_PORT_MAX_UIDS];
+    /* The uids in the identity database, allocated to fit by wish_core_update_identities() */
+    wish_uid_list_elem_t* uid_list;
     
     /* RPC Servers */
     #ifdef WISH_RPC_SERVER_STATIC_REQUEST_POOL
@@ -138,11 +161,17 @@ typedef struct wish_core {
     
     /* The number of seconds since core startup is stored here */
     wish_time_t core_time;
-    wish_timer_db_t* time_db;
+    struct wish_timer_wheel* timer_wheel;
 
     /* Connections */
     struct wish_context* connection_pool;
     wish_connection_id_t next_conn_id;
+    /* Handshake rate per source IP, see wish_connections_admit_incoming() */
+    struct wish_admission_entry* admission_db;
+    /* Outgoing connection attempts in progress, see wish_race.h */
+    struct wish_connection_race* race_db;
+    /* Contacts to keep connected to, see wish_reconnect.h */
+    struct wish_reconnect* reconnect_db;
     
     /* Instantiate Relay client to a server with specied IP addr and port */
     struct wish_relay_client_ctx* relay_db;
@@ -150,6 +179,8 @@ typedef struct wish_core {
     /* Local discovery */
     bool ldiscover_allowed;
     struct wish_ldiscover_t* ldiscovery_db;
+    /* The advert messages of local identities, see wish_local_discovery.h */
+    struct wish_ldiscover_advert* ldiscover_adverts;
     
     /* Relationship management */
     struct wish_relationship_req_t* relationship_req_db;
@@ -161,6 +192,9 @@ typedef struct wish_core {
     /* Wish Directory */
     struct wish_directory* directory;
     
+    /* Identity and configuration writes waiting to be committed, see wish_commit.h */
+    struct wish_commit* commit;
+    
     /** Storage for an optional local discovery class string, which will be announced as meta.product in the broadcast */
     char wld_class[WISH_WLD_CLASS_MAX_LEN];
 } wish_core_t;
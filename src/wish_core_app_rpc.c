@@ -216,9 +216,11 @@ handler version_h =                                   { .op = "version",
 handler services_send_h =                             { .op = "services.send",                     .handler = wish_api_services_send, .args = "(peer: Peer, payload: Buffer): bool", .doc = "Send payload to peer." };
 handler services_list_h =                             { .op = "services.list",                     .handler = wish_api_services_list, .args = "(void): Service[]", .doc = "List local services." };
 
-handler identity_list_h =                             { .op = "identity.list",                     .handler = wish_api_identity_list, .args="(void): Identity[]" };
+handler identity_list_h =                             { .op = "identity.list",                     .handler = wish_api_identity_list, .args="(opts?: { limit?: number, cursor?: Uid, fields?: string[], stream?: bool }): Identity[] | { list: Identity[], cursor?: Uid }", .doc = "List identities, all of them, or a page at a time when opts is given." };
 handler identity_export_h =                           { .op = "identity.export",                   .handler = wish_api_identity_export, .args="(void): Document" };
 handler identity_import_h =                           { .op = "identity.import",                   .handler = wish_api_identity_import, .args="(identity: Document): Identity" };
+handler identity_import_batch_h =                     { .op = "identity.importBatch",              .handler = wish_api_identity_import_batch, .args="(documents: Document[]): Identity[]", .doc = "Import many identities with one write. Failed documents are { err, msg } in the result." };
+handler identity_export_batch_h =                     { .op = "identity.exportBatch",              .handler = wish_api_identity_export_batch, .args="(uids?: Uid[]): Document[]", .doc = "Export many identities, or all if no uids are given." };
 handler identity_create_h =                           { .op = "identity.create",                   .handler = wish_api_identity_create, .args="(alias: string): Identity" };
 handler identity_update_h =                           { .op = "identity.update",                   .handler = wish_api_identity_update, .args="({ alias?: string, [field: string]: string }): Identity" };
 handler identity_permissions_h =                      { .op = "identity.permissions",              .handler = wish_api_identity_permissions, .args="({ [field: string]: string }): Identity" };
@@ -237,6 +239,8 @@ handler connections_apps_h =                          { .op = "connections.apps"
 handler connections_request_h =                       { .op = "connections.request",               .handler = wish_api_connections_request, .args = "(host: Host, op: string, args: array): Response" };
 handler connections_disconnect_h =                    { .op = "connections.disconnect",            .handler = wish_api_connections_disconnect, .args = "(id: number): bool" };
 handler connections_disconnect_all_h =                { .op = "connections.disconnectAll",         .handler = wish_api_connections_disconnect_all, .args = "(): bool" };
+handler connections_stats_h =                         { .op = "connections.stats",                 .handler = wish_api_connections_stats, .args = "(id: number): ConnectionStats", .doc = "Frames and bytes sent per priority class, and receive buffer occupancy." };
+handler connections_dns_cache_h =                     { .op = "connections.dnsCache",              .handler = wish_api_connections_dns_cache, .args = "(void): DnsCacheStats", .doc = "Statistics of the DNS answer cache shared by connections and relay clients." };
 handler connections_check_connections_h =             { .op = "connections.checkConnections",      .handler = wish_api_connections_check_connections, .args = "(id: number): bool" };
 
 handler directory_find_h =                            { .op = "directory.find",                    .handler = wish_api_directory_find, .args = "(filter?: string): DirectoryEntry" };
@@ -265,6 +269,19 @@ handler host_skip_connection_acl_h =                  { .op = "host.skipConnecti
 handler host_set_wld_class_h =                             { .op = "host.setWldClass",                      .handler = host_set_wld_class, .args = "(class: string): bool" };
 
 
+static size_t (*service_ipc_queued_fn)(wish_core_t* core, const uint8_t wsid[WISH_ID_LEN]);
+
+void core_service_ipc_set_queued(size_t (*fn)(wish_core_t* core, const uint8_t wsid[WISH_ID_LEN])) {
+    service_ipc_queued_fn = fn;
+}
+
+size_t core_service_ipc_queued(wish_core_t* core, const uint8_t wsid[WISH_ID_LEN]) {
+    if (service_ipc_queued_fn == NULL) {
+        return 0;
+    }
+    return service_ipc_queued_fn(core, wsid);
+}
+
 static void wish_core_app_rpc_send(rpc_server_req* req, const bson* bs) {
     wish_core_t* core = (wish_core_t*) req->server->context;
     wish_app_entry_t* app = (wish_app_entry_t*) req->context;
@@ -298,6 +315,8 @@ void wish_core_app_rpc_init(wish_core_t* core) {
     rpc_server_register(core->app_api, &identity_permissions_h);
     rpc_server_register(core->app_api, &identity_export_h);
     rpc_server_register(core->app_api, &identity_import_h);
+    rpc_server_register(core->app_api, &identity_import_batch_h);
+    rpc_server_register(core->app_api, &identity_export_batch_h);
     rpc_server_register(core->app_api, &identity_get_h);
     rpc_server_register(core->app_api, &identity_remove_h);
     rpc_server_register(core->app_api, &identity_sign_h);
@@ -313,6 +332,8 @@ void wish_core_app_rpc_init(wish_core_t* core) {
     rpc_server_register(core->app_api, &connections_request_h);
     rpc_server_register(core->app_api, &connections_disconnect_h);
     rpc_server_register(core->app_api, &connections_disconnect_all_h);
+    rpc_server_register(core->app_api, &connections_stats_h);
+    rpc_server_register(core->app_api, &connections_dns_cache_h);
     rpc_server_register(core->app_api, &connections_check_connections_h);
 
     rpc_server_register(core->app_api, &api_acl_check_h);
@@ -36,6 +36,7 @@
 
 #include "utlist.h"
 #include "wish_connection_mgr.h"
+#include "wish_commit.h"
 
 void wish_send_peer_update(wish_core_t* core, struct wish_service_entry *service_entry, bool online) {
     int buffer_len = 300;
@@ -357,7 +358,13 @@ static void send_op_handler(rpc_server_req* req, const uint8_t* args) {
      */
 
     size_t buf_len = 4*WISH_ID_LEN + WISH_PROTOCOL_NAME_MAX_LEN + 100 + payload_len;
-    uint8_t buf[buf_len];
+    /* The payload may be a large message reassembled from fragments, so the frame is not built on stack */
+    uint8_t* buf = wish_platform_malloc(buf_len);
+    if (buf == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "send_op_handler: Out of memory, payload len %i", payload_len);
+        rpc_server_error_msg(req, 41, "Out of memory.");
+        return;
+    }
     
     bson bs;
     bson_init_buffer(&bs, buf, buf_len);
@@ -379,6 +386,7 @@ static void send_op_handler(rpc_server_req* req, const uint8_t* args) {
     bson_finish(&bs);
     
     send_core_to_app(core, lsid, bson_data(&bs), bson_size(&bs));
+    wish_platform_free(buf);
     rpc_server_send(req, NULL, 0);
 }
 
@@ -869,26 +877,17 @@ static void friend_req_callback(rpc_client_req* req, void* context, const uint8_
     
     // Check if identity is already in db
 
-    int num_uids_in_db = wish_get_num_uid_entries();
-    wish_uid_list_elem_t uid_list[num_uids_in_db];
-    int num_uids = wish_load_uid_list(uid_list, num_uids_in_db);
-
-
     bool found = false;
-    int i = 0;
-    for (i = 0; i < num_uids; i++) {
-        if ( memcmp(&uid_list[i].uid, new_friend_id_from_cert.uid, WISH_ID_LEN) == 0 ) {
-            WISHDEBUG(LOG_CRITICAL, "New friend identity already in DB, we wont add it multiple times.");
-            found = true;
-            
-            // TODO: Update alias, meta... based on cert that friend requestee sent
-            
-            break;
-        }
+    if (wish_identity_exists(new_friend_id_from_cert.uid) > 0) {
+        WISHDEBUG(LOG_CRITICAL, "New friend identity already in DB, we wont add it multiple times.");
+        found = true;
+        
+        // TODO: Update alias, meta... based on cert that friend requestee sent
     }
 
     if(!found) {
         wish_save_identity_entry(&new_friend_id_from_cert);
+        wish_commit_request(core, WISH_COMMIT_IDENTITIES, NULL, NULL);
         wish_core_signals_emit_string(core, "identity");
     }
     
@@ -32,6 +32,10 @@
 #include "wish_core_app_rpc.h"
 #include "core_service_ipc.h"
 #include "wish_fs.h"
+#include "wish_fragment.h"
+#include "wish_stream.h"
+#include "wish_compress.h"
+#include "wish_batch.h"
 
 #include "mbedtls/sha256.h"
 #include "ed25519.h"
@@ -51,7 +55,7 @@ void wish_core_send_pong(wish_core_t* core, wish_connection_t* ctx) {
     bson_append_bool(&bs, "pong", true);
     bson_finish(&bs);
     
-    wish_core_send_message(core, ctx, bson_data(&bs), bson_size(&bs));
+    wish_core_send_message_class(core, ctx, bson_data(&bs), bson_size(&bs), WISH_TX_CLASS_CONTROL);
 }
 
 
@@ -147,6 +151,16 @@ void wish_core_update_transports_from_handshake(wish_core_t *core, wish_connecti
     wish_identity_destroy(&id);
 }
 
+void wish_core_update_features_from_handshake(wish_core_t *core, wish_connection_t *connection, uint8_t *handshake_msg) {
+    bson_iterator it;
+    
+    /* Cores which predate the features field don't support any of the optional features */
+    connection->remote_features = 0;
+    if (bson_find_from_buffer(&it, handshake_msg, "features") == BSON_INT) {
+        connection->remote_features = (uint32_t) bson_iterator_int(&it);
+    }
+}
+
 void wish_core_create_handshake_msg(wish_core_t* core, wish_connection_t* conn, uint8_t *buffer, size_t buffer_len) {
     
     uint8_t host_id[WISH_WHID_LEN] = { 0 };
@@ -191,6 +205,17 @@ void wish_core_create_handshake_msg(wish_core_t* core, wish_connection_t* conn,
       
     bson_append_finish_array(&bs);
     
+    uint32_t features = 0;
+#if WISH_PORT_MAX_MESSAGE_SZ > WISH_FRAME_MAX_PAYLOAD_LEN
+    features |= WISH_FEATURE_FRAGMENT;
+#endif
+    features |= WISH_FEATURE_STREAM;
+    features |= WISH_FEATURE_COMPRESS;
+    features |= WISH_FEATURE_BATCH;
+    if (features != 0) {
+        bson_append_int(&bs, "features", features);
+    }
+    
     if (conn->friend_req_connection == false) {
         /* Check if conn->ruid has permissions: { banned:true } */
         wish_identity_t id;
@@ -243,6 +268,8 @@ void wish_core_process_handshake(wish_core_t* core, wish_connection_t* ctx, uint
     
     memcpy(ctx->rhid, host_id, WISH_WHID_LEN);
     
+    wish_core_update_features_from_handshake(core, ctx, handshake);
+    
     if (ctx->friend_req_connection == false) {
         wish_core_update_transports_from_handshake(core, ctx, handshake);
     }
@@ -256,7 +283,7 @@ void wish_core_process_handshake(wish_core_t* core, wish_connection_t* ctx, uint
     bson bs;
     bson_init_with_data(&bs, handshake_msg);
 
-    wish_core_send_message(core, ctx, bson_data(&bs), bson_size(&bs));
+    wish_core_send_message_class(core, ctx, bson_data(&bs), bson_size(&bs), WISH_TX_CLASS_CONTROL);
 }
 
 /* Generate an id for service messages */
@@ -269,6 +296,10 @@ int32_t generate_service_msg_id(void) {
 
 
 void wish_core_process_message(wish_core_t* core, wish_connection_t* ctx, uint8_t* msg) {
+    wish_core_process_inner_message(core, ctx, msg, 0);
+}
+
+void wish_core_process_inner_message(wish_core_t* core, wish_connection_t* ctx, uint8_t* msg, int envelopes) {
     /* If you want to print out the on-wire message, now would be the
      * time */
     bool wire_debug = false;
@@ -295,6 +326,35 @@ void wish_core_process_message(wish_core_t* core, wish_connection_t* ctx, uint8_
         wish_core_send_pong(core, ctx);
     } else if (bson_find_from_buffer(&it, msg, "pong") == BSON_BOOL) {
         // received a pong, but won't do much with it here.
+    } else if (bson_find_from_buffer(&it, msg, "frag") == BSON_BINDATA) {
+        if (envelopes != 0) {
+            WISHDEBUG(LOG_CRITICAL, "Fragment inside another envelope, closing connection");
+            wish_close_connection(core, ctx);
+            return;
+        }
+        wish_fragment_feed(core, ctx, msg);
+    } else if (bson_find_from_buffer(&it, msg, "stream") == BSON_INT) {
+        if (envelopes != 0) {
+            WISHDEBUG(LOG_CRITICAL, "Stream message inside another envelope, closing connection");
+            wish_close_connection(core, ctx);
+            return;
+        }
+        wish_stream_feed(core, ctx, msg);
+    } else if (bson_find_from_buffer(&it, msg, "z") == BSON_BINDATA) {
+        /* Each decompression allocates up to WISH_PORT_MAX_MESSAGE_SZ */
+        if (envelopes & (WISH_ENVELOPE_COMPRESSED | WISH_ENVELOPE_BATCH)) {
+            WISHDEBUG(LOG_CRITICAL, "Nested compressed message, closing connection");
+            wish_close_connection(core, ctx);
+            return;
+        }
+        wish_compress_feed(core, ctx, msg, envelopes);
+    } else if (bson_find_from_buffer(&it, msg, "batch") == BSON_BINDATA) {
+        if (envelopes & WISH_ENVELOPE_BATCH) {
+            WISHDEBUG(LOG_CRITICAL, "Nested batch, closing connection");
+            wish_close_connection(core, ctx);
+            return;
+        }
+        wish_batch_feed(core, ctx, msg, envelopes);
     } else {
         WISHDEBUG(LOG_CRITICAL, "Unknown message on wire!");
     }
@@ -26,9 +26,23 @@ void wish_core_create_handshake_msg(wish_core_t* core, wish_connection_t* conn,
 
 void wish_core_update_transports_from_handshake(wish_core_t *core, wish_connection_t *connection, uint8_t *handshake_msg);
 
+/* Save the WISH_FEATURE_* bit field announced by the remote core in its handshake */
+void wish_core_update_features_from_handshake(wish_core_t *core, wish_connection_t *connection, uint8_t *handshake_msg);
+
 /* Submit an actual Wish service message */
 void wish_core_process_message(wish_core_t* core, wish_connection_t* ctx, uint8_t* bson_doc);
 
+/* The envelopes a message has been taken out of, for wish_core_process_inner_message() */
+#define WISH_ENVELOPE_REASSEMBLED 1 /* frag or stream */
+#define WISH_ENVELOPE_COMPRESSED 2  /* z */
+#define WISH_ENVELOPE_BATCH 4       /* batch */
+
+/* Submit a message taken out of the envelopes given as WISH_ENVELOPE_*
+ * flags. Envelopes may only be nested in the order they are sent,
+ * frag or stream, then z, then batch, each at most once; otherwise the
+ * connection is closed. */
+void wish_core_process_inner_message(wish_core_t* core, wish_connection_t* ctx, uint8_t* bson_doc, int envelopes);
+
 void wish_core_process_service_meta(wish_core_t* core, wish_connection_t* ctx,
 uint8_t* service_reply_doc);
 
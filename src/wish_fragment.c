@@ -0,0 +1,157 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "wish_fragment.h"
+#include "wish_connection.h"
+#include "wish_connection_mgr.h"
+#include "wish_dispatcher.h"
+#include "wish_platform.h"
+#include "wish_debug.h"
+#include "bson.h"
+
+int wish_fragment_send(wish_core_t* core, wish_connection_t* connection, const uint8_t* payload, int payload_len, enum wish_tx_class tx_class) {
+    if ((connection->remote_features & WISH_FEATURE_FRAGMENT) == 0) {
+        WISHDEBUG(LOG_CRITICAL, "Message of len %i does not fit in a frame, and remote core does not support fragments", payload_len);
+        return 1;
+    }
+
+    uint8_t* buffer = wish_platform_malloc(WISH_FRAME_MAX_PAYLOAD_LEN);
+    if (buffer == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "Memory allocation fail when fragmenting message");
+        return 1;
+    }
+
+    int ret = 0;
+    int offset = 0;
+    while (offset < payload_len) {
+        int data_len = payload_len - offset;
+        if (data_len > WISH_FRAGMENT_DATA_LEN) {
+            data_len = WISH_FRAGMENT_DATA_LEN;
+        }
+
+        bson bs;
+        bson_init_buffer(&bs, buffer, WISH_FRAME_MAX_PAYLOAD_LEN);
+        bson_append_binary(&bs, "frag", payload + offset, data_len);
+        bson_append_int(&bs, "total", payload_len);
+        bson_finish(&bs);
+
+        if (bs.err) {
+            WISHDEBUG(LOG_CRITICAL, "BSON write error when fragmenting message");
+            ret = 1;
+            break;
+        }
+
+        ret = wish_core_send_frame_class(core, connection, bson_data(&bs), bson_size(&bs), tx_class);
+        if (ret) {
+            /* The remote end cannot recover from a missing fragment */
+            WISHDEBUG(LOG_CRITICAL, "Sending fragment failed at offset %i of %i", offset, payload_len);
+            break;
+        }
+        offset += data_len;
+    }
+
+    wish_platform_free(buffer);
+    return ret;
+}
+
+void wish_fragment_feed(wish_core_t* core, wish_connection_t* connection, const uint8_t* msg) {
+    bson_iterator it;
+
+    if (bson_find_from_buffer(&it, msg, "total") != BSON_INT) {
+        WISHDEBUG(LOG_CRITICAL, "Fragment without total length, closing connection");
+        wish_close_connection(core, connection);
+        return;
+    }
+    int32_t total = bson_iterator_int(&it);
+
+    if (bson_find_from_buffer(&it, msg, "frag") != BSON_BINDATA) {
+        WISHDEBUG(LOG_CRITICAL, "Fragment without data, closing connection");
+        wish_close_connection(core, connection);
+        return;
+    }
+    const uint8_t* data = bson_iterator_bin_data(&it);
+    int32_t data_len = bson_iterator_bin_len(&it);
+
+    if (connection->rx_fragment_total == 0) {
+        /* First fragment of a new message */
+        if (total <= 0 || data_len <= 0 || data_len > total) {
+            WISHDEBUG(LOG_CRITICAL, "Bad first fragment (total %i, len %i), closing connection", total, data_len);
+            wish_close_connection(core, connection);
+            return;
+        }
+
+        connection->rx_fragment_total = total;
+        connection->rx_fragment_len = 0;
+
+        if (total > WISH_PORT_MAX_MESSAGE_SZ) {
+            /* Leave rx_fragment_buf NULL, the fragments of this message are counted but discarded */
+            WISHDEBUG(LOG_CRITICAL, "Incoming message of len %i exceeds WISH_PORT_MAX_MESSAGE_SZ, discarding it", total);
+        }
+        else {
+            connection->rx_fragment_buf = wish_platform_malloc(total);
+            if (connection->rx_fragment_buf == NULL) {
+                WISHDEBUG(LOG_CRITICAL, "Memory allocation fail for message of len %i, discarding it", total);
+            }
+        }
+    }
+    else if (total != connection->rx_fragment_total || data_len > connection->rx_fragment_total - connection->rx_fragment_len) {
+        WISHDEBUG(LOG_CRITICAL, "Fragment does not match message being reassembled, closing connection");
+        wish_close_connection(core, connection);
+        return;
+    }
+
+    if (connection->rx_fragment_buf != NULL) {
+        memcpy(connection->rx_fragment_buf + connection->rx_fragment_len, data, data_len);
+    }
+    connection->rx_fragment_len += data_len;
+
+    if (connection->rx_fragment_len < connection->rx_fragment_total) {
+        /* More fragments to come */
+        return;
+    }
+
+    /* The message is complete. Detach it from the connection before
+     * processing, as processing may close the connection */
+    uint8_t* message = connection->rx_fragment_buf;
+    int32_t message_len = connection->rx_fragment_total;
+    connection->rx_fragment_buf = NULL;
+    connection->rx_fragment_len = 0;
+    connection->rx_fragment_total = 0;
+
+    if (message == NULL) {
+        return;
+    }
+
+    if (message_len < 5 || bson_size2(message) != message_len) {
+        WISHDEBUG(LOG_CRITICAL, "Reassembled message is not a valid BSON document of len %i", message_len);
+        wish_platform_free(message);
+        return;
+    }
+
+    wish_core_process_inner_message(core, connection, message, WISH_ENVELOPE_REASSEMBLED);
+    wish_platform_free(message);
+}
+
+void wish_fragment_cleanup(wish_core_t* core, wish_connection_t* connection) {
+    if (connection->rx_fragment_buf != NULL) {
+        wish_platform_free(connection->rx_fragment_buf);
+        connection->rx_fragment_buf = NULL;
+    }
+    connection->rx_fragment_len = 0;
+    connection->rx_fragment_total = 0;
+}
@@ -0,0 +1,75 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+#pragma once
+
+/* Wish C - Fragmentation of messages which do not fit into one Wish frame
+ *
+ * The frame length on the wire is a 16-bit field, which limits the
+ * payload of one frame to WISH_FRAME_MAX_PAYLOAD_LEN bytes. Larger
+ * messages are split into fragments, each sent in a frame of its own:
+ *
+ * { frag: Buffer, total: int32 }
+ *
+ * where total is the length of the whole message. The receiver
+ * collects the fragments in order and processes the message when
+ * total bytes have been received. Fragments are only sent to remote
+ * cores that announce WISH_FEATURE_FRAGMENT in their handshake.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "wish_core.h"
+#include "wish_connection.h"
+
+/** The maximum length of a frame on the wire (16-bit length field) */
+#define WISH_FRAME_MAX_LEN 0xffff
+
+/** The maximum length of the clear text payload of one frame */
+#define WISH_FRAME_MAX_PAYLOAD_LEN (WISH_FRAME_MAX_LEN - AES_GCM_AUTH_TAG_LEN)
+
+/** The number of bytes reserved in each frame for the BSON envelope of a fragment */
+#define WISH_FRAGMENT_OVERHEAD 64
+
+/** The number of message bytes carried by one fragment */
+#define WISH_FRAGMENT_DATA_LEN (WISH_FRAME_MAX_PAYLOAD_LEN - WISH_FRAGMENT_OVERHEAD)
+
+/* Define the maximum length of a reassembled message */
+#ifndef WISH_PORT_MAX_MESSAGE_SZ
+#define WISH_PORT_MAX_MESSAGE_SZ WISH_FRAME_MAX_PAYLOAD_LEN
+#endif
+
+/**
+ * Send a message which is too large for one frame as a sequence of
+ * fragments, in the given priority class.
+ *
+ * @return 0 if all fragments were sent, non-zero on failure
+ */
+int wish_fragment_send(wish_core_t* core, wish_connection_t* connection, const uint8_t* payload, int payload_len, enum wish_tx_class tx_class);
+
+/**
+ * Feed an incoming fragment message ({ frag: Buffer, total: int32 }).
+ * When the last fragment arrives, the reassembled message is submitted
+ * to wish_core_process_inner_message().
+ */
+void wish_fragment_feed(wish_core_t* core, wish_connection_t* connection, const uint8_t* msg);
+
+/** Release a partially reassembled message of a connection */
+void wish_fragment_cleanup(wish_core_t* core, wish_connection_t* connection);
+
+#ifdef __cplusplus
+}
+#endif
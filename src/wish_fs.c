@@ -43,6 +43,10 @@ static wish_offset_t (*fs_lseek_fn)(wish_file_t fd, wish_offset_t offset, int wh
 static wish_offset_t (*fs_close_fn)(wish_file_t fd);
 static int32_t (*fs_rename_fn)(const char *oldpath, const char *newpath);
 static int32_t (*fs_remove_fn)(const char *path);
+static int32_t (*fs_sync_fn)(wish_file_t fd);
+static int32_t (*fs_sync_dir_fn)(const char *path);
+static const void* (*fs_map_fn)(const char *path, size_t* len);
+static void (*fs_unmap_fn)(const void* addr, size_t len);
 
 /* Implementations of the file system abstraction functions - they are
  * really just simple "call-throughs" for the function pointers which
@@ -105,6 +109,50 @@ int32_t wish_fs_remove(const char *path) {
     return fs_remove_fn(path);
 }
 
+int32_t wish_fs_sync(wish_file_t fd) {
+    if (fs_sync_fn == NULL) {
+        /* Syncing is optional, some ports write through */
+        return 0;
+    }
+    return fs_sync_fn(fd);
+}
+
+int32_t wish_fs_sync_dir(const char *path) {
+    if (fs_sync_dir_fn == NULL) {
+        /* Syncing is optional, some ports write through */
+        return 0;
+    }
+    return fs_sync_dir_fn(path);
+}
+
+int32_t wish_fs_replace(const char *old_path, const char *new_path) {
+    /* No remove and retry here: new_path must not be missing if the
+     * power fails in between */
+    int32_t ret = wish_fs_rename(old_path, new_path);
+    if (ret != 0) {
+        return ret;
+    }
+    if (wish_fs_sync_dir(new_path) != 0) {
+        WISHDEBUG(LOG_CRITICAL, "Could not sync the directory of %s", new_path);
+    }
+    return 0;
+}
+
+const void* wish_fs_map(const char* path, size_t* len) {
+    if (fs_map_fn == NULL) {
+        /* Mapping is optional, the caller falls back to reading */
+        return NULL;
+    }
+    return fs_map_fn(path, len);
+}
+
+void wish_fs_unmap(const void* addr, size_t len) {
+    if (fs_unmap_fn == NULL || addr == NULL) {
+        return;
+    }
+    fs_unmap_fn(addr, len);
+}
+
 
 
 /* Dependency injection setter functions for the platform-dependent file
@@ -138,3 +186,19 @@ void wish_fs_set_rename(int32_t (*fn)(const char *oldpath,
 void wish_fs_set_remove(int32_t (*fn)(const char *path)) {
     fs_remove_fn = fn;
 }
+
+void wish_fs_set_sync(int32_t (*fn)(wish_file_t fd)) {
+    fs_sync_fn = fn;
+}
+
+void wish_fs_set_sync_dir(int32_t (*fn)(const char *path)) {
+    fs_sync_dir_fn = fn;
+}
+
+void wish_fs_set_map(const void* (*fn)(const char *path, size_t* len)) {
+    fs_map_fn = fn;
+}
+
+void wish_fs_set_unmap(void (*fn)(const void* addr, size_t len)) {
+    fs_unmap_fn = fn;
+}
@@ -39,6 +39,31 @@ int32_t wish_fs_close(wish_file_t fd);
 int32_t wish_fs_rename(const char *old_path, const char *new_path);
 int32_t wish_fs_remove(const char* path);
 
+/* Optional: flush the written data of a file to stable storage.
+ * Returns 0 on success. Ports without the function write through. */
+int32_t wish_fs_sync(wish_file_t fd);
+
+/* Optional: flush the directory entries of the directory of path to
+ * stable storage, so that a completed rename survives a crash. Returns
+ * 0 on success. */
+int32_t wish_fs_sync_dir(const char *path);
+
+/* Replace the file new_path with old_path by renaming it, then sync the
+ * directory. The rename of the port must replace an existing new_path
+ * atomically; if it fails, its error is returned and new_path is left
+ * as it was. A failure to sync the directory is only logged, as the
+ * file has been replaced by then. */
+int32_t wish_fs_replace(const char *old_path, const char *new_path);
+
+/* Optional: map a whole file to memory for reading. Returns NULL if
+ * mapping is not supported by the port, or the file is empty. The
+ * length is fixed at map time: bytes appended later are not in the
+ * mapping, and a file replaced by wish_fs_replace() is not seen. Whether
+ * later writes within the mapped length are seen depends on the port;
+ * on unix the mapping is MAP_SHARED, so they are. */
+const void* wish_fs_map(const char* path, size_t* len);
+void wish_fs_unmap(const void* addr, size_t len);
+
 /* Dependency injection */
 void wish_fs_set_open(wish_file_t (*fn)(const char *path));
 void wish_fs_set_read(int32_t (*fn)(wish_file_t fd, void* buf, size_t count));
@@ -47,6 +72,10 @@ void wish_fs_set_lseek(int32_t (*fn)(wish_file_t fd, wish_offset_t offset, int w
 void wish_fs_set_close(int32_t (*fn)(wish_file_t fd));
 void wish_fs_set_rename(int32_t (*fn)(const char *oldpath, const char *newpath));
 void wish_fs_set_remove(int32_t (*fn)(const char *path));
+void wish_fs_set_sync(int32_t (*fn)(wish_file_t fd));
+void wish_fs_set_sync_dir(int32_t (*fn)(const char *path));
+void wish_fs_set_map(const void* (*fn)(const char *path, size_t* len));
+void wish_fs_set_unmap(void (*fn)(const void* addr, size_t len));
 
 
 #endif //WISH_FS_H
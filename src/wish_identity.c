@@ -18,6 +18,7 @@
 #include <string.h>
 #include "wish_connection.h"
 #include "wish_identity.h"
+#include "wish_identity_db.h"
 #include "ed25519.h"
 #include "mbedtls/sha256.h"
 #include "wish_debug.h"
@@ -25,6 +26,8 @@
 #include "bson_visit.h"
 #include "wish_port_config.h"
 #include "wish_connection_mgr.h"
+#include "wish_commit.h"
+#include "wish_local_discovery.h"
 
 #include "utlist.h"
 
@@ -88,14 +91,102 @@ static bson wish_identity_to_bson(wish_identity_t* identity) {
     return bs;
 }
 
-int wish_save_identity_entry(wish_identity_t* identity) {
-    int num_uids_in_db = wish_get_num_uid_entries();
-    wish_uid_list_elem_t uid_list[num_uids_in_db];
-    int num_uids = wish_load_uid_list(uid_list, num_uids_in_db);
+/* Populate identity from an identity document of the database */
+static return_t identity_from_doc(const uint8_t* doc, wish_identity_t* identity) {
+    bson bs;
+    bson_init_with_data(&bs, doc);
+
+    bson_iterator it;
+
+    if (bson_find(&it, &bs, "uid") != BSON_BINDATA || bson_iterator_bin_len(&it) != WISH_UID_LEN) {
+        WISHDEBUG(LOG_CRITICAL, "Invalid uid.");
+        return RET_FAIL;
+    }
+    memcpy(&(identity->uid), bson_iterator_bin_data(&it), WISH_ID_LEN);
+
+    if (bson_find(&it, &bs, "pubkey") != BSON_BINDATA) {
+        WISHDEBUG(LOG_CRITICAL, "Could not load pubkey");
+        return RET_FAIL;
+    }
+    memcpy(&(identity->pubkey), bson_iterator_bin_data(&it), WISH_PUBKEY_LEN);
+
+    if (bson_find(&it, &bs, "privkey") != BSON_BINDATA) {
+        WISHDEBUG(LOG_DEBUG, "No privkey for this identity");
+        identity->has_privkey = false;
+    } else {
+        WISHDEBUG(LOG_DEBUG, "Found privkey for identity");
+        if (bson_iterator_bin_len(&it) != WISH_PRIVKEY_LEN) {
+            WISHDEBUG(LOG_CRITICAL, "Could not load privkey, invalid len");
+            return RET_FAIL;
+        }
+        memcpy(&(identity->privkey), bson_iterator_bin_data(&it), WISH_PRIVKEY_LEN);
+        identity->has_privkey = true;
+    }
+
+    if (bson_find(&it, &bs, "alias") != BSON_STRING) {
+        WISHDEBUG(LOG_CRITICAL, "Could not get alias");
+        return RET_FAIL;
+    }
+    strncpy(&(identity->alias[0]), bson_iterator_string(&it), WISH_ALIAS_LEN);
+
+    /* When we got this far, we are satisfied with import, the
+     * rest is optional */
+
+    for (int i = 0; i < WISH_MAX_TRANSPORTS; i++) {
+        const int max_len = 16;
+        char transports_path[max_len];
+        bson_iterator_init(&it, &bs);
+        wish_platform_snprintf(transports_path, max_len, "transports.%d", i);
+        if (bson_find_fieldpath_value(transports_path, &it) == BSON_STRING) {
+            strncpy(&(identity->transports[i][0]), bson_iterator_string(&it), WISH_MAX_TRANSPORT_LEN);
+        }
+    }
+
+    bson_iterator_init(&it, &bs);
+
+    if (bson_find_fieldpath_value("meta", &it) == BSON_BINDATA) {
+        bson b;
+        bson_init_with_data(&b, bson_iterator_bin_data(&it));
+
+        if (bson_iterator_bin_len(&it) != bson_size(&b)) {
+            // corrupt data, don't load
+            WISHDEBUG(LOG_CRITICAL, "Identity meta data is corrupt, not loading.");
+        } else {
+            char* meta = wish_platform_malloc(bson_size(&b));
+
+            if (meta != NULL) {
+                memcpy(meta, bson_data(&b), bson_size(&b));
+            }
+
+            identity->meta = meta;
+        }
+    }
+
+    bson_iterator_init(&it, &bs);
+
+    if (bson_find_fieldpath_value("permissions", &it) == BSON_BINDATA) {
+        bson b;
+        bson_init_with_data(&b, bson_iterator_bin_data(&it));
+
+        if (bson_iterator_bin_len(&it) != bson_size(&b)) {
+            // corrupt data, don't load
+            WISHDEBUG(LOG_CRITICAL, "Identity permission data is corrupt, not loading.");
+        } else {
+            char* permissions = wish_platform_malloc(bson_size(&b));
 
-    if (num_uids >= WISH_PORT_MAX_UIDS) {
-        // DB is full, return error
-        WISHDEBUG(LOG_CRITICAL, "Too many identities in database");
+            if (permissions != NULL) {
+                memcpy(permissions, bson_data(&b), bson_size(&b));
+            }
+
+            identity->permissions = permissions;
+        }
+    }
+
+    return RET_SUCCESS;
+}
+
+int wish_save_identity_entry(wish_identity_t* identity) {
+    if (!wish_identity_db_open()) {
         return -1;
     }
 
@@ -112,6 +203,51 @@ int wish_save_identity_entry(wish_identity_t* identity) {
     }
 }
 
+int wish_save_identity_entries(wish_identity_t* identities, int count) {
+    if (!wish_identity_db_open()) {
+        return -1;
+    }
+    
+    if (count <= 0) {
+        return 0;
+    }
+
+    bson* docs = wish_platform_malloc(count * sizeof(bson));
+    const uint8_t** doc_data = wish_platform_malloc(count * sizeof(uint8_t*));
+    
+    if (docs == NULL || doc_data == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "Memory allocation fail when saving %d identities", count);
+        if (docs != NULL) { wish_platform_free(docs); }
+        if (doc_data != NULL) { wish_platform_free(doc_data); }
+        return -1;
+    }
+    
+    int ret = 0;
+    int i = 0;
+    for (i = 0; i < count; i++) {
+        docs[i] = wish_identity_to_bson(&identities[i]);
+        if (docs[i].data == NULL) {
+            i++;
+            ret = -3;
+            break;
+        }
+        doc_data[i] = (const uint8_t*) bson_data(&docs[i]);
+    }
+    
+    if (ret == 0 && wish_identity_db_append_batch(doc_data, count) != count) {
+        ret = -2;
+    }
+    
+    /* i is the number of documents created */
+    while (i > 0) {
+        bson_destroy(&docs[--i]);
+    }
+    wish_platform_free(docs);
+    wish_platform_free(doc_data);
+    
+    return ret;
+}
+
 /**
  * Save identity, expressed in BSON format, to the identity database 
  * 
@@ -121,110 +257,21 @@ int wish_save_identity_entry(wish_identity_t* identity) {
  * @return 
  */
 int wish_save_identity_entry_bson(const uint8_t* identity) {
-    wish_file_t fd;
-    int32_t io_retval = 0;
-    fd = wish_fs_open(WISH_ID_DB_NAME);
-    if (fd < 0) {
-        /* error */
-        WISHDEBUG(LOG_CRITICAL, "could not open identity db");
-        return 0;
-    }
-
     /* FIXME Find if there is already an existing entry for this identity. If
      * there this, delete the old entry */
 
-    /* APPEEND the new BSON document to stable storage file -  */
-    io_retval = wish_fs_lseek(fd, 0, WISH_FS_SEEK_END);
-    if (io_retval < 0) {
-        /* error */
-        WISHDEBUG(LOG_CRITICAL, "error seeking");
-        return 0;
-    }
-
-    bson bs;
-    bson_init_with_data(&bs, identity);
-    
-    io_retval = wish_fs_write(fd, bson_data(&bs), bson_size(&bs));
-    if (io_retval <= 0) {
-        /* error */
-        WISHDEBUG(LOG_CRITICAL, "error writing");
-        return 0;
-    }
-    wish_fs_close(fd);
-
-    return io_retval;
+    return wish_identity_db_append(identity);
 }
 
 /** This function returns the number of entries in the identity database (number of true identities + contacts),
  * Returns the number of identities, or -1 for errors */
 int wish_get_num_uid_entries(void) {
-    int retval = 0;
-    wish_file_t fd = wish_fs_open(WISH_ID_DB_NAME);
-    wish_offset_t prev_offset = 0;
-
-    int num_ids = 0;
-    
-    while (num_ids <= WISH_PORT_MAX_UIDS) {
-        /* Determine length and uid of next element */
-        int peek_len = sizeof (wish_identity_t) + 100;
-        uint8_t peek_buf[peek_len];
-
-        WISHDEBUG(LOG_DEBUG, "Seeking to offset %d", prev_offset);
-        int io_retval = wish_fs_lseek(fd, prev_offset, WISH_FS_SEEK_SET);
-        if (io_retval == -1) {
-            WISHDEBUG(LOG_CRITICAL, "Error seeking");
-            retval = -1;
-            break;
-        }
-        io_retval = wish_fs_read(fd, peek_buf, peek_len);
-        if (io_retval == 0) {
-            WISHDEBUG(LOG_DEBUG, "End of file detected");
-            /* Success exit */
-            retval = num_ids;
-            break;
-        }
-        else if (io_retval < 0) {
-            WISHDEBUG(LOG_CRITICAL, "read error");
-            retval = -1;
-            break;
-        }
-
-        bson bs;
-        
-        bson_init_with_data(&bs, peek_buf);
-        
-        int32_t elem_len = bson_size(&bs);
-        if (elem_len < 4 || elem_len > peek_len) {
-            WISHDEBUG(LOG_CRITICAL, "BSON Read error");
-            retval =  -1;
-            break;
-        }
-        /* Update prev offset so that we can later re-position the
-         * stream */
-        prev_offset+=elem_len;
-
-        bson_iterator it;
-        
-        if ( bson_find_from_buffer(&it, peek_buf, "uid") != BSON_BINDATA ) {
-            WISHDEBUG(LOG_CRITICAL, "Could not get uid (a)");
-            retval = -1;
-            break;
-        }
-        
-        WISHDEBUG(LOG_DEBUG, "Found identity!");
-        num_ids++;
-        
-    }
-    
-    if (num_ids > WISH_PORT_MAX_UIDS) {
-        WISHDEBUG(LOG_CRITICAL, "Number of identities in db exceeds allowable number of identities (%d)!", WISH_PORT_MAX_UIDS);
-        retval = WISH_PORT_MAX_UIDS;
+    if (!wish_identity_db_open()) {
+        return -1;
     }
-    
-    wish_fs_close(fd);
-    return retval;
-}
 
+    return wish_identity_db_count();
+}
 
 /**
  * This function returns the list of UIDs which are in the identity
@@ -238,65 +285,39 @@ int wish_load_uid_list(wish_uid_list_elem_t *list, int list_len ) {
         return -1;
     }
 
-    wish_file_t fd = wish_fs_open(WISH_ID_DB_NAME);
-    wish_offset_t prev_offset = 0;
+    if (!wish_identity_db_open()) {
+        return -1;
+    }
 
     int i = 0;
-    for (i = 0; i < list_len; i++) {
-        /* Determine length and uid of next element */
-        int peek_len = sizeof (wish_identity_t) + 100;
-        uint8_t peek_buf[peek_len];
+    wish_identity_db_entry_t* entry = wish_identity_db_first();
+    for (i = 0; i < list_len && entry != NULL; i++) {
+        /* Add element to uid list */
+        memcpy(list[i].uid, entry->uid, WISH_ID_LEN);
+        entry = wish_identity_db_next(entry);
+    }
+    return i;
+}
 
-        WISHDEBUG(LOG_DEBUG, "Seeking to offset %d", prev_offset);
-        int io_retval = wish_fs_lseek(fd, prev_offset, WISH_FS_SEEK_SET);
-        if (io_retval == -1) {
-            WISHDEBUG(LOG_CRITICAL, "Error seeking");
+int wish_load_uid_list_alloc(wish_uid_list_elem_t **list) {
+    *list = NULL;
 
-        }
-        io_retval = wish_fs_read(fd, peek_buf, peek_len);
-        if (io_retval == 0) {
-            WISHDEBUG(LOG_DEBUG, "End of file detected");
-            break;
-        }
-        else if (io_retval < 0) {
-            WISHDEBUG(LOG_CRITICAL, "read error");
-            return -1;
-        }
+    if (!wish_identity_db_open()) {
+        return -1;
+    }
 
-        
-        bson bs;
-        bson_init_with_data(&bs, peek_buf);
-        
-        int32_t elem_len = bson_size(&bs);
-        if (elem_len < 4 || elem_len > peek_len) {
-            WISHDEBUG(LOG_CRITICAL, "BSON Read error");
-            return -1;
-        }
-        /* Update prev offset so that we can later re-position the
-         * stream */
-        prev_offset+=elem_len;
+    int num_ids = wish_identity_db_count();
+    if (num_ids == 0) {
+        return 0;
+    }
 
-        bson_iterator it;
-        
-        if (bson_find_from_buffer(&it, peek_buf, "uid") != BSON_BINDATA) {
-            WISHDEBUG(LOG_CRITICAL, "Could not get uid (b)");
-            return -1;
-        }
+    *list = wish_platform_malloc(num_ids * sizeof(wish_uid_list_elem_t));
+    if (*list == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "Memory allocation fail for uid list of %d identities", num_ids);
+        return -1;
+    }
 
-        const uint8_t* uid = bson_iterator_bin_data(&it);
-        int32_t uid_len = bson_iterator_bin_len(&it);
-        
-        if (uid_len != WISH_UID_LEN) {
-            WISHDEBUG(LOG_CRITICAL, "Could not get uid (c)");
-            return -1;
-        }
-        
-        WISHDEBUG(LOG_DEBUG, "Found identity!");
-        /* Add element to uid list */
-        memcpy(list[i].uid, uid, WISH_ID_LEN);
-    } 
-    wish_fs_close(fd);
-    return i;
+    return wish_load_uid_list(*list, num_ids);
 }
 
 
@@ -304,160 +325,26 @@ return_t wish_identity_load(const uint8_t* uid, wish_identity_t* identity) {
     // init the structure to all zeroes, i.e. pointers to NULL
     memset(identity, 0, sizeof(wish_identity_t));
     
-    int retval = RET_FAIL;
-
     if (uid == NULL) {
         return RET_FAIL;
     }
 
-    
-    wish_file_t fd = wish_fs_open(WISH_ID_DB_NAME);
-    wish_offset_t prev_offset = 0;
-
-    do {
-        /* Determine length and uid of next element */
-        int peek_len = sizeof (wish_identity_t) + 100;
-        uint8_t peek_buf[peek_len];
-        /* Re-position the stream to the end of the previous BSON structure - 
-         * so that the next bytes to be read will be of the next element
-         * */
-        int io_retval = wish_fs_lseek(fd, prev_offset, WISH_FS_SEEK_SET);
-        if (io_retval == -1) {
-            WISHDEBUG(LOG_CRITICAL, "Error seeking");
-            break;
-
-        }
-        io_retval = wish_fs_read(fd, peek_buf, peek_len);
-        if (io_retval == 0) {
-            WISHDEBUG(LOG_DEBUG, "End of file detected (2)");
-            break;
-        }
-        else if (io_retval < 0) {
-            WISHDEBUG(LOG_CRITICAL, "read error");
-            break;
-        }
-
-        bson bs;
-        bson_init_with_data(&bs, peek_buf);
-        
-        int32_t elem_len = bson_size(&bs);
-        if (elem_len < 4 || elem_len > peek_len) {
-            WISHDEBUG(LOG_CRITICAL, "BSON Read error");
-            break;
-        }
-        /* Update prev offset so that we can later re-position the
-         * stream */
-        prev_offset+=elem_len;
-
-        bson_iterator it;
-        
-        if (bson_find_from_buffer(&it, peek_buf, "uid") != BSON_BINDATA) {
-            WISHDEBUG(LOG_CRITICAL, "Could not get uid (d)");
-            break;
-        }
-
-        const uint8_t* peek_uid = bson_iterator_bin_data(&it);
-        
-        if ( bson_iterator_bin_len(&it) != WISH_UID_LEN ) {
-            WISHDEBUG(LOG_CRITICAL, "Invalid uid.");
-            break;
-        }
-        
-        if (memcmp(peek_uid, uid, WISH_ID_LEN) == 0) {
-            WISHDEBUG(LOG_DEBUG, "Found identity (2)!");
-            memcpy(&(identity->uid), peek_uid, WISH_ID_LEN);
-
-            
-            if (bson_find_from_buffer(&it, peek_buf, "pubkey") != BSON_BINDATA) {
-                WISHDEBUG(LOG_CRITICAL, "Could not load pubkey");
-                break;
-            }
-            
-            const uint8_t* pubkey = bson_iterator_bin_data(&it);
-            int32_t len = 0;
-            
-            memcpy(&(identity->pubkey), pubkey, WISH_PUBKEY_LEN);
- 
-            if (bson_find_from_buffer(&it, peek_buf, "privkey") != BSON_BINDATA) {
-                WISHDEBUG(LOG_DEBUG, "No privkey for this identity");
-                identity->has_privkey = false;
-            } else {
-                WISHDEBUG(LOG_DEBUG, "Found privkey for identity");
-                if (bson_iterator_bin_len(&it) != WISH_PRIVKEY_LEN) {
-                    WISHDEBUG(LOG_CRITICAL, "Could not load privkey, invalid len");
-                    break;
-                }
-                memcpy(&(identity->privkey), bson_iterator_bin_data(&it), WISH_PRIVKEY_LEN);
-                identity->has_privkey = true;
-            }
+    if (!wish_identity_db_open()) {
+        return RET_FAIL;
+    }
 
-            if (bson_find_from_buffer(&it, peek_buf, "alias") != BSON_STRING) {
-                WISHDEBUG(LOG_CRITICAL, "Could not get alias");
-                break;
-            }
-            
-            const char* alias = bson_iterator_string(&it);
-            
-            strncpy(&(identity->alias[0]), alias, WISH_ALIAS_LEN);
-
-            /* When we got this far, we are satisfied with import, the
-             * rest is optional */
-            retval = RET_SUCCESS;
-  
-            for (int i = 0; i < WISH_MAX_TRANSPORTS; i++) {
-                const int max_len = 16;
-                char transports_path[max_len];
-                bson_iterator_init(&it, &bs);
-                wish_platform_snprintf(transports_path, max_len, "transports.%d", i);
-                if (bson_find_fieldpath_value(transports_path, &it) == BSON_STRING) {
-                    strncpy(&(identity->transports[i][0]), bson_iterator_string(&it), WISH_MAX_TRANSPORT_LEN);
-                }
-                
-            }
+    wish_identity_db_entry_t* entry = wish_identity_db_find(uid);
+    if (entry == NULL) {
+        return RET_FAIL;
+    }
 
-            bson_iterator_init(&it, &bs);
-            
-            if (bson_find_fieldpath_value("meta", &it) == BSON_BINDATA) {
-                bson b;
-                bson_init_with_data(&b, bson_iterator_bin_data(&it));
-                
-                if (bson_iterator_bin_len(&it) != bson_size(&b)) {
-                    // corrupt data, don't load
-                    WISHDEBUG(LOG_CRITICAL, "Identity meta data is corrupt, not loading.");
-                } else {
-                    char* meta = wish_platform_malloc(bson_size(&b));
-
-                    if (meta != NULL) {
-                        memcpy(meta, bson_data(&b), bson_size(&b));
-                    }
-
-                    identity->meta = meta;
-                }
-            }
+    uint8_t* doc = wish_identity_db_load(entry);
+    if (doc == NULL) {
+        return RET_FAIL;
+    }
 
-            bson_iterator_init(&it, &bs);
-            
-            if (bson_find_fieldpath_value("permissions", &it) == BSON_BINDATA) {
-                bson b;
-                bson_init_with_data(&b, bson_iterator_bin_data(&it));
-                
-                if (bson_iterator_bin_len(&it) != bson_size(&b)) {
-                    // corrupt data, don't load
-                    WISHDEBUG(LOG_CRITICAL, "Identity permission data is corrupt, not loading.");
-                } else {
-                    char* permissions = wish_platform_malloc(bson_size(&b));
-
-                    if (permissions != NULL) {
-                        memcpy(permissions, bson_data(&b), bson_size(&b));
-                    }
-
-                    identity->permissions = permissions;
-                }
-            }
-            break;
-        }
-    } while (1); 
-    wish_fs_close(fd);
+    return_t retval = identity_from_doc(doc, identity);
+    wish_platform_free(doc);
     return retval;
 }
 
@@ -468,135 +355,44 @@ void wish_identity_destroy(wish_identity_t* identity) {
 
 // returns < 0 on error, == 0 is false, > 0 is true
 int wish_identity_exists(uint8_t *uid) {
-    int retval = 0;
-
     if (uid == NULL) {
         return -1;
     }
 
-    wish_file_t fd = wish_fs_open(WISH_ID_DB_NAME);
-    wish_offset_t prev_offset = 0;
-
-    do {
-        /* Determine length and uid of next element */
-        int peek_len = sizeof (wish_identity_t) + 100;
-        uint8_t peek_buf[peek_len];
-        /* Re-position the stream to the end of the previous BSON structure - 
-         * so that the next bytes to be read will be of the next element
-         * */
-        int io_retval = wish_fs_lseek(fd, prev_offset, WISH_FS_SEEK_SET);
-        if (io_retval == -1) {
-            WISHDEBUG(LOG_CRITICAL, "Error seeking");
-            break;
-
-        }
-        io_retval = wish_fs_read(fd, peek_buf, peek_len);
-        if (io_retval == 0) {
-            WISHDEBUG(LOG_DEBUG, "End of file detected (2)");
-            break;
-        }
-        else if (io_retval < 0) {
-            WISHDEBUG(LOG_CRITICAL, "read error");
-            break;
-        }
-
-        bson bs;
-        bson_init_with_data(&bs, peek_buf);
-        
-        int32_t elem_len = bson_size(&bs);
-        if (elem_len < 4 || elem_len > peek_len) {
-            WISHDEBUG(LOG_CRITICAL, "BSON Read error");
-            break;
-        }
-        /* Update prev offset so that we can later re-position the
-         * stream */
-        prev_offset+=elem_len;
+    if (!wish_identity_db_open()) {
+        return -1;
+    }
 
-        bson_iterator it;
-        
-        if (bson_find_from_buffer(&it, peek_buf, "uid") != BSON_BINDATA) {
-            WISHDEBUG(LOG_CRITICAL, "Could not get uid (e)");
-            break;
-        }
-        if (memcmp(bson_iterator_bin_data(&it), uid, WISH_ID_LEN) == 0) {
-            WISHDEBUG(LOG_DEBUG, "Found identity (2)!");
-            retval = 1;
-            break;
-        }
-    } while (1); 
-    wish_fs_close(fd);
-    return retval;
+    return wish_identity_db_find(uid) != NULL ? 1 : 0;
 }
 
-
 int wish_load_identity_bson(uint8_t *uid, uint8_t *identity_bson_doc, size_t identity_bson_doc_max_len) {
-    int retval = -1;
-
     if (uid == NULL) {
-        return retval;
+        return -1;
     }
 
-    wish_file_t fd = wish_fs_open(WISH_ID_DB_NAME);
-    wish_offset_t prev_offset = 0;
-
-    do {
-        /* Determine length and uid of next element */
-        int peek_len = sizeof (wish_identity_t) + 100;
-        uint8_t peek_buf[peek_len];
-        /* Re-position the stream to the end of the previous BSON structure - 
-         * so that the next bytes to be read will be of the next element
-         * */
-        int io_retval = wish_fs_lseek(fd, prev_offset, WISH_FS_SEEK_SET);
-        if (io_retval == -1) {
-            WISHDEBUG(LOG_CRITICAL, "Error seeking");
-            break;
-
-        }
-        io_retval = wish_fs_read(fd, peek_buf, peek_len);
-        if (io_retval == 0) {
-            WISHDEBUG(LOG_DEBUG, "End of file detected (2)");
-            break;
-        }
-        else if (io_retval < 0) {
-            WISHDEBUG(LOG_CRITICAL, "read error");
-            break;
-        }
+    if (!wish_identity_db_open()) {
+        return -1;
+    }
 
-        bson bs;
-        bson_init_with_data(&bs, peek_buf);
-        
-        int32_t elem_len = bson_size(&bs);
-        if (elem_len < 4 || elem_len > peek_len) {
-            WISHDEBUG(LOG_CRITICAL, "BSON Read error");
-            break;
-        }
-        /* Update prev offset so that we can later re-position the
-         * stream */
-        prev_offset+=elem_len;
+    wish_identity_db_entry_t* entry = wish_identity_db_find(uid);
+    if (entry == NULL) {
+        return -1;
+    }
 
-        bson_iterator it;
-        
-        if (bson_find_from_buffer(&it, peek_buf, "uid") != BSON_BINDATA) {
-            WISHDEBUG(LOG_CRITICAL, "Could not get uid (f)");
-            break;
-        }
-        if (memcmp(bson_iterator_bin_data(&it), uid, WISH_ID_LEN) == 0) {
-            WISHDEBUG(LOG_DEBUG, "Found identity (3)!");
-            if (identity_bson_doc_max_len >= elem_len) {
-                memcpy(identity_bson_doc, peek_buf, elem_len);
-                retval = 1;
-            }
-            else {
-                WISHDEBUG(LOG_CRITICAL, "Buffer to small to copy BSON doc into!");
-                retval = -1;
-            }
-            break;
-        }
-    } while (1);
+    if (identity_bson_doc_max_len < entry->len) {
+        WISHDEBUG(LOG_CRITICAL, "Buffer to small to copy BSON doc into!");
+        return -1;
+    }
 
-    wish_fs_close(fd);
-    return retval;
+    uint8_t* doc = wish_identity_db_load(entry);
+    if (doc == NULL) {
+        return -1;
+    }
 
+    memcpy(identity_bson_doc, doc, entry->len);
+    wish_platform_free(doc);
+    return 1;
 }
 
 /**
@@ -653,29 +449,29 @@ void wish_create_local_identity(wish_core_t *core, wish_identity_t *id, const ch
 
 /* Return 1 if privkey is known, else 0 */
 int wish_has_privkey(uint8_t *uid) {
-    uint8_t privkey[WISH_PRIVKEY_LEN];
-    if (wish_load_privkey(uid, privkey)) {
+    if (!wish_identity_db_open()) {
         return 0;
     }
-    return 1;
 
+    wish_identity_db_entry_t* entry = wish_identity_db_find(uid);
+    if (entry == NULL || !entry->has_privkey) {
+        return 0;
+    }
+    return 1;
 }
 
 int wish_load_pubkey(uint8_t *uid, uint8_t *dst_buffer) {
-    wish_identity_t id;
-    return_t retval = wish_identity_load(uid, &id);
+    wish_identity_db_entry_t* entry = NULL;
+    if (wish_identity_db_open()) {
+        entry = wish_identity_db_find(uid);
+    }
 
-    if (retval != RET_SUCCESS) {
+    if (entry == NULL) {
         WISHDEBUG(LOG_CRITICAL, "wish_load_pubkey: Identity not found");
-        wish_identity_destroy(&id);
         return -1;
     }
 
-    
-    memcpy(dst_buffer, id.pubkey, WISH_PUBKEY_LEN);
-
-    wish_identity_destroy(&id);
-        
+    memcpy(dst_buffer, entry->pubkey, WISH_PUBKEY_LEN);
     return 0;
 }
 
@@ -770,82 +566,12 @@ int wish_identity_remove(wish_core_t* core, uint8_t uid[WISH_ID_LEN]) {
         return retval;
     }
 
-    const char *oldpath = WISH_ID_DB_NAME;
-    const char *newpath = WISH_ID_DB_NAME ".tmp";
-    wish_file_t old_fd = wish_fs_open(oldpath);
-    wish_file_t new_fd = wish_fs_open(newpath);
-
-    /* Truncate the new file */
-    int32_t tmp = 0;
-    int wr_len = wish_fs_write(new_fd, &tmp, 0);
-    if (wr_len != 0) {
-        WISHDEBUG(LOG_CRITICAL, "Error truncating tmp file");
-    }
-
-    wish_offset_t prev_offset = 0;
-
-    do {
-        /* Determine length and uid of next element */
-        int peek_len = sizeof (wish_identity_t) + 100;
-        uint8_t peek_buf[peek_len];
-        /* Re-position the stream to the end of the previous BSON structure - 
-         * so that the next bytes to be read will be of the next element
-         * */
-        int io_retval = wish_fs_lseek(old_fd, prev_offset, WISH_FS_SEEK_SET);
-        if (io_retval == -1) {
-            WISHDEBUG(LOG_CRITICAL, "Error seeking");
-            break;
-
-        }
-        io_retval = wish_fs_read(old_fd, peek_buf, peek_len);
-        if (io_retval == 0) {
-            WISHDEBUG(LOG_DEBUG, "End of file detected (2)");
-            break;
-        }
-        else if (io_retval < 0) {
-            WISHDEBUG(LOG_CRITICAL, "read error");
-            break;
-        }
-
-        bson bs;
-        bson_init_with_data(&bs, peek_buf);
-        
-        int32_t elem_len = bson_size(&bs);
-        if (elem_len < 4 || elem_len > peek_len) {
-            WISHDEBUG(LOG_CRITICAL, "BSON Read error");
-            break;
-        }
-        
-        bson_iterator it;
-        
-        if (bson_find_from_buffer(&it, peek_buf, "uid") != BSON_BINDATA) {
-            WISHDEBUG(LOG_CRITICAL, "Could not get uid (g)");
-            break;
-        }
-        if (memcmp(bson_iterator_bin_data(&it), uid, WISH_ID_LEN) == 0) {
-            WISHDEBUG(LOG_DEBUG, "Remove: Found identity (2)!");
-            retval = 1;
-        }
-        else {
-            /* Write the document to new file */
-            wr_len = wish_fs_write(new_fd, peek_buf, elem_len);
-            if (wr_len == elem_len) {
-                WISHDEBUG(LOG_DEBUG, "Writing identity to new file");
-            }
-            else {
-                WISHDEBUG(LOG_CRITICAL, "Unexpected write len!");
-            }
-        }
-         /* Update prev offset so that we can later re-position the
-         * stream */
-        prev_offset+=elem_len;
-    } while (1);
+    retval = wish_identity_db_remove(uid);
     
-    wish_fs_close(new_fd);
-    wish_fs_close(old_fd);
-
-    wish_fs_remove(oldpath);
-    wish_fs_rename(newpath, oldpath);
+    if (retval == 1) {
+        wish_commit_request(core, WISH_COMMIT_IDENTITIES, NULL, NULL);
+        wish_ldiscover_invalidate(core, uid);
+    }
     
     /* For all connections: if identity is either in luid or ruid, close the connection. */
     wish_connection_t *wish_context_pool = wish_core_get_connection_pool(core);
@@ -870,106 +596,28 @@ int wish_identity_remove(wish_core_t* core, uint8_t uid[WISH_ID_LEN]) {
 }
 
 int wish_identity_update(wish_core_t* core, wish_identity_t* identity) {
-    int retval = 0;
-
-    const char* oldpath = WISH_ID_DB_NAME;
-    const char* newpath = WISH_ID_DB_NAME ".tmp";
-    wish_file_t old_fd = wish_fs_open(oldpath);
-    wish_file_t new_fd = wish_fs_open(newpath);
-      
-    //WISHDEBUG(LOG_CRITICAL, "wish_identity_update: old_fd %d new_fd %d", old_fd, new_fd);
- 
-    /* Truncate the new file */
-    int32_t tmp = 0;
-    int wr_len = wish_fs_write(new_fd, &tmp, 0);
-    if (wr_len != 0) {
-        WISHDEBUG(LOG_CRITICAL, "Error truncating tmp file");
-    }
-
-    wish_offset_t prev_offset = 0;
-
-    do {
-        /* Determine length and uid of next element */
-        int peek_len = sizeof (wish_identity_t) + 100;
-        uint8_t peek_buf[peek_len];
-        /* Re-position the stream to the end of the previous BSON structure - 
-         * so that the next bytes to be read will be of the next element
-         * */
-        int io_retval = wish_fs_lseek(old_fd, prev_offset, WISH_FS_SEEK_SET);
-        if (io_retval == -1) {
-            WISHDEBUG(LOG_CRITICAL, "Error seeking");
-            break;
-
-        }
-        io_retval = wish_fs_read(old_fd, peek_buf, peek_len);
-        if (io_retval == 0) {
-            WISHDEBUG(LOG_DEBUG, "End of file detected (2)");
-            break;
-        }
-        else if (io_retval < 0) {
-            WISHDEBUG(LOG_CRITICAL, "read error");
-            break;
-        }
-
-        bson bs;
-        bson_init_with_data(&bs, peek_buf);
-        
-        int32_t elem_len = bson_size(&bs);
-        if (elem_len < 4 || elem_len > peek_len) {
-            WISHDEBUG(LOG_CRITICAL, "BSON Read error");
-            break;
-        }
-        
-        bson_iterator it;
-        
-        if (bson_find_from_buffer(&it, peek_buf, "uid") != BSON_BINDATA) {
-            WISHDEBUG(LOG_CRITICAL, "Could not get uid (g)");
-            break;
-        }
-        if (memcmp(bson_iterator_bin_data(&it), identity->uid, WISH_ID_LEN) == 0) {
-            //WISHDEBUG(LOG_CRITICAL, "Update: Found identity (2)!");
-            retval = 1;
-            
-            bson bs = wish_identity_to_bson(identity);
-            
-            if (bs.data == NULL) {
-                WISHDEBUG(LOG_CRITICAL, "Failed updating identity. Could not product bson serialized data.");
-                // failed to produce bson from identity, keep the old one.
-                wr_len = wish_fs_write(new_fd, peek_buf, elem_len);
-                if (wr_len != elem_len) { WISHDEBUG(LOG_CRITICAL, "Unexpected write len! A"); }
-            } else {
-                //bson_visit("on the right track...", bson_data(&bs));
-                wr_len = wish_fs_write(new_fd, bson_data(&bs), bson_size(&bs));
-                if (wr_len != bson_size(&bs)) { WISHDEBUG(LOG_CRITICAL, "Unexpected write len! B"); }
-                bson_destroy(&bs);
-            }
-        } else {
-            /* Write the document to new file */
-            wr_len = wish_fs_write(new_fd, peek_buf, elem_len);
-            if (wr_len != elem_len) { WISHDEBUG(LOG_CRITICAL, "Unexpected write len! C"); }
-        }
-         /* Update prev offset so that we can later re-position the
-         * stream */
-        prev_offset+=elem_len;
-    } while (1);
+    bson bs = wish_identity_to_bson(identity);
     
-    wish_fs_close(new_fd);
-    wish_fs_close(old_fd);
-
-    wish_fs_remove(oldpath);
-    int rename_ret = wish_fs_rename(newpath, oldpath);
-    if ( rename_ret != 0) {
-        WISHDEBUG(LOG_CRITICAL, "Rename fails %d", rename_ret);
+    if (bs.data == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "Failed updating identity. Could not product bson serialized data.");
+        bson_destroy(&bs);
+        return 0;
+    }
+    
+    int retval = wish_identity_db_update((const uint8_t*) bson_data(&bs));
+    bson_destroy(&bs);
+    
+    if (retval == 1) {
+        wish_commit_request(core, WISH_COMMIT_IDENTITIES, NULL, NULL);
+        /* The alias may have changed */
+        wish_ldiscover_invalidate(core, identity->uid);
     }
     
     return retval;
 }
 
-
 void wish_identity_delete_db(void) {
-    if (wish_fs_remove(WISH_ID_DB_NAME)) {
-        WISHDEBUG(LOG_CRITICAL, "Unexpected while removing id db!");
-    }
+    wish_identity_db_delete();
 }
 
 /** Get the the list of local identities, that is an array of id database entries which can be used for opening Wish connections, meaning that the privkey is also in the database.  
@@ -978,19 +626,15 @@ void wish_identity_delete_db(void) {
  * @return number of local identities or 0 for an error
  */
 int wish_get_local_identity_list(wish_uid_list_elem_t *list, int list_len) {
-    int num_ids_in_db = wish_get_num_uid_entries();
-    wish_uid_list_elem_t all_uids_list[num_ids_in_db];
-    int num_uids = wish_load_uid_list(all_uids_list, num_ids_in_db);
-    
-    if(num_uids == 0) {
+    if (!wish_identity_db_open()) {
         return 0;
     }
     
-    int i = 0;
     int j = 0;
-    for (i = 0; i < num_uids; i++) {
-        if (wish_has_privkey(all_uids_list[i].uid)) {
-            memcpy(&(list[j++]), &(all_uids_list[i]), sizeof(wish_uid_list_elem_t));
+    wish_identity_db_entry_t* entry = NULL;
+    for (entry = wish_identity_db_first(); entry != NULL && j < list_len; entry = wish_identity_db_next(entry)) {
+        if (entry->has_privkey) {
+            memcpy(list[j++].uid, entry->uid, WISH_ID_LEN);
         }
     }
     return j;
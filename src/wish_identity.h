@@ -73,6 +73,15 @@ int wish_get_num_uid_entries(void);
  * identities in the database, and a negative number for an error */
 int wish_load_uid_list(wish_uid_list_elem_t *list, int list_len); 
 
+/**
+ * Load the uids of all identities in the database to a list which is
+ * allocated to fit, and must be freed with wish_platform_free().
+ * 
+ * @param list set to the list, or NULL if there are no identities
+ * @return the number of uids in the list, or a negative number for an error
+ */
+int wish_load_uid_list_alloc(wish_uid_list_elem_t **list);
+
 /** 
  * Initializes the structure and loads the contact specified by 'uid', storing it to
  * the pointer 'contact'
@@ -96,6 +105,14 @@ int wish_load_identity_bson(uint8_t *uid, uint8_t *identity_bson_doc, size_t ide
 /* Save identity to database */
 int wish_save_identity_entry(wish_identity_t *identity);
 
+/**
+ * Save many identities to the database with a single write. Either all
+ * are saved, or none.
+ * 
+ * @return 0 on success
+ */
+int wish_save_identity_entries(wish_identity_t *identities, int count);
+
 /* Save identity, expressed in BSON format, to the identity database */
 int wish_save_identity_entry_bson(const uint8_t *identity_doc);
 
@@ -0,0 +1,1209 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "wish_identity_db.h"
+#include "wish_fs.h"
+#include "wish_platform.h"
+#include "wish_debug.h"
+#include "wish_time.h"
+#include "bson.h"
+
+#define WISH_ID_DB_TMP_NAME WISH_ID_DB_NAME ".tmp"
+
+#define DB_MAGIC "WIDB"
+#define DB_MAGIC_LEN 4
+#define DB_HEADER_LEN 12
+#define DB_RECORD_HEADER_LEN 12
+/* uid, pubkey, offset, len, flags */
+#define DB_INDEX_ENTRY_LEN (WISH_ID_LEN + WISH_PUBKEY_LEN + 12)
+
+#define DB_RECORD_IDENTITY 1
+#define DB_RECORD_INDEX 2
+#define DB_RECORD_TOMBSTONE 3
+
+/* The interval of compaction steps */
+#define DB_COMPACT_INTERVAL_MS 100
+
+#define DB_FLAG_PRIVKEY 1
+
+static wish_identity_db_entry_t* db_index = NULL;
+static bool db_is_open = false;
+/* True while the entries point to a database in the old format, which is being converted */
+static bool db_legacy = false;
+/* The end of the last record */
+static uint32_t db_end = 0;
+/* The number of bytes of superseded records and tombstones */
+static uint32_t db_garbage = 0;
+/* After a failed compaction, the amount of garbage before trying again */
+static uint32_t db_compact_after = 0;
+/* True if records have been appended since the database was last synced */
+static bool db_unsynced = false;
+
+/* The database mapped to memory for reading, or NULL */
+static const uint8_t* db_map = NULL;
+static size_t db_map_len = 0;
+
+/* Reads go to the mapping of the database if the port supports it, and to the file otherwise */
+typedef struct {
+    wish_file_t fd;
+    const uint8_t* map;
+    uint32_t map_len;
+} db_reader_t;
+
+static struct {
+    bool active;
+    /* The offset of the next record to copy */
+    uint32_t pos;
+    /* The end of the new file */
+    uint32_t new_end;
+    /* Tombstones written after compaction started are copied, as the new file may have the records they remove */
+    uint32_t tombstones_from;
+    /* The number of bytes of superseded records and tombstones in the new file */
+    uint32_t garbage;
+} compaction;
+
+static uint32_t crc_table[256];
+static bool crc_table_ready = false;
+
+static uint32_t db_crc32(const uint8_t* data, uint32_t len) {
+    if (!crc_table_ready) {
+        uint32_t i = 0;
+        for (i = 0; i < 256; i++) {
+            uint32_t c = i;
+            int k = 0;
+            for (k = 0; k < 8; k++) {
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            crc_table[i] = c;
+        }
+        crc_table_ready = true;
+    }
+
+    uint32_t crc = 0xffffffff;
+    uint32_t i = 0;
+    for (i = 0; i < len; i++) {
+        crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc ^ 0xffffffff;
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static uint32_t get32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/* Read until len bytes are read or the end of file. Returns the number of bytes read, or -1 on error */
+static int32_t db_read(wish_file_t fd, uint8_t* buf, uint32_t len) {
+    uint32_t done = 0;
+    while (done < len) {
+        int32_t n = wish_fs_read(fd, buf + done, len - done);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+/* Read exactly len bytes at offset. Returns 0 on success */
+static int db_read_at(wish_file_t fd, uint32_t offset, uint8_t* buf, uint32_t len) {
+    if (wish_fs_lseek(fd, offset, WISH_FS_SEEK_SET) < 0) {
+        return -1;
+    }
+    return db_read(fd, buf, len) == len ? 0 : -1;
+}
+
+/* Drop the mapping of the database. Called after every write, the next read maps the file again. */
+static void db_unmap(void) {
+    if (db_map != NULL) {
+        wish_fs_unmap(db_map, db_map_len);
+        db_map = NULL;
+        db_map_len = 0;
+    }
+}
+
+static bool db_reader_open(db_reader_t* r) {
+    if (db_map == NULL) {
+        db_map = wish_fs_map(WISH_ID_DB_NAME, &db_map_len);
+    }
+
+    r->fd = -1;
+    r->map = db_map;
+    r->map_len = db_map_len;
+    if (r->map != NULL) {
+        return true;
+    }
+
+    r->fd = wish_fs_open(WISH_ID_DB_NAME);
+    if (r->fd < 0) {
+        WISHDEBUG(LOG_CRITICAL, "could not open identity db");
+        return false;
+    }
+    return true;
+}
+
+static void db_reader_close(db_reader_t* r) {
+    if (r->fd >= 0) {
+        wish_fs_close(r->fd);
+    }
+}
+
+/* Returns the size of the database, or -1 on error */
+static int32_t db_reader_size(db_reader_t* r) {
+    if (r->map != NULL) {
+        return r->map_len;
+    }
+    return wish_fs_lseek(r->fd, 0, WISH_FS_SEEK_END);
+}
+
+/**
+ * Get len bytes at offset of the database: a pointer into the mapping,
+ * or the bytes read into buf, which must then have room for len bytes.
+ *
+ * @return pointer to the bytes, or NULL if they could not be read
+ */
+static const uint8_t* db_get(db_reader_t* r, uint32_t offset, uint32_t len, uint8_t* buf) {
+    if (r->map != NULL) {
+        if (offset > r->map_len || len > r->map_len - offset) {
+            return NULL;
+        }
+        return r->map + offset;
+    }
+    return db_read_at(r->fd, offset, buf, len) ? NULL : buf;
+}
+
+static int db_write(wish_file_t fd, const uint8_t* buf, uint32_t len) {
+    uint32_t done = 0;
+    while (done < len) {
+        int32_t n = wish_fs_write(fd, buf + done, len - done);
+        if (n <= 0) {
+            WISHDEBUG(LOG_CRITICAL, "error writing identity database");
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int db_write_header(wish_file_t fd, uint32_t index_offset) {
+    uint8_t header[DB_HEADER_LEN];
+    memcpy(header, DB_MAGIC, DB_MAGIC_LEN);
+    put32(header + 4, WISH_ID_DB_VERSION);
+    put32(header + 8, index_offset);
+    return db_write(fd, header, DB_HEADER_LEN);
+}
+
+/* Put a record to dst, which must have room for DB_RECORD_HEADER_LEN + len bytes */
+static void db_format_record(uint8_t* dst, uint32_t type, const uint8_t* payload, uint32_t len) {
+    put32(dst, type);
+    put32(dst + 4, len);
+    put32(dst + 8, db_crc32(payload, len));
+    memcpy(dst + DB_RECORD_HEADER_LEN, payload, len);
+}
+
+/* Write a record at the current position with one write. Returns 0 on success */
+static int db_write_record(wish_file_t fd, uint32_t type, const uint8_t* payload, uint32_t len) {
+    uint8_t* record = wish_platform_malloc(DB_RECORD_HEADER_LEN + len);
+    if (record == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "Memory allocation fail for identity database record");
+        return -1;
+    }
+    db_format_record(record, type, payload, len);
+
+    int ret = db_write(fd, record, DB_RECORD_HEADER_LEN + len);
+    wish_platform_free(record);
+    return ret;
+}
+
+/* Fill in uid, pubkey and has_privkey of an entry from an identity document. Returns 0 on success */
+static int db_entry_from_doc(wish_identity_db_entry_t* entry, const uint8_t* doc, uint32_t len) {
+    memset(entry, 0, sizeof(wish_identity_db_entry_t));
+
+    if (len < 5 || bson_size2(doc) != len) {
+        return -1;
+    }
+
+    bson_iterator it;
+    if (bson_find_from_buffer(&it, (const char*) doc, "uid") != BSON_BINDATA || bson_iterator_bin_len(&it) != WISH_ID_LEN) {
+        return -1;
+    }
+    memcpy(entry->uid, bson_iterator_bin_data(&it), WISH_ID_LEN);
+
+    if (bson_find_from_buffer(&it, (const char*) doc, "pubkey") != BSON_BINDATA || bson_iterator_bin_len(&it) != WISH_PUBKEY_LEN) {
+        return -1;
+    }
+    memcpy(entry->pubkey, bson_iterator_bin_data(&it), WISH_PUBKEY_LEN);
+
+    entry->has_privkey = bson_find_from_buffer(&it, (const char*) doc, "privkey") == BSON_BINDATA
+            && bson_iterator_bin_len(&it) == WISH_PRIVKEY_LEN;
+    entry->len = len;
+    return 0;
+}
+
+/* Add a copy of entry to the index. The first entry of a uid is the one in effect. */
+static void db_index_add(const wish_identity_db_entry_t* entry) {
+    if (wish_identity_db_find(entry->uid) != NULL) {
+        return;
+    }
+
+    wish_identity_db_entry_t* copy = wish_platform_malloc(sizeof(wish_identity_db_entry_t));
+    if (copy == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "Memory allocation fail for identity database index");
+        return;
+    }
+    memcpy(copy, entry, sizeof(wish_identity_db_entry_t));
+    HASH_ADD(hh, db_index, uid, WISH_ID_LEN, copy);
+}
+
+/* Superseded or removed: the record of entry becomes garbage */
+static void db_entry_retire(wish_identity_db_entry_t* entry) {
+    db_garbage += DB_RECORD_HEADER_LEN + entry->len;
+    if (compaction.active && entry->compact_offset != 0) {
+        compaction.garbage += DB_RECORD_HEADER_LEN + entry->len;
+    }
+}
+
+/* Add entry to the index, replacing the entry of the same uid */
+static void db_index_put(const wish_identity_db_entry_t* entry) {
+    wish_identity_db_entry_t* existing = wish_identity_db_find(entry->uid);
+    if (existing == NULL) {
+        db_index_add(entry);
+        return;
+    }
+
+    db_entry_retire(existing);
+    memcpy(existing->pubkey, entry->pubkey, WISH_PUBKEY_LEN);
+    existing->has_privkey = entry->has_privkey;
+    existing->offset = entry->offset;
+    existing->len = entry->len;
+    existing->compact_offset = 0;
+}
+
+static void db_index_drop(const uint8_t* uid) {
+    wish_identity_db_entry_t* existing = wish_identity_db_find(uid);
+    if (existing == NULL) {
+        return;
+    }
+
+    db_entry_retire(existing);
+    HASH_DEL(db_index, existing);
+    wish_platform_free(existing);
+}
+
+static void db_index_clear(void) {
+    wish_identity_db_entry_t* entry = NULL;
+    wish_identity_db_entry_t* tmp = NULL;
+    HASH_ITER(hh, db_index, entry, tmp) {
+        HASH_DEL(db_index, entry);
+        wish_platform_free(entry);
+    }
+}
+
+/* Fill the index from the payload of an index record. Returns 0 on success */
+static int db_index_parse(const uint8_t* payload, uint32_t len) {
+    if (len % DB_INDEX_ENTRY_LEN != 0) {
+        return -1;
+    }
+
+    uint32_t pos = 0;
+    for (pos = 0; pos < len; pos += DB_INDEX_ENTRY_LEN) {
+        const uint8_t* p = payload + pos;
+        wish_identity_db_entry_t entry;
+        memset(&entry, 0, sizeof(entry));
+        memcpy(entry.uid, p, WISH_ID_LEN);
+        p += WISH_ID_LEN;
+        memcpy(entry.pubkey, p, WISH_PUBKEY_LEN);
+        p += WISH_PUBKEY_LEN;
+        entry.offset = get32(p);
+        entry.len = get32(p + 4);
+        entry.has_privkey = (get32(p + 8) & DB_FLAG_PRIVKEY) != 0;
+        db_index_add(&entry);
+    }
+    return 0;
+}
+
+static void db_index_entry_write(uint8_t* p, const wish_identity_db_entry_t* entry) {
+    memcpy(p, entry->uid, WISH_ID_LEN);
+    p += WISH_ID_LEN;
+    memcpy(p, entry->pubkey, WISH_PUBKEY_LEN);
+    p += WISH_PUBKEY_LEN;
+    put32(p, entry->offset);
+    put32(p + 4, entry->len);
+    put32(p + 8, entry->has_privkey ? DB_FLAG_PRIVKEY : 0);
+}
+
+/**
+ * Read and check the record at offset. With a mapping, the payload is
+ * not copied.
+ *
+ * @param to_free set to the buffer the caller must free after using
+ * the payload, or NULL
+ * @return the payload, or NULL at the end of the file or if the record
+ * is damaged. type is 0 if not even the record header could be read.
+ */
+static const uint8_t* db_read_record(db_reader_t* r, uint32_t offset, uint32_t* type, uint32_t* len, uint8_t** to_free) {
+    uint8_t header_buf[DB_RECORD_HEADER_LEN];
+    *type = 0;
+    *to_free = NULL;
+    const uint8_t* header = db_get(r, offset, DB_RECORD_HEADER_LEN, header_buf);
+    if (header == NULL) {
+        return NULL;
+    }
+
+    *type = get32(header);
+    *len = get32(header + 4);
+    uint32_t crc = get32(header + 8);
+
+    /* Index records grow with the number of identities, and are bounded only by the file */
+    if (*len > WISH_PORT_ID_DB_MAX_RECORD_LEN && *type != DB_RECORD_INDEX) {
+        WISHDEBUG(LOG_CRITICAL, "Identity database record at offset %u is too long", offset);
+        return NULL;
+    }
+
+    uint8_t* buf = NULL;
+    if (r->map == NULL) {
+        buf = wish_platform_malloc(*len > 0 ? *len : 1);
+        if (buf == NULL) {
+            WISHDEBUG(LOG_CRITICAL, "Memory allocation fail for identity database record");
+            return NULL;
+        }
+    }
+
+    const uint8_t* payload = db_get(r, offset + DB_RECORD_HEADER_LEN, *len, buf);
+    if (payload == NULL || db_crc32(payload, *len) != crc) {
+        WISHDEBUG(LOG_CRITICAL, "Identity database record at offset %u is damaged", offset);
+        if (buf != NULL) { wish_platform_free(buf); }
+        return NULL;
+    }
+
+    *to_free = buf;
+    return payload;
+}
+
+/**
+ * Apply the records from offset to the end of the file to the index.
+ * A damaged record which is followed by other records is skipped.
+ *
+ * @return the offset where reading stopped
+ */
+static uint32_t db_scan(db_reader_t* r, uint32_t offset, uint32_t file_end) {
+    while (1) {
+        uint32_t type = 0;
+        uint32_t len = 0;
+        uint8_t* to_free = NULL;
+        const uint8_t* payload = db_read_record(r, offset, &type, &len, &to_free);
+        if (payload == NULL) {
+            if (type != 0 && len <= WISH_PORT_ID_DB_MAX_RECORD_LEN && offset + DB_RECORD_HEADER_LEN + len < file_end) {
+                db_garbage += DB_RECORD_HEADER_LEN + len;
+                offset += DB_RECORD_HEADER_LEN + len;
+                continue;
+            }
+            break;
+        }
+
+        if (type == DB_RECORD_IDENTITY) {
+            wish_identity_db_entry_t entry;
+            if (db_entry_from_doc(&entry, payload, len) == 0) {
+                entry.offset = offset;
+                db_index_put(&entry);
+            }
+            else {
+                WISHDEBUG(LOG_CRITICAL, "Bad identity in database at offset %u, ignoring it", offset);
+                db_garbage += DB_RECORD_HEADER_LEN + len;
+            }
+        }
+        else {
+            if (type == DB_RECORD_TOMBSTONE && len == WISH_ID_LEN) {
+                db_index_drop(payload);
+            }
+            /* Tombstones, and index records which are not the last one */
+            db_garbage += DB_RECORD_HEADER_LEN + len;
+        }
+
+        if (to_free != NULL) { wish_platform_free(to_free); }
+        offset += DB_RECORD_HEADER_LEN + len;
+    }
+    return offset;
+}
+
+/* Add the documents of a database in the old format to the index */
+static void db_scan_legacy(db_reader_t* r) {
+    uint32_t offset = 0;
+    while (1) {
+        uint8_t len_buf[4];
+        const uint8_t* p = db_get(r, offset, sizeof(len_buf), len_buf);
+        if (p == NULL) {
+            break;
+        }
+        uint32_t len = get32(p);
+        if (len < 5 || len > WISH_PORT_ID_DB_MAX_RECORD_LEN) {
+            WISHDEBUG(LOG_CRITICAL, "BSON Read error");
+            break;
+        }
+
+        uint8_t* buf = NULL;
+        if (r->map == NULL) {
+            buf = wish_platform_malloc(len);
+            if (buf == NULL) {
+                break;
+            }
+        }
+        const uint8_t* doc = db_get(r, offset, len, buf);
+        if (doc == NULL) {
+            if (buf != NULL) { wish_platform_free(buf); }
+            break;
+        }
+
+        wish_identity_db_entry_t entry;
+        if (db_entry_from_doc(&entry, doc, len) == 0) {
+            entry.offset = offset;
+            db_index_add(&entry);
+        }
+        else {
+            WISHDEBUG(LOG_CRITICAL, "Bad identity in database at offset %u, ignoring it", offset);
+        }
+
+        if (buf != NULL) { wish_platform_free(buf); }
+        offset += len;
+    }
+}
+
+/* Read the document of an entry from the database, to a buffer the caller must free */
+static uint8_t* db_load(db_reader_t* r, const wish_identity_db_entry_t* entry) {
+    uint32_t header_len = db_legacy ? 0 : DB_RECORD_HEADER_LEN;
+    /* Without a mapping, the record is read to the buffer which is returned */
+    uint8_t* doc = wish_platform_malloc(r->map != NULL ? entry->len : header_len + entry->len);
+    if (doc == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "Memory allocation fail for identity");
+        return NULL;
+    }
+
+    const uint8_t* record = db_get(r, entry->offset, header_len + entry->len, doc);
+    if (record == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "Could not read identity at offset %u", entry->offset);
+        wish_platform_free(doc);
+        return NULL;
+    }
+
+    if (header_len > 0) {
+        if (get32(record) != DB_RECORD_IDENTITY || get32(record + 4) != entry->len
+                || get32(record + 8) != db_crc32(record + header_len, entry->len)) {
+            WISHDEBUG(LOG_CRITICAL, "Identity database record at offset %u is damaged", entry->offset);
+            wish_platform_free(doc);
+            return NULL;
+        }
+    }
+
+    memmove(doc, record + header_len, entry->len);
+    return doc;
+}
+
+/* Write an identity record at *offset, and its entry to index_entry. Returns 0 on success */
+static int db_rewrite_identity(wish_file_t fd, const uint8_t* doc, uint32_t* offset, uint8_t* index_entry) {
+    wish_identity_db_entry_t written;
+    if (db_entry_from_doc(&written, doc, bson_size2(doc))
+            || db_write_record(fd, DB_RECORD_IDENTITY, doc, written.len)) {
+        return -1;
+    }
+    written.offset = *offset;
+    db_index_entry_write(index_entry, &written);
+    *offset += DB_RECORD_HEADER_LEN + written.len;
+    return 0;
+}
+
+/**
+ * Write the identities in effect to a new file, with an index record at
+ * the end, and replace the database with it. The index in memory is
+ * rebuilt from the new file. Used when converting or repairing the
+ * database while opening it.
+ *
+ * @return 0 on success
+ */
+static int db_rewrite(void) {
+    uint32_t count = HASH_COUNT(db_index);
+    uint8_t* index = wish_platform_malloc(count * DB_INDEX_ENTRY_LEN + 1);
+    if (index == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "Memory allocation fail for identity database index");
+        return -1;
+    }
+
+    wish_fs_remove(WISH_ID_DB_TMP_NAME);
+
+    db_reader_t reader;
+    bool reader_open = db_reader_open(&reader);
+    wish_file_t new_fd = wish_fs_open(WISH_ID_DB_TMP_NAME);
+
+    int ret = 0;
+    if (!reader_open || new_fd < 0 || db_write_header(new_fd, 0)) {
+        WISHDEBUG(LOG_CRITICAL, "could not open identity db");
+        ret = -1;
+    }
+
+    uint32_t offset = DB_HEADER_LEN;
+    uint32_t num_entries = 0;
+
+    wish_identity_db_entry_t* entry = NULL;
+    wish_identity_db_entry_t* tmp = NULL;
+    HASH_ITER(hh, db_index, entry, tmp) {
+        if (ret != 0) {
+            break;
+        }
+
+        uint8_t* doc = db_load(&reader, entry);
+        if (doc == NULL) {
+            ret = -1;
+            break;
+        }
+
+        ret = db_rewrite_identity(new_fd, doc, &offset, index + num_entries * DB_INDEX_ENTRY_LEN);
+        num_entries++;
+        wish_platform_free(doc);
+    }
+
+    uint32_t index_offset = offset;
+    if (ret == 0) {
+        if (db_write_record(new_fd, DB_RECORD_INDEX, index, num_entries * DB_INDEX_ENTRY_LEN)
+                || wish_fs_lseek(new_fd, 0, WISH_FS_SEEK_SET) < 0
+                || db_write_header(new_fd, index_offset)
+                || wish_fs_sync(new_fd)) {
+            ret = -1;
+        }
+    }
+
+    if (new_fd >= 0) { wish_fs_close(new_fd); }
+    if (reader_open) { db_reader_close(&reader); }
+
+    if (ret == 0) {
+        db_unmap();
+        int rename_ret = wish_fs_replace(WISH_ID_DB_TMP_NAME, WISH_ID_DB_NAME);
+        if (rename_ret != 0) {
+            WISHDEBUG(LOG_CRITICAL, "Rename fails %d", rename_ret);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        db_index_clear();
+        db_legacy = false;
+        db_index_parse(index, num_entries * DB_INDEX_ENTRY_LEN);
+        db_end = index_offset + DB_RECORD_HEADER_LEN + num_entries * DB_INDEX_ENTRY_LEN;
+        db_garbage = 0;
+        db_unsynced = false;
+    }
+    else {
+        WISHDEBUG(LOG_CRITICAL, "Writing the identity database failed");
+        wish_fs_remove(WISH_ID_DB_TMP_NAME);
+        /* Read back whatever is in the database now */
+        db_index_clear();
+        db_legacy = false;
+        db_is_open = false;
+    }
+
+    wish_platform_free(index);
+    return ret;
+}
+
+/* Append formatted records to the database with one write. Returns the offset of the first record, or -1 on error */
+static int32_t db_append(const uint8_t* records, uint32_t len) {
+    wish_file_t fd = wish_fs_open(WISH_ID_DB_NAME);
+    if (fd < 0) {
+        WISHDEBUG(LOG_CRITICAL, "could not open identity db");
+        return -1;
+    }
+
+    if (db_end == 0) {
+        if (db_write_header(fd, 0)) {
+            wish_fs_close(fd);
+            return -1;
+        }
+        db_end = DB_HEADER_LEN;
+    }
+
+    int32_t offset = db_end;
+    if (wish_fs_lseek(fd, offset, WISH_FS_SEEK_SET) < 0 || db_write(fd, records, len)) {
+        WISHDEBUG(LOG_CRITICAL, "error appending to identity db");
+        wish_fs_close(fd);
+        return -1;
+    }
+    wish_fs_close(fd);
+    db_unmap();
+
+    db_end += len;
+    db_unsynced = true;
+    return offset;
+}
+
+/* Append a record to the database. Returns the offset of the record, or -1 on error */
+static int32_t db_append_record(uint32_t type, const uint8_t* payload, uint32_t len) {
+    uint8_t* record = wish_platform_malloc(DB_RECORD_HEADER_LEN + len);
+    if (record == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "Memory allocation fail for identity database record");
+        return -1;
+    }
+    db_format_record(record, type, payload, len);
+
+    int32_t offset = db_append(record, DB_RECORD_HEADER_LEN + len);
+    wish_platform_free(record);
+    return offset;
+}
+
+/**
+ * Append an index record of the whole index, and point the header to
+ * it, so that the records before it need not be read when the database
+ * is opened the next time.
+ *
+ * @param old_index_len the length of the record of the index in effect, or 0
+ * @return 0 on success
+ */
+static int db_checkpoint(uint32_t old_index_len) {
+    uint32_t count = HASH_COUNT(db_index);
+    uint8_t* index = wish_platform_malloc(count * DB_INDEX_ENTRY_LEN + 1);
+    if (index == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "Memory allocation fail for identity database index");
+        return -1;
+    }
+
+    uint32_t num_entries = 0;
+    wish_identity_db_entry_t* entry = NULL;
+    for (entry = db_index; entry != NULL; entry = entry->hh.next) {
+        db_index_entry_write(index + num_entries * DB_INDEX_ENTRY_LEN, entry);
+        num_entries++;
+    }
+
+    int32_t index_offset = db_append_record(DB_RECORD_INDEX, index, num_entries * DB_INDEX_ENTRY_LEN);
+    wish_platform_free(index);
+    /* The index record must be on stable storage before the header points to it */
+    if (index_offset < 0 || wish_identity_db_sync()) {
+        return -1;
+    }
+
+    wish_file_t fd = wish_fs_open(WISH_ID_DB_NAME);
+    if (fd < 0) {
+        return -1;
+    }
+    int ret = db_write_header(fd, index_offset);
+    wish_fs_close(fd);
+    db_unmap();
+
+    if (ret == 0) {
+        /* The index record replaced is garbage now */
+        if (old_index_len > 0) {
+            db_garbage += DB_RECORD_HEADER_LEN + old_index_len;
+        }
+        db_unsynced = true;
+    }
+    return ret;
+}
+
+static void db_compact_abort(void) {
+    WISHDEBUG(LOG_CRITICAL, "Compacting the identity database failed");
+    compaction.active = false;
+    wish_fs_remove(WISH_ID_DB_TMP_NAME);
+    db_compact_after = db_garbage + WISH_PORT_ID_DB_COMPACT_MIN;
+}
+
+/* Start compaction if there is enough garbage */
+static void db_maybe_compact(void) {
+    if (compaction.active || db_garbage < WISH_PORT_ID_DB_COMPACT_MIN || db_garbage < db_compact_after) {
+        return;
+    }
+    if ((uint64_t) db_garbage * 100 < (uint64_t) db_end * WISH_PORT_ID_DB_COMPACT_RATIO) {
+        return;
+    }
+
+    wish_fs_remove(WISH_ID_DB_TMP_NAME);
+    wish_file_t fd = wish_fs_open(WISH_ID_DB_TMP_NAME);
+    if (fd < 0) {
+        db_compact_after = db_garbage + WISH_PORT_ID_DB_COMPACT_MIN;
+        return;
+    }
+    int ret = db_write_header(fd, 0);
+    wish_fs_close(fd);
+    if (ret) {
+        db_compact_abort();
+        return;
+    }
+
+    wish_identity_db_entry_t* entry = NULL;
+    for (entry = db_index; entry != NULL; entry = entry->hh.next) {
+        entry->compact_offset = 0;
+    }
+
+    compaction.active = true;
+    compaction.pos = DB_HEADER_LEN;
+    compaction.new_end = DB_HEADER_LEN;
+    compaction.tombstones_from = db_end;
+    compaction.garbage = 0;
+}
+
+/* Write the index to the new file, close it, and replace the database with it. Returns 0 on success */
+static int db_compact_finish(wish_file_t new_fd) {
+    uint32_t count = HASH_COUNT(db_index);
+    uint8_t* index = wish_platform_malloc(count * DB_INDEX_ENTRY_LEN + 1);
+    if (index == NULL) {
+        wish_fs_close(new_fd);
+        return -1;
+    }
+
+    uint32_t i = 0;
+    wish_identity_db_entry_t* entry = NULL;
+    for (entry = db_index; entry != NULL; entry = entry->hh.next) {
+        if (entry->compact_offset == 0) {
+            /* Every record in effect must have been copied */
+            wish_platform_free(index);
+            wish_fs_close(new_fd);
+            return -1;
+        }
+        wish_identity_db_entry_t copied = *entry;
+        copied.offset = entry->compact_offset;
+        db_index_entry_write(index + i * DB_INDEX_ENTRY_LEN, &copied);
+        i++;
+    }
+
+    uint32_t index_offset = compaction.new_end;
+    int ret = 0;
+    if (wish_fs_lseek(new_fd, index_offset, WISH_FS_SEEK_SET) < 0
+            || db_write_record(new_fd, DB_RECORD_INDEX, index, count * DB_INDEX_ENTRY_LEN)
+            || wish_fs_lseek(new_fd, 0, WISH_FS_SEEK_SET) < 0
+            || db_write_header(new_fd, index_offset)
+            || wish_fs_sync(new_fd)) {
+        ret = -1;
+    }
+    wish_platform_free(index);
+    wish_fs_close(new_fd);
+
+    if (ret != 0) {
+        return -1;
+    }
+
+    db_unmap();
+    int rename_ret = wish_fs_replace(WISH_ID_DB_TMP_NAME, WISH_ID_DB_NAME);
+    if (rename_ret != 0) {
+        WISHDEBUG(LOG_CRITICAL, "Rename fails %d", rename_ret);
+        /* Read back whatever is in the database now */
+        compaction.active = false;
+        db_index_clear();
+        db_is_open = false;
+        return 0;
+    }
+
+    for (entry = db_index; entry != NULL; entry = entry->hh.next) {
+        entry->offset = entry->compact_offset;
+        entry->compact_offset = 0;
+    }
+    db_end = index_offset + DB_RECORD_HEADER_LEN + count * DB_INDEX_ENTRY_LEN;
+    db_garbage = compaction.garbage;
+    db_compact_after = 0;
+    /* The new file has every record, and was synced */
+    db_unsynced = false;
+    compaction.active = false;
+    return 0;
+}
+
+/**
+ * Copy the next records in effect to the new file. When all records
+ * are copied, replace the database with the new file. Records
+ * appended meanwhile are at the end of the database, and get copied
+ * too.
+ */
+static void db_compact_step(void) {
+    db_reader_t reader;
+    if (!db_reader_open(&reader)) {
+        db_compact_abort();
+        return;
+    }
+    wish_file_t new_fd = wish_fs_open(WISH_ID_DB_TMP_NAME);
+    if (new_fd < 0 || wish_fs_lseek(new_fd, compaction.new_end, WISH_FS_SEEK_SET) < 0) {
+        if (new_fd >= 0) { wish_fs_close(new_fd); }
+        db_reader_close(&reader);
+        db_compact_abort();
+        return;
+    }
+
+    int ret = 0;
+    int n = 0;
+    for (n = 0; n < WISH_PORT_ID_DB_COMPACT_STEP && compaction.pos < db_end; n++) {
+        uint32_t type = 0;
+        uint32_t len = 0;
+        uint8_t* to_free = NULL;
+        const uint8_t* payload = db_read_record(&reader, compaction.pos, &type, &len, &to_free);
+        if (payload == NULL) {
+            ret = -1;
+            break;
+        }
+
+        wish_identity_db_entry_t* entry = NULL;
+        bool copy = false;
+        if (type == DB_RECORD_IDENTITY) {
+            bson_iterator it;
+            if (bson_find_from_buffer(&it, (const char*) payload, "uid") == BSON_BINDATA && bson_iterator_bin_len(&it) == WISH_ID_LEN) {
+                entry = wish_identity_db_find((const uint8_t*) bson_iterator_bin_data(&it));
+            }
+            copy = entry != NULL && entry->offset == compaction.pos;
+        }
+        else if (type == DB_RECORD_TOMBSTONE) {
+            copy = compaction.pos >= compaction.tombstones_from;
+        }
+
+        if (copy) {
+            if (db_write_record(new_fd, type, payload, len)) {
+                if (to_free != NULL) { wish_platform_free(to_free); }
+                ret = -1;
+                break;
+            }
+            if (entry != NULL) {
+                entry->compact_offset = compaction.new_end;
+            }
+            else {
+                compaction.garbage += DB_RECORD_HEADER_LEN + len;
+            }
+            compaction.new_end += DB_RECORD_HEADER_LEN + len;
+        }
+
+        if (to_free != NULL) { wish_platform_free(to_free); }
+        compaction.pos += DB_RECORD_HEADER_LEN + len;
+    }
+
+    db_reader_close(&reader);
+
+    if (ret == 0 && compaction.pos >= db_end) {
+        /* Closes new_fd */
+        ret = db_compact_finish(new_fd);
+    }
+    else {
+        wish_fs_close(new_fd);
+    }
+
+    if (ret != 0) {
+        db_compact_abort();
+    }
+}
+
+static void db_compact_timer(wish_core_t* core, void* ctx) {
+    if (compaction.active) {
+        db_compact_step();
+    }
+}
+
+void wish_identity_db_init(wish_core_t* core) {
+    wish_core_time_set_interval_ms(core, db_compact_timer, NULL, DB_COMPACT_INTERVAL_MS);
+}
+
+/**
+ * The garbage of the whole file, when the records before the index have
+ * not been read: all that is not the header, a live identity or the
+ * index record in effect.
+ *
+ * @param index_record_len the length of the index record, with its header
+ */
+static uint32_t db_garbage_derive(uint32_t index_record_len) {
+    uint32_t live = DB_HEADER_LEN + index_record_len;
+    wish_identity_db_entry_t* entry = NULL;
+    for (entry = db_index; entry != NULL; entry = entry->hh.next) {
+        live += DB_RECORD_HEADER_LEN + entry->len;
+    }
+    return db_end > live ? db_end - live : 0;
+}
+
+bool wish_identity_db_open(void) {
+    if (db_is_open) {
+        return true;
+    }
+
+    db_reader_t reader;
+    if (!db_reader_open(&reader)) {
+        return false;
+    }
+
+    int32_t file_end = db_reader_size(&reader);
+    uint8_t header_buf[DB_HEADER_LEN];
+    const uint8_t* header = NULL;
+    bool rewrite = false;
+    /* If not 0, the length of the index record in effect + 1, and a new one is written */
+    uint32_t checkpoint_len = 0;
+
+    db_end = 0;
+    db_garbage = 0;
+
+    if (file_end < 0) {
+        WISHDEBUG(LOG_CRITICAL, "read error");
+        db_reader_close(&reader);
+        return false;
+    }
+    else if (file_end == 0) {
+        /* New database, the header is written with the first identity */
+    }
+    else if (file_end >= DB_HEADER_LEN && (header = db_get(&reader, 0, DB_HEADER_LEN, header_buf)) != NULL
+            && memcmp(header, DB_MAGIC, DB_MAGIC_LEN) == 0) {
+        uint32_t version = get32(header + 4);
+        if (version != WISH_ID_DB_VERSION) {
+            WISHDEBUG(LOG_CRITICAL, "Unsupported identity database version %u", version);
+            db_reader_close(&reader);
+            return false;
+        }
+
+        uint32_t index_offset = get32(header + 8);
+        uint32_t offset = DB_HEADER_LEN;
+        uint32_t index_len = 0;
+
+        if (index_offset != 0) {
+            uint32_t type = 0;
+            uint32_t len = 0;
+            uint8_t* to_free = NULL;
+            const uint8_t* payload = db_read_record(&reader, index_offset, &type, &len, &to_free);
+            if (payload != NULL && type == DB_RECORD_INDEX && db_index_parse(payload, len) == 0) {
+                offset = index_offset + DB_RECORD_HEADER_LEN + len;
+                index_len = len;
+            }
+            else {
+                WISHDEBUG(LOG_CRITICAL, "Identity database index is damaged, reading all records");
+                db_index_clear();
+                rewrite = true;
+            }
+            if (to_free != NULL) { wish_platform_free(to_free); }
+        }
+
+        db_end = db_scan(&reader, offset, file_end);
+        if (file_end != (int32_t) db_end) {
+            /* Drop the damaged data, so that new records are not appended after it */
+            rewrite = true;
+        }
+        else {
+            if (index_len > 0) {
+                db_garbage = db_garbage_derive(DB_RECORD_HEADER_LEN + index_len);
+            }
+            if (db_end - offset >= WISH_PORT_ID_DB_CHECKPOINT_LEN) {
+                checkpoint_len = index_len + 1;
+            }
+        }
+    }
+    else {
+        WISHDEBUG(LOG_CRITICAL, "Converting identity database to format version %d", WISH_ID_DB_VERSION);
+        db_scan_legacy(&reader);
+        db_legacy = true;
+        rewrite = true;
+    }
+
+    db_reader_close(&reader);
+    db_is_open = true;
+
+    if (rewrite && db_rewrite()) {
+        return false;
+    }
+
+    if (!rewrite && checkpoint_len > 0 && db_checkpoint(checkpoint_len - 1)) {
+        /* The records after the old index are read again the next time */
+        WISHDEBUG(LOG_CRITICAL, "Could not write identity database index");
+    }
+
+    db_maybe_compact();
+    return true;
+}
+
+int wish_identity_db_count(void) {
+    return HASH_COUNT(db_index);
+}
+
+wish_identity_db_entry_t* wish_identity_db_find(const uint8_t* uid) {
+    wish_identity_db_entry_t* entry = NULL;
+    HASH_FIND(hh, db_index, uid, WISH_ID_LEN, entry);
+    return entry;
+}
+
+wish_identity_db_entry_t* wish_identity_db_first(void) {
+    return db_index;
+}
+
+wish_identity_db_entry_t* wish_identity_db_next(wish_identity_db_entry_t* entry) {
+    return entry->hh.next;
+}
+
+uint8_t* wish_identity_db_load(const wish_identity_db_entry_t* entry) {
+    db_reader_t reader;
+    if (!db_reader_open(&reader)) {
+        return NULL;
+    }
+
+    uint8_t* doc = db_load(&reader, entry);
+    db_reader_close(&reader);
+    return doc;
+}
+
+int wish_identity_db_append(const uint8_t* doc) {
+    if (!wish_identity_db_open()) {
+        return 0;
+    }
+
+    wish_identity_db_entry_t entry;
+    if (db_entry_from_doc(&entry, doc, bson_size2(doc))) {
+        WISHDEBUG(LOG_CRITICAL, "Bad identity document, not saving");
+        return 0;
+    }
+
+    int32_t offset = db_append_record(DB_RECORD_IDENTITY, doc, entry.len);
+    if (offset < 0) {
+        return 0;
+    }
+
+    entry.offset = offset;
+    db_index_put(&entry);
+    db_maybe_compact();
+    return entry.len;
+}
+
+int wish_identity_db_append_batch(const uint8_t** docs, int count) {
+    if (!wish_identity_db_open()) {
+        return -1;
+    }
+
+    if (count <= 0) {
+        return 0;
+    }
+
+    wish_identity_db_entry_t* entries = wish_platform_malloc(count * sizeof(wish_identity_db_entry_t));
+    if (entries == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "Memory allocation fail for identity batch");
+        return -1;
+    }
+
+    uint32_t total = 0;
+    int i = 0;
+    for (i = 0; i < count; i++) {
+        if (db_entry_from_doc(&entries[i], docs[i], bson_size2(docs[i]))) {
+            WISHDEBUG(LOG_CRITICAL, "Bad identity document in batch, not saving");
+            wish_platform_free(entries);
+            return -1;
+        }
+        entries[i].offset = total;
+        total += DB_RECORD_HEADER_LEN + entries[i].len;
+    }
+
+    uint8_t* records = wish_platform_malloc(total);
+    if (records == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "Memory allocation fail for identity batch");
+        wish_platform_free(entries);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        db_format_record(records + entries[i].offset, DB_RECORD_IDENTITY, docs[i], entries[i].len);
+    }
+
+    int32_t offset = db_append(records, total);
+    wish_platform_free(records);
+
+    if (offset < 0) {
+        wish_platform_free(entries);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        entries[i].offset += offset;
+        db_index_put(&entries[i]);
+    }
+
+    wish_platform_free(entries);
+    db_maybe_compact();
+    return count;
+}
+
+int wish_identity_db_update(const uint8_t* doc) {
+    if (!wish_identity_db_open()) {
+        return 0;
+    }
+
+    bson_iterator it;
+    if (bson_find_from_buffer(&it, (const char*) doc, "uid") != BSON_BINDATA || bson_iterator_bin_len(&it) != WISH_ID_LEN) {
+        return 0;
+    }
+
+    if (wish_identity_db_find((const uint8_t*) bson_iterator_bin_data(&it)) == NULL) {
+        return 0;
+    }
+
+    return wish_identity_db_append(doc) > 0 ? 1 : 0;
+}
+
+int wish_identity_db_remove(const uint8_t* uid) {
+    if (!wish_identity_db_open()) {
+        return 0;
+    }
+
+    if (wish_identity_db_find(uid) == NULL) {
+        return 0;
+    }
+
+    if (db_append_record(DB_RECORD_TOMBSTONE, uid, WISH_ID_LEN) < 0) {
+        return 0;
+    }
+
+    db_index_drop(uid);
+    db_garbage += DB_RECORD_HEADER_LEN + WISH_ID_LEN;
+    db_maybe_compact();
+    return 1;
+}
+
+int wish_identity_db_sync(void) {
+    if (!db_unsynced) {
+        return 0;
+    }
+
+    wish_file_t fd = wish_fs_open(WISH_ID_DB_NAME);
+    if (fd < 0) {
+        WISHDEBUG(LOG_CRITICAL, "could not open identity db");
+        return -1;
+    }
+    int ret = wish_fs_sync(fd);
+    wish_fs_close(fd);
+
+    if (ret != 0) {
+        WISHDEBUG(LOG_CRITICAL, "Syncing the identity database failed");
+        return -1;
+    }
+    db_unsynced = false;
+    return 0;
+}
+
+void wish_identity_db_delete(void) {
+    if (compaction.active) {
+        compaction.active = false;
+        wish_fs_remove(WISH_ID_DB_TMP_NAME);
+    }
+
+    db_unmap();
+    db_index_clear();
+    db_legacy = false;
+    db_is_open = false;
+    db_end = 0;
+    db_garbage = 0;
+    db_compact_after = 0;
+    db_unsynced = false;
+
+    if (wish_fs_remove(WISH_ID_DB_NAME)) {
+        WISHDEBUG(LOG_CRITICAL, "Unexpected while removing id db!");
+    }
+}
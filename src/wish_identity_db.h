@@ -0,0 +1,193 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+#pragma once
+
+/* Wish C - Identity database storage
+ *
+ * The identity database file (WISH_ID_DB_NAME) starts with a header:
+ *
+ * magic "WIDB", version: uint32, index_offset: uint32
+ *
+ * followed by records, each of which is
+ *
+ * type: uint32, len: uint32, crc: uint32, payload: len bytes
+ *
+ * where crc is the CRC-32 of the payload. All integers are little
+ * endian. The payload of an identity record is the BSON document of
+ * the identity, and the payload of a tombstone record is the uid of a
+ * removed identity. The payload of an index record is the uid, pubkey,
+ * record offset, record length and flags of every identity written
+ * before it; index_offset in the header is the offset of the last index
+ * record, or 0 if there is none.
+ *
+ * The file is a log: adding and updating an identity appends an
+ * identity record, and removing one appends a tombstone. The last
+ * record of a uid is the one in effect.
+ *
+ * When the database is opened, the index record is read, and only the
+ * records after it are scanned. If the index record is missing or
+ * damaged, all records are scanned. If the scanned records take at
+ * least WISH_PORT_ID_DB_CHECKPOINT_LEN bytes, a new index record is
+ * appended, so that the next open reads just that. The same index is kept in memory,
+ * so that finding an identity does not read the file, and reading one
+ * is a single seek and read. If the port can map files to memory
+ * (wish_fs_set_map()), the database is read through a mapping instead,
+ * and records are scanned in place. The mapping is dropped whenever the
+ * database is written, and made again on the next read.
+ *
+ * When superseded records and tombstones take more than
+ * WISH_PORT_ID_DB_COMPACT_RATIO percent of the file, and at least
+ * WISH_PORT_ID_DB_COMPACT_MIN bytes, the records in effect are copied
+ * to a new file in the background, WISH_PORT_ID_DB_COMPACT_STEP
+ * records at a time. The new file, with an index record at the end,
+ * then replaces the database.
+ *
+ * Appended records are not synced to stable storage by the functions
+ * which write them; wish_identity_db_sync() does that, and is called by
+ * the commit layer (wish_commit.h), so that the records written within
+ * a short window are synced together. A rewritten or compacted file is
+ * synced before it replaces the database.
+ *
+ * A database in the old format, which is just the BSON documents one
+ * after another, is converted when it is opened.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "uthash.h"
+#include "wish_identity.h"
+
+#define WISH_ID_DB_VERSION 1
+
+/* Define the maximum length of an identity or tombstone record payload accepted when reading the database */
+#ifndef WISH_PORT_ID_DB_MAX_RECORD_LEN
+#define WISH_PORT_ID_DB_MAX_RECORD_LEN ( 64*1024 )
+#endif
+
+/* Define the number of bytes of records after the index record which makes opening the database write a new index record */
+#ifndef WISH_PORT_ID_DB_CHECKPOINT_LEN
+#define WISH_PORT_ID_DB_CHECKPOINT_LEN ( 16*1024 )
+#endif
+
+/* Define the number of bytes of superseded records and tombstones before the database is compacted */
+#ifndef WISH_PORT_ID_DB_COMPACT_MIN
+#define WISH_PORT_ID_DB_COMPACT_MIN ( 16*1024 )
+#endif
+
+/* Define the percentage of the file which must be superseded records and tombstones before the database is compacted */
+#ifndef WISH_PORT_ID_DB_COMPACT_RATIO
+#define WISH_PORT_ID_DB_COMPACT_RATIO 50
+#endif
+
+/* Define the maximum number of records copied per compaction step */
+#ifndef WISH_PORT_ID_DB_COMPACT_STEP
+#define WISH_PORT_ID_DB_COMPACT_STEP 32
+#endif
+
+typedef struct wish_identity_db_entry {
+    uint8_t uid[WISH_ID_LEN];
+    uint8_t pubkey[WISH_PUBKEY_LEN];
+    bool has_privkey;
+    /* The offset of the identity record in the file, and the length of its payload */
+    uint32_t offset;
+    uint32_t len;
+    /* The offset of the copy of the record in the database being compacted, or 0 */
+    uint32_t compact_offset;
+    UT_hash_handle hh;
+} wish_identity_db_entry_t;
+
+/** Start the timer which runs compaction. Called from wish_core_init(). */
+void wish_identity_db_init(wish_core_t* core);
+
+/**
+ * Open the identity database and read its index, unless already done.
+ * Appended records are not synced to stable storage by the functions
+ * which write them; wish_identity_db_sync() does that, and is called by
+ * the commit layer (wish_commit.h), so that the records written within
+ * a short window are synced together. A rewritten or compacted file is
+ * synced before it replaces the database.
+ *
+ * A database in the old format is converted.
+ *
+ * @return true if the database can be used
+ */
+bool wish_identity_db_open(void);
+
+/** Returns the number of identities in the database */
+int wish_identity_db_count(void);
+
+/** Returns the index entry of the identity uid, or NULL if there is no such identity */
+wish_identity_db_entry_t* wish_identity_db_find(const uint8_t* uid);
+
+/** Iterate the index entries in database order. Returns NULL at the end. */
+wish_identity_db_entry_t* wish_identity_db_first(void);
+wish_identity_db_entry_t* wish_identity_db_next(wish_identity_db_entry_t* entry);
+
+/**
+ * Read the BSON document of an identity from the database.
+ *
+ * @return the document, which the caller must free with
+ * wish_platform_free(), or NULL if it could not be read
+ */
+uint8_t* wish_identity_db_load(const wish_identity_db_entry_t* entry);
+
+/**
+ * Append the BSON document of an identity to the database. If the
+ * identity is already in the database, the new document replaces it.
+ *
+ * @return the number of bytes written, or 0 on error
+ */
+int wish_identity_db_append(const uint8_t* doc);
+
+/**
+ * Append the BSON documents of many identities to the database with a
+ * single write. Either all documents are written, or none.
+ *
+ * @return the number of documents written, or -1 on error
+ */
+int wish_identity_db_append_batch(const uint8_t** docs, int count);
+
+/**
+ * Replace the document of the identity with the uid of doc.
+ *
+ * @return 1 if the identity was updated, 0 if there is no such identity or on error
+ */
+int wish_identity_db_update(const uint8_t* doc);
+
+/**
+ * Remove an identity from the database.
+ *
+ * @return 1 if the identity was removed, 0 if there is no such identity or on error
+ */
+int wish_identity_db_remove(const uint8_t* uid);
+
+/**
+ * Sync the records appended since the last sync to stable storage.
+ *
+ * @return 0 on success, also if there was nothing to sync
+ */
+int wish_identity_db_sync(void);
+
+/** Remove the whole database */
+void wish_identity_db_delete(void);
+
+#ifdef __cplusplus
+}
+#endif
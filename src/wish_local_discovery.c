@@ -31,11 +31,17 @@
 #include "bson.h"
 #include "bson_visit.h"
 #include "wish_connection_mgr.h"
+#include "wish_reconnect.h"
 #include "wish_identity.h"
 #include "wish_dispatcher.h"
 #include "wish_core_signals.h"
 #include "wish_time.h"
 #include "wish_connection.h"
+#include "wish_platform.h"
+#include "utlist.h"
+
+static int ldiscover_transport_url(wish_core_t* core, char* transport_url);
+static void ldiscover_advertize(wish_core_t* core, uint8_t* uid, const char* transport_url);
 
 static void wish_ldiscover_periodic(wish_core_t* core, void* ctx) {
     //WISHDEBUG(LOG_CRITICAL, "Do some discovering...", ctx);
@@ -55,9 +61,28 @@ void wish_ldiscover_init(wish_core_t* core) {
 
 void wish_ldiscover_announce_all(wish_core_t* core) {
     if (core->loaded_num_ids > 0) {
+        /* The same transport is announced for all identities */
+        char transport_url[WISH_MAX_TRANSPORT_LEN];
+        if (ldiscover_transport_url(core, transport_url)) {
+            WISHDEBUG(LOG_CRITICAL, "Could not get Host IP addr");
+            return;
+        }
+        
         int c;
         for (c=0; c<core->loaded_num_ids; c++) {
-            wish_ldiscover_advertize(core, core->uid_list[c].uid);
+            ldiscover_advertize(core, core->uid_list[c].uid, transport_url);
+        }
+    }
+}
+
+void wish_ldiscover_invalidate(wish_core_t* core, const uint8_t* uid) {
+    wish_ldiscover_advert_t* advert = NULL;
+    wish_ldiscover_advert_t* tmp = NULL;
+    
+    LL_FOREACH_SAFE(core->ldiscover_adverts, advert, tmp) {
+        if (uid == NULL || memcmp(advert->uid, uid, WISH_ID_LEN) == 0) {
+            LL_DELETE(core->ldiscover_adverts, advert);
+            wish_platform_free(advert);
         }
     }
 }
@@ -331,6 +356,10 @@ size_t buffer_len) {
         // Will  connect over wld
         wish_identity_destroy(&id);
     }
+    
+    /* The contact is on the local network: in case connecting over the
+     * advertised address fails, retry its transports without backoff */
+    wish_reconnect_hint(core, uid_list[0].uid, ruid);
         
     /* Start connecting: Create new wish context with the ids */
     /* FIXME currently always using first uid of list */
@@ -349,26 +378,20 @@ size_t buffer_len) {
 
 }
 
-/* This function will create a 'transports' document in the memory
- * pointed to by the supplied pointer. 
- * @param transports_array   The pointer to memory where the document is to be
- * stored
- * @param transports_array_max_len The maxmimum allowed length of the document
+/* Write the transport URL announced in adverts to transport_url, which
+ * must have room for WISH_MAX_TRANSPORT_LEN bytes.
  * @return Value 0, if no error
  */
-static int append_transports_array(wish_core_t* core, bson* bs) {
-    
-    bson_append_start_array(bs, "transports");
-    
-    char transport_url[WISH_MAX_TRANSPORT_LEN];
-    char host_part[WISH_MAX_TRANSPORT_LEN];
-    
+static int ldiscover_transport_url(wish_core_t* core, char* transport_url) {
 #ifdef __APPLE__
     struct ifaddrs *ifap, *ifa;
     struct sockaddr_in *sa;
     char *addr;
+    int ret = 1;
     
-    getifaddrs (&ifap);
+    if (getifaddrs(&ifap)) {
+        return 1;
+    }
     int c = 0;
     for (ifa = ifap; ifa; ifa = ifa->ifa_next) {
         if (ifa->ifa_addr->sa_family==AF_INET) {
@@ -377,31 +400,26 @@ static int append_transports_array(wish_core_t* core, bson* bs) {
             addr = inet_ntoa(sa->sin_addr);
             //printf("Interface: %s\tAddress: %s\n", ifa->ifa_name, addr);
             wish_platform_sprintf(transport_url, "wish://%s:%d", addr, wish_get_host_port(core));
-            
-            bson_append_string(bs, "0", transport_url);
-            
-            freeifaddrs(ifap);
-            return 0;
+            ret = 0;
             break;
         }
     }
+    freeifaddrs(ifap);
+    return ret;
 #else
+    char host_part[WISH_MAX_TRANSPORT_LEN];
+    
     if (wish_get_host_ip_str(core, host_part, WISH_MAX_TRANSPORT_LEN)) {
-        WISHDEBUG(LOG_CRITICAL, "Could not get Host IP addr");
         return 1;
     }
     wish_platform_sprintf(transport_url, "wish://%s:%d", host_part, wish_get_host_port(core));
-
-    bson_append_string(bs, "0", transport_url);
-    
-#endif
-    bson_append_finish_array(bs);
     
     return 0;
+#endif
 }
 
-/* Send out one "advertizement" message for wish identity my_uid */
-void wish_ldiscover_advertize(wish_core_t* core, uint8_t* uid) {
+/* Build the advert message of a local identity, or return NULL if it cannot be advertized */
+static wish_ldiscover_advert_t* ldiscover_advert_build(wish_core_t* core, uint8_t* uid, const char* transport_url) {
     /* Advert message length:
      * uid len + hostid len + pubkey len + room for metadata */
 
@@ -411,13 +429,13 @@ void wish_ldiscover_advertize(wish_core_t* core, uint8_t* uid) {
     // Local discovery will not advertise if we cant load identity
     if (ret != RET_SUCCESS) { 
         wish_identity_destroy(&id);
-        return; 
+        return NULL; 
     }
 
     // Local discovery will not advertise if we don't have a private key
     if (!id.has_privkey) { 
         wish_identity_destroy(&id);
-        return; 
+        return NULL; 
     }
 
     const size_t msg_len = 2 + 2*(20 + WISH_ID_LEN) + 20 + WISH_PUBKEY_LEN + 10 + WISH_MAX_TRANSPORT_LEN + WISH_ALIAS_LEN;
@@ -443,27 +461,88 @@ void wish_ldiscover_advertize(wish_core_t* core, uint8_t* uid) {
     wish_core_get_host_id(core, host_id);
     bson_append_binary(&bs, "whid", host_id, WISH_ID_LEN);
 
-    uint8_t pubkey[WISH_PUBKEY_LEN] = { 0 };
-
-    if (wish_load_pubkey(uid, pubkey)) {
-        bson_visit("failed to load pubkey for uid", bson_data(&bs));
-        wish_identity_destroy(&id);
-        return;
-    }
-
-    bson_append_binary(&bs, "pubkey", pubkey, WISH_PUBKEY_LEN);
-    append_transports_array(core, &bs);
+    bson_append_binary(&bs, "pubkey", id.pubkey, WISH_PUBKEY_LEN);
+    
+    bson_append_start_array(&bs, "transports");
+    bson_append_string(&bs, "0", transport_url);
+    bson_append_finish_array(&bs);
     
     if (core->config_skip_connection_acl) {
         bson_append_bool(&bs, "claim", true);
     }
 
     bson_finish(&bs);
+    wish_identity_destroy(&id);
+
+    if (bs.err) {
+        WISHDEBUG(LOG_CRITICAL, "Could not build advertizement message");
+        return NULL;
+    }
 
     //bson_visit("Advertisement message going out from core:", bson_data(&bs));
     
-    wish_send_advertizement(core, msg, 2 + bson_size(&bs));
-    wish_identity_destroy(&id);
+    size_t len = 2 + bson_size(&bs);
+    wish_ldiscover_advert_t* advert = wish_platform_malloc(sizeof(wish_ldiscover_advert_t) + len);
+    if (advert == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "Memory allocation fail for advertizement message");
+        return NULL;
+    }
+    memset(advert, 0, sizeof(wish_ldiscover_advert_t));
+    memcpy(advert->uid, uid, WISH_ID_LEN);
+    strncpy(advert->transport, transport_url, WISH_MAX_TRANSPORT_LEN - 1);
+    strncpy(advert->wld_class, core->wld_class, WISH_WLD_CLASS_MAX_LEN - 1);
+    advert->claim = core->config_skip_connection_acl;
+    advert->len = len;
+    memcpy(advert->msg, msg, len);
+    
+    return advert;
+}
+
+/* Send the advert of uid, building it unless the cached one is up to date */
+static void ldiscover_advertize(wish_core_t* core, uint8_t* uid, const char* transport_url) {
+    /* Only local identities are advertized; contacts are skipped without reading them */
+    if (!wish_has_privkey(uid)) {
+        return;
+    }
+    
+    wish_ldiscover_advert_t* advert = NULL;
+    
+    LL_FOREACH(core->ldiscover_adverts, advert) {
+        if (memcmp(advert->uid, uid, WISH_ID_LEN) == 0) {
+            break;
+        }
+    }
+    
+    if (advert != NULL 
+            && (strncmp(advert->transport, transport_url, WISH_MAX_TRANSPORT_LEN) != 0
+            || strncmp(advert->wld_class, core->wld_class, WISH_WLD_CLASS_MAX_LEN) != 0
+            || advert->claim != core->config_skip_connection_acl)) {
+        LL_DELETE(core->ldiscover_adverts, advert);
+        wish_platform_free(advert);
+        advert = NULL;
+    }
+    
+    if (advert == NULL) {
+        advert = ldiscover_advert_build(core, uid, transport_url);
+        if (advert == NULL) {
+            return;
+        }
+        LL_PREPEND(core->ldiscover_adverts, advert);
+    }
+    
+    wish_send_advertizement(core, advert->msg, advert->len);
+}
+
+/* Send out one "advertizement" message for wish identity my_uid */
+void wish_ldiscover_advertize(wish_core_t* core, uint8_t* uid) {
+    char transport_url[WISH_MAX_TRANSPORT_LEN];
+    
+    if (ldiscover_transport_url(core, transport_url)) {
+        WISHDEBUG(LOG_CRITICAL, "Could not get Host IP addr");
+        return;
+    }
+    
+    ldiscover_advertize(core, uid, transport_url);
 }
 
 void wish_ldiscover_add(wish_core_t* core, wish_ldiscover_t* entry) {
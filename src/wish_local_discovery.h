@@ -55,6 +55,24 @@ typedef struct wish_ldiscover_t {
     const char* class;
 } wish_ldiscover_t;
 
+/**
+ * The advert message of a local identity, built once and sent on each
+ * announcement. The transport, class and claim state it was built with
+ * are compared to the current ones before sending, and the advert is
+ * rebuilt if they differ. Changes to the identity are handled by
+ * wish_ldiscover_invalidate().
+ */
+typedef struct wish_ldiscover_advert {
+    uint8_t uid[WISH_ID_LEN];
+    char transport[WISH_MAX_TRANSPORT_LEN];
+    char wld_class[WISH_WLD_CLASS_MAX_LEN];
+    bool claim;
+    /* The length of msg */
+    size_t len;
+    struct wish_ldiscover_advert* next;
+    uint8_t msg[];
+} wish_ldiscover_advert_t;
+
 void wish_ldiscover_init(wish_core_t* core);
 
 /** Make announcements for all identities */
@@ -81,6 +99,9 @@ void wish_ldiscover_feed(wish_core_t* core, wish_ip_addr_t *ip, uint16_t port, u
 /* Send out one "advertizement" message for wish identity my_uid */
 void wish_ldiscover_advertize(wish_core_t* core, uint8_t *my_uid);
 
+/** Drop the cached advert of uid, or all cached adverts if uid is NULL. Call when an identity changes. */
+void wish_ldiscover_invalidate(wish_core_t* core, const uint8_t* uid);
+
 /** */
 void wish_ldiscover_add(wish_core_t* core, wish_ldiscover_t* entry);
 
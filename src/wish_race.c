@@ -0,0 +1,235 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "wish_race.h"
+#include "wish_reconnect.h"
+#include "wish_connection.h"
+#include "wish_connection_mgr.h"
+#include "wish_time.h"
+#include "wish_platform.h"
+#include "wish_debug.h"
+#include "utlist.h"
+
+/* The period of the race timer; the stagger is kept to this precision */
+#define RACE_TICK_MS 50
+
+static bool race_has_members(wish_core_t* core, wish_connection_race_t* race) {
+    int i = 0;
+    for (i = 0; i < WISH_CONTEXT_POOL_SZ; i++) {
+        wish_connection_t* connection = &(core->connection_pool[i]);
+        if (connection->context_state != WISH_CONTEXT_FREE && connection->race == race) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Returns the index of the transport the connection was started for, or -1 */
+static int race_transport_index(wish_connection_race_t* race, wish_connection_t* connection) {
+    int i = 0;
+    for (i = 0; i < race->next_transport; i++) {
+        if (race->attempts[i] == connection->connection_id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void race_delete(wish_core_t* core, wish_connection_race_t* race) {
+    int i = 0;
+    for (i = 0; i < race->num_transports; i++) {
+        if (!race->reported[i]) {
+            /* Cancelled or never started: neither a success nor a failure */
+            wish_reconnect_transport_cancelled(core, race->luid, race->ruid, race->transports[i]);
+        }
+    }
+    for (i = 0; i < WISH_CONTEXT_POOL_SZ; i++) {
+        wish_connection_t* connection = &(core->connection_pool[i]);
+        if (connection->race == race) {
+            connection->race = NULL;
+        }
+    }
+    LL_DELETE(core->race_db, race);
+    wish_platform_free(race);
+}
+
+/* Start the next transport of the race. The connection may fail right away, for example when the host name is known not to exist. */
+static void race_start_next(wish_core_t* core, wish_connection_race_t* race) {
+    int index = race->next_transport;
+    const char* transport = race->transports[index];
+    race->next_transport++;
+    race->next_start = wish_time_get_relative_ms(core) + WISH_PORT_RACE_STAGGER_MS;
+
+    wish_connection_t* connection = wish_connection_init(core, race->luid, race->ruid);
+    if (connection == NULL) {
+        race->reported[index] = true;
+        wish_reconnect_transport_failed(core, race->luid, race->ruid, transport);
+        return;
+    }
+    connection->race = race;
+    race->attempts[index] = connection->connection_id;
+    
+    WISHDEBUG(LOG_DEBUG, "Race: starting transport %i of %i: %s", race->next_transport, race->num_transports, transport);
+    wish_connections_open_transport(core, connection, transport);
+}
+
+/* Cancel the attempts which have not yet got their transport connected, as the leader is in handshake */
+static void race_cancel_others(wish_core_t* core, wish_connection_race_t* race, wish_connection_t* leader) {
+    int i = 0;
+    for (i = 0; i < WISH_CONTEXT_POOL_SZ; i++) {
+        wish_connection_t* connection = &(core->connection_pool[i]);
+        if (connection == leader || connection->race != race || connection->context_state == WISH_CONTEXT_FREE) {
+            continue;
+        }
+        WISHDEBUG(LOG_DEBUG, "Race: cancelling connection %i", connection->connection_id);
+        connection->race = NULL;
+        wish_close_connection(core, connection);
+    }
+}
+
+static void wish_race_periodic(wish_core_t* core, void* ctx) {
+    wish_connection_race_t* race = NULL;
+    wish_connection_race_t* tmp = NULL;
+    
+    LL_FOREACH_SAFE(core->race_db, race, tmp) {
+        if (race->leader == 0 && wish_core_is_connected_luid_ruid(core, race->luid, race->ruid)) {
+            /* Connected otherwise, for example by the remote core connecting to us */
+            race_cancel_others(core, race, NULL);
+            race_delete(core, race);
+            continue;
+        }
+        
+        if (race->leader != 0) {
+            wish_connection_t* leader = wish_core_lookup_ctx_by_connection_id(core, race->leader);
+            if (leader != NULL && leader->race == race && leader->context_state == WISH_CONTEXT_CONNECTED) {
+                /* The race is won */
+                int index = race_transport_index(race, leader);
+                if (index >= 0) {
+                    race->reported[index] = true;
+                    wish_reconnect_transport_connected(core, race->luid, race->ruid, race->transports[index]);
+                }
+                race_delete(core, race);
+                continue;
+            }
+            if (leader != NULL && leader->race == race && leader->context_state == WISH_CONTEXT_IN_MAKING) {
+                /* Handshake in progress */
+                continue;
+            }
+            /* The leader failed, go on with the next transport right away */
+            race->leader = 0;
+            race->next_start = wish_time_get_relative_ms(core);
+        }
+        
+        if (race->next_transport < race->num_transports) {
+            if (wish_time_get_relative_ms(core) >= race->next_start) {
+                race_start_next(core, race);
+            }
+        }
+        else if (!race_has_members(core, race)) {
+            WISHDEBUG(LOG_DEBUG, "Race: all transports failed");
+            race_delete(core, race);
+        }
+    }
+}
+
+void wish_race_init(wish_core_t* core) {
+    core->race_db = NULL;
+    wish_core_time_set_interval_ms(core, &wish_race_periodic, NULL, RACE_TICK_MS);
+}
+
+static wish_connection_race_t* race_lookup(wish_core_t* core, const uint8_t* luid, const uint8_t* ruid) {
+    wish_connection_race_t* race = NULL;
+    
+    LL_FOREACH(core->race_db, race) {
+        if (memcmp(race->luid, luid, WISH_ID_LEN) == 0 && memcmp(race->ruid, ruid, WISH_ID_LEN) == 0) {
+            return race;
+        }
+    }
+    return NULL;
+}
+
+bool wish_race_is_on(wish_core_t* core, const uint8_t* luid, const uint8_t* ruid) {
+    return race_lookup(core, luid, ruid) != NULL;
+}
+
+void wish_race_start(wish_core_t* core, const uint8_t* luid, const uint8_t* ruid, char transports[][WISH_MAX_TRANSPORT_LEN], int num_transports) {
+    if (race_lookup(core, luid, ruid) != NULL) {
+        /* Already connecting */
+        return;
+    }
+    
+    wish_connection_race_t* race = wish_platform_malloc(sizeof(wish_connection_race_t));
+    if (race == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "Memory allocation fail when starting connection race");
+        return;
+    }
+    memset(race, 0, sizeof(wish_connection_race_t));
+    memcpy(race->luid, luid, WISH_ID_LEN);
+    memcpy(race->ruid, ruid, WISH_ID_LEN);
+    
+    int i = 0;
+    for (i = 0; i < num_transports && i < WISH_MAX_TRANSPORTS; i++) {
+        strncpy(race->transports[i], transports[i], WISH_MAX_TRANSPORT_LEN - 1);
+    }
+    race->num_transports = i;
+    
+    if (race->num_transports == 0) {
+        wish_platform_free(race);
+        return;
+    }
+    
+    LL_APPEND(core->race_db, race);
+    race_start_next(core, race);
+}
+
+bool wish_race_transport_connected(wish_core_t* core, wish_connection_t* connection) {
+    wish_connection_race_t* race = connection->race;
+    if (race == NULL) {
+        return true;
+    }
+    
+    if (race->leader != 0 && race->leader != connection->connection_id) {
+        WISHDEBUG(LOG_DEBUG, "Race: connection %i connected, but lost the race", connection->connection_id);
+        connection->race = NULL;
+        return false;
+    }
+    
+    race->leader = connection->connection_id;
+    race_cancel_others(core, race, connection);
+    return true;
+}
+
+void wish_race_connection_closed(wish_core_t* core, wish_connection_t* connection) {
+    wish_connection_race_t* race = connection->race;
+    if (race == NULL) {
+        return;
+    }
+    connection->race = NULL;
+    
+    int index = race_transport_index(race, connection);
+    if (index >= 0 && !race->reported[index]) {
+        race->reported[index] = true;
+        wish_reconnect_transport_failed(core, race->luid, race->ruid, race->transports[index]);
+    }
+    
+    if (race->leader == connection->connection_id) {
+        /* The leader failed in handshake, the next transport is started on the next tick */
+        race->leader = 0;
+        race->next_start = wish_time_get_relative_ms(core);
+    }
+}
@@ -0,0 +1,93 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+#pragma once
+
+/* Wish C - Racing the transports of a contact
+ *
+ * When connecting to a contact with several transports, the first
+ * transport is tried right away, and the alternates are started one by
+ * one, WISH_PORT_RACE_STAGGER_MS milliseconds apart. The first connection to
+ * get its transport connected becomes the leader of the race: the
+ * attempts still connecting or resolving are cancelled before they
+ * start the handshake, and no more alternates are started. If the
+ * leader fails before the handshake completes, the race continues with
+ * the next transport right away. The race ends when the leader is
+ * connected, or when all transports have failed.
+ *
+ * The outcome of each transport is reported to the reconnect scheduler
+ * (wish_reconnect.h).
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include "wish_core.h"
+#include "wish_connection.h"
+#include "wish_identity.h"
+
+/* Define the number of milliseconds between starting the alternate transports of a contact */
+#ifndef WISH_PORT_RACE_STAGGER_MS
+#define WISH_PORT_RACE_STAGGER_MS 250
+#endif
+
+typedef struct wish_connection_race {
+    uint8_t luid[WISH_ID_LEN];
+    uint8_t ruid[WISH_ID_LEN];
+    char transports[WISH_MAX_TRANSPORTS][WISH_MAX_TRANSPORT_LEN];
+    int num_transports;
+    /* The index of the next transport to start */
+    int next_transport;
+    /* The time when the next transport is started, in ms relative to core start */
+    wish_time_ms_t next_start;
+    /* The connection started for each transport, 0 if not started yet */
+    wish_connection_id_t attempts[WISH_MAX_TRANSPORTS];
+    /* True when the outcome of the transport has been reported */
+    bool reported[WISH_MAX_TRANSPORTS];
+    /* The connection which is in handshake, 0 if none yet */
+    wish_connection_id_t leader;
+    struct wish_connection_race* next;
+} wish_connection_race_t;
+
+/** Start the periodic race timer. Called from wish_connections_init(). */
+void wish_race_init(wish_core_t* core);
+
+/**
+ * Start connecting luid to ruid using the given transports, in order,
+ * unless a race between them is already on.
+ */
+void wish_race_start(wish_core_t* core, const uint8_t* luid, const uint8_t* ruid, char transports[][WISH_MAX_TRANSPORT_LEN], int num_transports);
+
+/** Returns true if a race between luid and ruid is on */
+bool wish_race_is_on(wish_core_t* core, const uint8_t* luid, const uint8_t* ruid);
+
+/**
+ * Called when the transport of an outgoing connection is connected,
+ * before the handshake is started.
+ *
+ * @return true if the connection may start the handshake, false if
+ * another connection of the same race is already in handshake. The
+ * caller must then close the connection.
+ */
+bool wish_race_transport_connected(wish_core_t* core, wish_connection_t* connection);
+
+/** Called when a connection is closed */
+void wish_race_connection_closed(wish_core_t* core, wish_connection_t* connection);
+
+#ifdef __cplusplus
+}
+#endif
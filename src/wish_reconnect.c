@@ -0,0 +1,309 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "wish_reconnect.h"
+#include "wish_race.h"
+#include "wish_connection.h"
+#include "wish_identity.h"
+#include "wish_time.h"
+#include "wish_platform.h"
+#include "wish_debug.h"
+#include "utlist.h"
+
+/* The delay after the given number of consecutive failures: exponential, with jitter of up to half of the delay */
+static wish_time_t backoff_delay(int failures) {
+    wish_time_t delay = WISH_PORT_RECONNECT_MAX_DELAY;
+    if (failures < 16 && (WISH_PORT_RECONNECT_MIN_DELAY << failures) < WISH_PORT_RECONNECT_MAX_DELAY) {
+        delay = WISH_PORT_RECONNECT_MIN_DELAY << failures;
+    }
+    wish_time_t half = delay / 2;
+    return delay - half + ((unsigned long) wish_platform_rng() % (half + 1));
+}
+
+static wish_reconnect_t* reconnect_lookup(wish_core_t* core, const uint8_t* luid, const uint8_t* ruid) {
+    wish_reconnect_t* entry = NULL;
+    LL_FOREACH(core->reconnect_db, entry) {
+        if (memcmp(entry->luid, luid, WISH_ID_LEN) == 0 && memcmp(entry->ruid, ruid, WISH_ID_LEN) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static struct wish_reconnect_transport* transport_lookup(wish_reconnect_t* entry, const char* url) {
+    int i = 0;
+    for (i = 0; i < entry->num_transports; i++) {
+        if (strncmp(entry->transports[i].url, url, WISH_MAX_TRANSPORT_LEN) == 0) {
+            return &entry->transports[i];
+        }
+    }
+    return NULL;
+}
+
+/* True if there is any connection between luid and ruid, connected or being connected */
+static bool has_connection(wish_core_t* core, const uint8_t* luid, const uint8_t* ruid) {
+    int i = 0;
+    for (i = 0; i < WISH_CONTEXT_POOL_SZ; i++) {
+        wish_connection_t* connection = &(core->connection_pool[i]);
+        if (connection->context_state != WISH_CONTEXT_FREE 
+                && memcmp(connection->luid, luid, WISH_ID_LEN) == 0 
+                && memcmp(connection->ruid, ruid, WISH_ID_LEN) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Reload the transports and flags of the contact. The state of the transports which did not change is kept. */
+static void reconnect_load(wish_core_t* core, wish_reconnect_t* entry) {
+    wish_identity_t id;
+    if (wish_identity_load(entry->ruid, &id) != RET_SUCCESS) {
+        WISHDEBUG(LOG_CRITICAL, "Reconnect: failed loading identity");
+        wish_identity_destroy(&id);
+        entry->disabled = true;
+        return;
+    }
+    
+    entry->disabled = wish_identity_get_meta_connect(&id) == false || wish_identity_is_banned(&id) == true;
+    
+    struct wish_reconnect_transport transports[WISH_MAX_TRANSPORTS];
+    int num_transports = 0;
+    memset(transports, 0, sizeof(transports));
+    
+    int i = 0;
+    for (i = 0; i < WISH_MAX_TRANSPORTS; i++) {
+        const char* url = id.transports[i];
+        if (strnlen(url, WISH_MAX_TRANSPORT_LEN) == 0) {
+            continue;
+        }
+        struct wish_reconnect_transport* old = transport_lookup(entry, url);
+        if (old != NULL) {
+            transports[num_transports] = *old;
+        }
+        else {
+            strncpy(transports[num_transports].url, url, WISH_MAX_TRANSPORT_LEN - 1);
+            transports[num_transports].next_attempt = core->core_time;
+        }
+        num_transports++;
+    }
+    wish_identity_destroy(&id);
+    
+    memcpy(entry->transports, transports, sizeof(transports));
+    entry->num_transports = num_transports;
+}
+
+/* Update the time when the contact is looked at next: when its first transport is due */
+static void reconnect_update_next_check(wish_core_t* core, wish_reconnect_t* entry) {
+    if (entry->disabled || entry->num_transports == 0) {
+        /* Reloaded on the next sync */
+        entry->next_check = core->core_time + WISH_PORT_RECONNECT_MAX_DELAY;
+        return;
+    }
+    
+    entry->next_check = entry->transports[0].next_attempt;
+    int i = 0;
+    for (i = 1; i < entry->num_transports; i++) {
+        if (entry->transports[i].next_attempt < entry->next_check) {
+            entry->next_check = entry->transports[i].next_attempt;
+        }
+    }
+}
+
+/* Start connecting with the transports which are due */
+static void reconnect_attempt(wish_core_t* core, wish_reconnect_t* entry) {
+    reconnect_load(core, entry);
+    
+    char due[WISH_MAX_TRANSPORTS][WISH_MAX_TRANSPORT_LEN];
+    int num_due = 0;
+    
+    int i = 0;
+    for (i = 0; i < entry->num_transports && !entry->disabled; i++) {
+        struct wish_reconnect_transport* transport = &entry->transports[i];
+        if (transport->next_attempt > core->core_time) {
+            continue;
+        }
+        memcpy(due[num_due++], transport->url, WISH_MAX_TRANSPORT_LEN);
+        /* Not due again until the race has reported back */
+        transport->next_attempt = core->core_time + WISH_PORT_RECONNECT_MAX_DELAY;
+    }
+    
+    if (num_due > 0) {
+        WISHDEBUG(LOG_DEBUG, "Reconnect: %i transports due", num_due);
+        wish_race_start(core, entry->luid, entry->ruid, due, num_due);
+    }
+    
+    reconnect_update_next_check(core, entry);
+}
+
+static void wish_reconnect_periodic(wish_core_t* core, void* ctx) {
+    int started = 0;
+    wish_reconnect_t* entry = NULL;
+    
+    LL_FOREACH(core->reconnect_db, entry) {
+        if (entry->next_check > core->core_time) {
+            continue;
+        }
+        
+        if (wish_race_is_on(core, entry->luid, entry->ruid)) {
+            continue;
+        }
+        
+        if (has_connection(core, entry->luid, entry->ruid)) {
+            /* If the connection is lost, reconnect after the minimum delay */
+            entry->next_check = core->core_time + backoff_delay(0);
+            continue;
+        }
+        
+        if (started >= WISH_PORT_RECONNECT_MAX_PER_TICK) {
+            /* The rest on the next tick */
+            break;
+        }
+        
+        reconnect_attempt(core, entry);
+        started++;
+    }
+}
+
+static void wish_reconnect_sync_periodic(wish_core_t* core, void* ctx) {
+    wish_reconnect_sync(core);
+}
+
+void wish_reconnect_init(wish_core_t* core) {
+    core->reconnect_db = NULL;
+    wish_core_time_set_interval(core, &wish_reconnect_periodic, NULL, 1);
+    wish_core_time_set_interval(core, &wish_reconnect_sync_periodic, NULL, WISH_RECONNECT_SYNC_INTERVAL);
+    /* The first sync once the core is up */
+    wish_core_time_set_timeout(core, &wish_reconnect_sync_periodic, NULL, 1);
+}
+
+void wish_reconnect_sync(wish_core_t* core) {
+    wish_uid_list_elem_t* uid_list = NULL;
+    int num_uids = wish_load_uid_list_alloc(&uid_list);
+    if (num_uids <= 0) {
+        return;
+    }
+
+    wish_reconnect_t* entry = NULL;
+    wish_reconnect_t* tmp = NULL;
+    
+    LL_FOREACH(core->reconnect_db, entry) {
+        entry->seen = false;
+    }
+    
+    /* Note: as before, the first identity in the database is the local identity used for connecting */
+    int j;
+    for (j = 1; j < num_uids; j++) {
+        entry = reconnect_lookup(core, uid_list[0].uid, uid_list[j].uid);
+        if (entry == NULL) {
+            entry = wish_platform_malloc(sizeof(wish_reconnect_t));
+            if (entry == NULL) {
+                WISHDEBUG(LOG_CRITICAL, "Memory allocation fail in reconnect sync");
+                break;
+            }
+            memset(entry, 0, sizeof(wish_reconnect_t));
+            memcpy(entry->luid, uid_list[0].uid, WISH_ID_LEN);
+            memcpy(entry->ruid, uid_list[j].uid, WISH_ID_LEN);
+            /* Spread the first attempts to new contacts over the minimum delay */
+            entry->next_check = core->core_time + ((unsigned long) wish_platform_rng() % WISH_PORT_RECONNECT_MIN_DELAY);
+            LL_APPEND(core->reconnect_db, entry);
+        }
+        else if (entry->disabled) {
+            /* The flags may have changed, reload the contact */
+            entry->disabled = false;
+            entry->next_check = core->core_time;
+        }
+        entry->seen = true;
+    }
+    
+    wish_platform_free(uid_list);
+    
+    /* Forget contacts which were removed */
+    LL_FOREACH_SAFE(core->reconnect_db, entry, tmp) {
+        if (!entry->seen) {
+            LL_DELETE(core->reconnect_db, entry);
+            wish_platform_free(entry);
+        }
+    }
+}
+
+void wish_reconnect_hint(wish_core_t* core, const uint8_t* luid, const uint8_t* ruid) {
+    wish_reconnect_t* entry = reconnect_lookup(core, luid, ruid);
+    if (entry == NULL) {
+        return;
+    }
+    
+    int i = 0;
+    for (i = 0; i < entry->num_transports; i++) {
+        entry->transports[i].failures = 0;
+        entry->transports[i].next_attempt = core->core_time;
+    }
+    entry->disabled = false;
+    entry->next_check = core->core_time;
+}
+
+void wish_reconnect_hint_all(wish_core_t* core) {
+    wish_reconnect_t* entry = NULL;
+    LL_FOREACH(core->reconnect_db, entry) {
+        wish_reconnect_hint(core, entry->luid, entry->ruid);
+    }
+}
+
+void wish_reconnect_transport_failed(wish_core_t* core, const uint8_t* luid, const uint8_t* ruid, const char* url) {
+    wish_reconnect_t* entry = reconnect_lookup(core, luid, ruid);
+    if (entry == NULL) {
+        return;
+    }
+    struct wish_reconnect_transport* transport = transport_lookup(entry, url);
+    if (transport == NULL) {
+        return;
+    }
+    
+    transport->failures++;
+    transport->next_attempt = core->core_time + backoff_delay(transport->failures);
+    reconnect_update_next_check(core, entry);
+}
+
+void wish_reconnect_transport_cancelled(wish_core_t* core, const uint8_t* luid, const uint8_t* ruid, const char* url) {
+    wish_reconnect_t* entry = reconnect_lookup(core, luid, ruid);
+    if (entry == NULL) {
+        return;
+    }
+    struct wish_reconnect_transport* transport = transport_lookup(entry, url);
+    if (transport == NULL) {
+        return;
+    }
+    
+    /* Not a failure: keep the backoff of the transport as it was before the race */
+    transport->next_attempt = core->core_time + (transport->failures > 0 ? backoff_delay(transport->failures) : 0);
+    reconnect_update_next_check(core, entry);
+}
+
+void wish_reconnect_transport_connected(wish_core_t* core, const uint8_t* luid, const uint8_t* ruid, const char* url) {
+    wish_reconnect_t* entry = reconnect_lookup(core, luid, ruid);
+    if (entry == NULL) {
+        return;
+    }
+    struct wish_reconnect_transport* transport = transport_lookup(entry, url);
+    if (transport == NULL) {
+        return;
+    }
+    
+    transport->failures = 0;
+    transport->next_attempt = core->core_time;
+    reconnect_update_next_check(core, entry);
+}
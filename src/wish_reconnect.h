@@ -0,0 +1,108 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+#pragma once
+
+/* Wish C - Reconnect scheduler
+ *
+ * The scheduler keeps, in memory, the contacts we should be connected
+ * to, and for each of their transports the number of consecutive
+ * failed attempts and the time of the next attempt. After a failure
+ * the delay doubles from WISH_PORT_RECONNECT_MIN_DELAY up to
+ * WISH_PORT_RECONNECT_MAX_DELAY, with random jitter of up to half the
+ * delay, so that attempts to many contacts are spread out in time.
+ *
+ * Once a second, the contacts with transports due are connected (see
+ * wish_race.h), at most WISH_PORT_RECONNECT_MAX_PER_TICK contacts at a
+ * time. The identity of a contact is loaded only when an attempt is
+ * due. The list of contacts is synced with the identity database every
+ * WISH_RECONNECT_SYNC_INTERVAL seconds, which does not cause any
+ * connection attempts by itself.
+ *
+ * Hints make contacts due right away: wish_reconnect_hint() when a
+ * contact is seen on the local network, and wish_reconnect_hint_all()
+ * when the network has changed.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include "wish_core.h"
+#include "wish_identity.h"
+
+/* Define the delay before reconnecting after a disconnect, and the first retry delay, in seconds */
+#ifndef WISH_PORT_RECONNECT_MIN_DELAY
+#define WISH_PORT_RECONNECT_MIN_DELAY 4
+#endif
+
+/* Define the maximum retry delay, in seconds */
+#ifndef WISH_PORT_RECONNECT_MAX_DELAY
+#define WISH_PORT_RECONNECT_MAX_DELAY 600
+#endif
+
+/* Define the maximum number of contacts for which connecting is started per second */
+#ifndef WISH_PORT_RECONNECT_MAX_PER_TICK
+#define WISH_PORT_RECONNECT_MAX_PER_TICK 8
+#endif
+
+#define WISH_RECONNECT_SYNC_INTERVAL 60 /* seconds */
+
+struct wish_reconnect_transport {
+    char url[WISH_MAX_TRANSPORT_LEN];
+    /* Consecutive failed attempts */
+    int failures;
+    wish_time_t next_attempt;
+};
+
+typedef struct wish_reconnect {
+    uint8_t luid[WISH_ID_LEN];
+    uint8_t ruid[WISH_ID_LEN];
+    struct wish_reconnect_transport transports[WISH_MAX_TRANSPORTS];
+    int num_transports;
+    /* The time when the contact is looked at next. Until then, no transport is due. */
+    wish_time_t next_check;
+    /* True if the contact is flagged as 'do not connect' or 'banned' */
+    bool disabled;
+    /* Used when syncing with the identity database */
+    bool seen;
+    struct wish_reconnect* next;
+} wish_reconnect_t;
+
+/** Start the scheduler. Called from wish_connections_init(). */
+void wish_reconnect_init(wish_core_t* core);
+
+/** Sync the list of contacts with the identity database */
+void wish_reconnect_sync(wish_core_t* core);
+
+/** The contact ruid has been seen, retry all its transports right away */
+void wish_reconnect_hint(wish_core_t* core, const uint8_t* luid, const uint8_t* ruid);
+
+/** The network has changed, retry all contacts right away */
+void wish_reconnect_hint_all(wish_core_t* core);
+
+/** Called by the race when connecting with a transport has failed */
+void wish_reconnect_transport_failed(wish_core_t* core, const uint8_t* luid, const uint8_t* ruid, const char* url);
+
+/** Called by the race for a transport which was not tried, or was cancelled because another transport won */
+void wish_reconnect_transport_cancelled(wish_core_t* core, const uint8_t* luid, const uint8_t* ruid, const char* url);
+
+/** Called by the race when a transport has been connected */
+void wish_reconnect_transport_connected(wish_core_t* core, const uint8_t* luid, const uint8_t* ruid, const char* url);
+
+#ifdef __cplusplus
+}
+#endif
@@ -179,6 +179,10 @@ again:
             
             /* This a convenient place to make a first connection check, because we know at this point that we have a working Internet connection */
             wish_connections_check(core); 
+
+            /* The session id may have been followed by keep-alives or
+             * connection attempts in the same read */
+            goto again;
         }
         break;
     case WISH_RELAY_CLIENT_WAIT:
@@ -186,7 +190,9 @@ again:
          * regular "keep-alive" messages (a '.' character every 10 secs)
          */
         /* FIXME How do we handle connection close? */
-        if (ring_buffer_length(&(relay->rx_ringbuf)) >= 1) {
+        /* Process everything received, the port may have fed us
+         * several commands at once */
+        while (relay->curr_state == WISH_RELAY_CLIENT_WAIT && ring_buffer_length(&(relay->rx_ringbuf)) >= 1) {
             uint8_t byte = 0;
             ring_buffer_read(&(relay->rx_ringbuf), &byte, 1);
             switch (byte) {
@@ -229,7 +235,6 @@ again:
                 else {
                     wish_open_connection_dns(core, connection, relay->host, relay->port, true);
                 }
-                goto again;
                 break;
             }
             default:
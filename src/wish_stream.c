@@ -0,0 +1,511 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "wish_stream.h"
+#include "wish_fragment.h"
+#include "wish_compress.h"
+#include "wish_connection.h"
+#include "wish_connection_mgr.h"
+#include "wish_dispatcher.h"
+#include "wish_platform.h"
+#include "wish_debug.h"
+#include "utlist.h"
+#include "bson.h"
+
+/* The number of bytes reserved in each frame for the BSON envelope of a chunk */
+#define WISH_STREAM_CHUNK_OVERHEAD 64
+
+static wish_stream_t* stream_find(wish_stream_t* head, wish_stream_id_t id) {
+    wish_stream_t* stream;
+    LL_FOREACH(head, stream) {
+        if (stream->id == id) {
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+static wish_stream_t* stream_find_by_wsid(wish_stream_t* head, const uint8_t* wsid) {
+    wish_stream_t* stream;
+    LL_FOREACH(head, stream) {
+        if (!stream->tx_ending && memcmp(stream->wsid, wsid, WISH_WSID_LEN) == 0) {
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+static int stream_count(wish_stream_t* head) {
+    int count = 0;
+    wish_stream_t* stream;
+    LL_COUNT(head, stream, count);
+    return count;
+}
+
+static wish_stream_t* stream_create(wish_stream_id_t id) {
+    wish_stream_t* stream = wish_platform_malloc(sizeof(wish_stream_t));
+    if (stream == NULL) {
+        return NULL;
+    }
+    memset(stream, 0, sizeof(wish_stream_t));
+    stream->id = id;
+    stream->tx_credit = WISH_PORT_STREAM_WINDOW;
+    return stream;
+}
+
+static void stream_destroy(wish_stream_t* stream) {
+    struct wish_stream_msg* msg;
+    struct wish_stream_msg* tmp;
+    LL_FOREACH_SAFE(stream->tx_queue, msg, tmp) {
+        LL_DELETE(stream->tx_queue, msg);
+        wish_platform_free(msg->data);
+        wish_platform_free(msg);
+    }
+    if (stream->rx_buf != NULL) {
+        wish_platform_free(stream->rx_buf);
+    }
+    wish_platform_free(stream);
+}
+
+static bool stream_tx_ready(wish_stream_t* stream) {
+    return stream->tx_queue != NULL && stream->tx_credit > 0;
+}
+
+/* Send { stream, credit } as control traffic, or { stream, end: true } if credit is 0. Returns 0 on success */
+static int stream_send_control(wish_core_t* core, wish_connection_t* connection, wish_stream_t* stream, int32_t credit) {
+    uint8_t buffer[64];
+    bson bs;
+    bson_init_buffer(&bs, buffer, sizeof(buffer));
+    bson_append_int(&bs, "stream", stream->id);
+    if (credit > 0) {
+        bson_append_int(&bs, "credit", credit);
+    }
+    else {
+        bson_append_bool(&bs, "end", true);
+    }
+    bson_finish(&bs);
+
+    /* A sender waiting for credit must not wait behind bulk data */
+    return wish_core_send_frame_class(core, connection, bson_data(&bs), bson_size(&bs), WISH_TX_CLASS_CONTROL);
+}
+
+/**
+ * End an outgoing stream which has nothing queued, and release it. If
+ * the end message cannot be sent now, the stream is kept until
+ * wish_stream_schedule() sends it.
+ *
+ * @return true if the stream was released
+ */
+static bool stream_end(wish_core_t* core, wish_connection_t* connection, wish_stream_t* stream) {
+    stream->tx_ending = true;
+
+    if (stream_send_control(core, connection, stream, 0)) {
+        return false;
+    }
+
+    LL_DELETE(connection->tx_streams, stream);
+    stream_destroy(stream);
+    return true;
+}
+
+static void stream_send_credit(wish_core_t* core, wish_connection_t* connection, wish_stream_t* stream) {
+    if (stream_send_control(core, connection, stream, stream->rx_consumed) == 0) {
+        stream->rx_consumed = 0;
+        stream->rx_credit_due = false;
+    }
+    else {
+        /* The sender may be waiting for it: wish_stream_schedule() tries again */
+        stream->rx_credit_due = true;
+    }
+}
+
+/* End a stream which has nothing queued, to make room for a new one. Returns true if a stream was released */
+static bool stream_end_idle(wish_core_t* core, wish_connection_t* connection) {
+    wish_stream_t* stream;
+    LL_FOREACH(connection->tx_streams, stream) {
+        if (stream->tx_queue == NULL && !stream->tx_ending) {
+            return stream_end(core, connection, stream);
+        }
+    }
+    return false;
+}
+
+int wish_stream_send(wish_core_t* core, wish_connection_t* connection, const uint8_t* wsid, const uint8_t* payload, int payload_len) {
+    if (payload_len <= 0) {
+        return 1;
+    }
+
+    wish_stream_t* stream = stream_find_by_wsid(connection->tx_streams, wsid);
+    if (stream == NULL) {
+        if (stream_count(connection->tx_streams) >= WISH_PORT_MAX_STREAMS && !stream_end_idle(core, connection)) {
+            /* Every stream is busy: send without a stream, which the remote end accepts as well */
+            WISHDEBUG(LOG_DEBUG, "No free stream on connection, sending message without a stream");
+            return wish_core_send_message(core, connection, payload, payload_len);
+        }
+        stream = stream_create(++connection->tx_stream_next_id);
+        if (stream == NULL) {
+            WISHDEBUG(LOG_CRITICAL, "Memory allocation fail when opening stream");
+            return 1;
+        }
+        memcpy(stream->wsid, wsid, WISH_WSID_LEN);
+        LL_APPEND(connection->tx_streams, stream);
+    }
+
+    if (stream->tx_queued + payload_len > WISH_PORT_STREAM_TX_QUEUE_SZ && stream->tx_queue != NULL) {
+        /* A single message larger than the queue is accepted on an empty queue */
+        WISHDEBUG(LOG_DEBUG, "Stream %i queue full", stream->id);
+        return 1;
+    }
+
+    struct wish_stream_msg* msg = wish_platform_malloc(sizeof(struct wish_stream_msg));
+    if (msg == NULL) {
+        return 1;
+    }
+
+    /* The message is compressed as a whole, and the chunks carry the compressed message */
+    int compressed_len = 0;
+    msg->data = wish_compress_message(connection, payload, payload_len, &compressed_len);
+    if (msg->data != NULL) {
+        payload_len = compressed_len;
+    }
+    else {
+        msg->data = wish_platform_malloc(payload_len);
+        if (msg->data == NULL) {
+            wish_platform_free(msg);
+            WISHDEBUG(LOG_CRITICAL, "Memory allocation fail when queuing message of len %i", payload_len);
+            return 1;
+        }
+        memcpy(msg->data, payload, payload_len);
+    }
+    msg->len = payload_len;
+    msg->offset = 0;
+    msg->next = NULL;
+
+    LL_APPEND(stream->tx_queue, msg);
+    stream->tx_queued += payload_len;
+
+    return 0;
+}
+
+/* Send the next chunk of the stream. Returns the number of message bytes sent, or -1 if sending failed. */
+static int stream_send_chunk(wish_core_t* core, wish_connection_t* connection, wish_stream_t* stream, uint8_t* buffer, size_t buffer_len) {
+    struct wish_stream_msg* msg = stream->tx_queue;
+
+    int32_t data_len = msg->len - msg->offset;
+    if (data_len > WISH_PORT_STREAM_CHUNK_SZ) {
+        data_len = WISH_PORT_STREAM_CHUNK_SZ;
+    }
+    if (data_len > stream->tx_credit) {
+        data_len = stream->tx_credit;
+    }
+
+    bson bs;
+    bson_init_buffer(&bs, buffer, buffer_len);
+    bson_append_int(&bs, "stream", stream->id);
+    bson_append_binary(&bs, "data", msg->data + msg->offset, data_len);
+    bson_append_int(&bs, "total", msg->len);
+    bson_finish(&bs);
+
+    if (bs.err) {
+        WISHDEBUG(LOG_CRITICAL, "BSON write error when building stream chunk");
+        return -1;
+    }
+
+    if (wish_core_send_frame_class(core, connection, bson_data(&bs), bson_size(&bs), WISH_TX_CLASS_BULK)) {
+        return -1;
+    }
+
+    stream->tx_credit -= data_len;
+    msg->offset += data_len;
+
+    if (msg->offset == msg->len) {
+        LL_DELETE(stream->tx_queue, msg);
+        stream->tx_queued -= msg->len;
+        wish_platform_free(msg->data);
+        wish_platform_free(msg);
+    }
+
+    return data_len;
+}
+
+void wish_stream_schedule(wish_core_t* core, wish_connection_t* connection) {
+    if (connection->context_state != WISH_CONTEXT_CONNECTED || !wish_stream_tx_pending(connection)) {
+        return;
+    }
+
+    wish_stream_t* stream;
+    wish_stream_t* tmp;
+
+    /* Control messages which could not be sent earlier go first */
+    LL_FOREACH(connection->rx_streams, stream) {
+        if (stream->rx_credit_due) {
+            stream_send_credit(core, connection, stream);
+        }
+    }
+    LL_FOREACH_SAFE(connection->tx_streams, stream, tmp) {
+        if (stream->tx_ending) {
+            stream_end(core, connection, stream);
+        }
+    }
+
+    size_t buffer_len = WISH_PORT_STREAM_CHUNK_SZ + WISH_STREAM_CHUNK_OVERHEAD;
+    uint8_t* buffer = wish_platform_malloc(buffer_len);
+    if (buffer == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "Memory allocation fail when scheduling streams");
+        return;
+    }
+
+    /* One round: take each stream from the head of the list, send a
+     * chunk if it is ready, and move it to the tail. The list order is
+     * thus preserved across rounds, and every stream gets its turn. */
+    int n = stream_count(connection->tx_streams);
+    int budget = WISH_PORT_STREAM_ROUND_SZ;
+    /* No chunks while the transport has not taken the earlier frames,
+     * they would only pile up in front of the control messages */
+    while (n-- > 0 && budget > 0 && wish_connection_tx_buffered(connection, NULL) == 0) {
+        stream = connection->tx_streams;
+        LL_DELETE(connection->tx_streams, stream);
+        LL_APPEND(connection->tx_streams, stream);
+
+        if (!stream_tx_ready(stream)) {
+            continue;
+        }
+
+        int sent = stream_send_chunk(core, connection, stream, buffer, buffer_len);
+        if (sent < 0) {
+            /* The remote end cannot recover from a missing chunk */
+            WISHDEBUG(LOG_CRITICAL, "Sending on stream %i failed, closing connection", stream->id);
+            wish_platform_free(buffer);
+            wish_close_connection(core, connection);
+            return;
+        }
+        budget -= sent;
+    }
+
+    wish_platform_free(buffer);
+}
+
+bool wish_stream_tx_pending(wish_connection_t* connection) {
+    wish_stream_t* stream;
+    LL_FOREACH(connection->tx_streams, stream) {
+        if (stream_tx_ready(stream) || stream->tx_ending) {
+            return true;
+        }
+    }
+    LL_FOREACH(connection->rx_streams, stream) {
+        if (stream->rx_credit_due) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void stream_feed_credit(wish_core_t* core, wish_connection_t* connection, wish_stream_id_t id, int32_t credit) {
+    wish_stream_t* stream = stream_find(connection->tx_streams, id);
+    if (stream == NULL) {
+        WISHDEBUG(LOG_DEBUG, "Credit for unknown stream %i", id);
+        return;
+    }
+    if (credit <= 0 || credit > WISH_PORT_STREAM_WINDOW - stream->tx_credit) {
+        WISHDEBUG(LOG_CRITICAL, "Bad credit %i for stream %i, closing connection", credit, id);
+        wish_close_connection(core, connection);
+        return;
+    }
+    stream->tx_credit += credit;
+
+    if (stream->tx_queue == NULL && stream->tx_credit == WISH_PORT_STREAM_WINDOW && !stream->tx_ending) {
+        /* All sent data has been processed, the service opens a new stream when it sends again */
+        stream_end(core, connection, stream);
+    }
+}
+
+static void stream_feed_end(wish_core_t* core, wish_connection_t* connection, wish_stream_id_t id) {
+    wish_stream_t* stream = stream_find(connection->rx_streams, id);
+    if (stream == NULL) {
+        /* Already dropped to make room for another stream */
+        return;
+    }
+    if (stream->rx_total != 0) {
+        WISHDEBUG(LOG_CRITICAL, "Stream %i ended in the middle of a message, closing connection", id);
+        wish_close_connection(core, connection);
+        return;
+    }
+    LL_DELETE(connection->rx_streams, stream);
+    stream_destroy(stream);
+}
+
+/* Drop an incoming stream which is not in the middle of a message, granting its credit first. Returns true if a stream was dropped */
+static bool stream_drop_idle(wish_core_t* core, wish_connection_t* connection) {
+    wish_stream_t* stream;
+    LL_FOREACH(connection->rx_streams, stream) {
+        if (stream->rx_total != 0) {
+            continue;
+        }
+        if (stream->rx_consumed > 0) {
+            stream_send_credit(core, connection, stream);
+            if (stream->rx_consumed > 0) {
+                /* The credit would be lost with the stream */
+                continue;
+            }
+        }
+        LL_DELETE(connection->rx_streams, stream);
+        stream_destroy(stream);
+        return true;
+    }
+    return false;
+}
+
+static void stream_feed_data(wish_core_t* core, wish_connection_t* connection, wish_stream_id_t id, const uint8_t* msg) {
+    bson_iterator it;
+
+    if (bson_find_from_buffer(&it, msg, "total") != BSON_INT) {
+        WISHDEBUG(LOG_CRITICAL, "Stream chunk without total length, closing connection");
+        wish_close_connection(core, connection);
+        return;
+    }
+    int32_t total = bson_iterator_int(&it);
+
+    bson_find_from_buffer(&it, msg, "data");
+    const uint8_t* data = bson_iterator_bin_data(&it);
+    int32_t data_len = bson_iterator_bin_len(&it);
+
+    wish_stream_t* stream = stream_find(connection->rx_streams, id);
+    if (stream == NULL) {
+        if (stream_count(connection->rx_streams) >= WISH_PORT_MAX_STREAMS && !stream_drop_idle(core, connection)) {
+            WISHDEBUG(LOG_CRITICAL, "Too many messages being received at once, closing connection");
+            wish_close_connection(core, connection);
+            return;
+        }
+        stream = stream_create(id);
+        if (stream == NULL) {
+            WISHDEBUG(LOG_CRITICAL, "Memory allocation fail for incoming stream, closing connection");
+            wish_close_connection(core, connection);
+            return;
+        }
+        LL_APPEND(connection->rx_streams, stream);
+    }
+
+    if (data_len <= 0 || stream->rx_consumed + data_len > WISH_PORT_STREAM_WINDOW) {
+        WISHDEBUG(LOG_CRITICAL, "Stream %i exceeds its window, closing connection", id);
+        wish_close_connection(core, connection);
+        return;
+    }
+
+    if (stream->rx_total == 0) {
+        /* First chunk of a new message */
+        if (total <= 0 || data_len > total) {
+            WISHDEBUG(LOG_CRITICAL, "Bad first chunk (total %i, len %i) on stream %i, closing connection", total, data_len, id);
+            wish_close_connection(core, connection);
+            return;
+        }
+
+        stream->rx_total = total;
+        stream->rx_len = 0;
+
+        if (total > WISH_PORT_MAX_MESSAGE_SZ) {
+            /* Leave rx_buf NULL, the chunks of this message are counted but discarded */
+            WISHDEBUG(LOG_CRITICAL, "Incoming message of len %i exceeds WISH_PORT_MAX_MESSAGE_SZ, discarding it", total);
+        }
+        else {
+            stream->rx_buf = wish_platform_malloc(total);
+            if (stream->rx_buf == NULL) {
+                WISHDEBUG(LOG_CRITICAL, "Memory allocation fail for message of len %i, discarding it", total);
+            }
+        }
+    }
+    else if (total != stream->rx_total || data_len > stream->rx_total - stream->rx_len) {
+        WISHDEBUG(LOG_CRITICAL, "Chunk does not match message being reassembled on stream %i, closing connection", id);
+        wish_close_connection(core, connection);
+        return;
+    }
+
+    if (stream->rx_buf != NULL) {
+        memcpy(stream->rx_buf + stream->rx_len, data, data_len);
+    }
+    stream->rx_len += data_len;
+    stream->rx_consumed += data_len;
+
+    if (stream->rx_len == stream->rx_total) {
+        /* The message is complete. Detach it from the stream before
+         * processing, as processing may close the connection */
+        uint8_t* message = stream->rx_buf;
+        int32_t message_len = stream->rx_total;
+        stream->rx_buf = NULL;
+        stream->rx_len = 0;
+        stream->rx_total = 0;
+
+        if (message != NULL) {
+            if (message_len >= 5 && bson_size2(message) == message_len) {
+                wish_core_process_inner_message(core, connection, message, WISH_ENVELOPE_REASSEMBLED);
+            }
+            else {
+                WISHDEBUG(LOG_CRITICAL, "Reassembled message is not a valid BSON document of len %i", message_len);
+            }
+            wish_platform_free(message);
+        }
+
+        if (connection->context_state != WISH_CONTEXT_CONNECTED) {
+            /* The connection was closed, and the stream with it */
+            return;
+        }
+    }
+
+    /* Grant credit in batches, to keep the number of credit messages low */
+    if (stream->rx_consumed >= WISH_PORT_STREAM_WINDOW / 2) {
+        stream_send_credit(core, connection, stream);
+    }
+}
+
+void wish_stream_feed(wish_core_t* core, wish_connection_t* connection, const uint8_t* msg) {
+    bson_iterator it;
+
+    if (bson_find_from_buffer(&it, msg, "stream") != BSON_INT) {
+        WISHDEBUG(LOG_CRITICAL, "Stream message without stream id, closing connection");
+        wish_close_connection(core, connection);
+        return;
+    }
+    wish_stream_id_t id = bson_iterator_int(&it);
+
+    if (bson_find_from_buffer(&it, msg, "data") == BSON_BINDATA) {
+        stream_feed_data(core, connection, id, msg);
+    }
+    else if (bson_find_from_buffer(&it, msg, "credit") == BSON_INT) {
+        stream_feed_credit(core, connection, id, bson_iterator_int(&it));
+    }
+    else if (bson_find_from_buffer(&it, msg, "end") == BSON_BOOL) {
+        stream_feed_end(core, connection, id);
+    }
+    else {
+        WISHDEBUG(LOG_CRITICAL, "Unknown stream message, closing connection");
+        wish_close_connection(core, connection);
+    }
+}
+
+void wish_stream_cleanup(wish_core_t* core, wish_connection_t* connection) {
+    wish_stream_t* stream;
+    wish_stream_t* tmp;
+    LL_FOREACH_SAFE(connection->tx_streams, stream, tmp) {
+        LL_DELETE(connection->tx_streams, stream);
+        stream_destroy(stream);
+    }
+    LL_FOREACH_SAFE(connection->rx_streams, stream, tmp) {
+        LL_DELETE(connection->rx_streams, stream);
+        stream_destroy(stream);
+    }
+    connection->tx_stream_next_id = 0;
+}
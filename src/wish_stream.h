@@ -0,0 +1,159 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+#pragma once
+
+/* Wish C - Multiplexed streams with per-stream flow control
+ *
+ * Service traffic (services.send) between two cores is carried on
+ * streams, one stream per sending local service. Messages queued on a
+ * stream are sent in chunks of at most WISH_PORT_STREAM_CHUNK_SZ bytes:
+ *
+ * { stream: int32, data: Buffer, total: int32 }
+ *
+ * where total is the length of the whole message the chunk belongs to.
+ * The chunks of one stream are sent in order, but the scheduler
+ * interleaves the chunks of different streams round-robin, so that a
+ * bulk transfer on one stream does not block the others. Messages
+ * which are not sent on streams (core RPC, ping/pong) are sent
+ * immediately, between the chunks.
+ *
+ * Each stream has a send window (credit) of WISH_PORT_STREAM_WINDOW
+ * bytes. The receiver grants more credit as it processes data:
+ *
+ * { stream: int32, credit: int32 }
+ *
+ * A stream which has nothing queued is ended when its credit is back
+ * to the full window, or when its slot is needed for another service,
+ * and the receiver then drops its state for the stream:
+ *
+ * { stream: int32, end: true }
+ *
+ * Stream ids are not reused. If all WISH_PORT_MAX_STREAMS streams have
+ * data queued, messages of other services are sent without a stream.
+ * The receiver makes room for a new stream by dropping one which is
+ * not in the middle of a message, after granting its credit back.
+ *
+ * Streams are only used with remote cores that announce
+ * WISH_FEATURE_STREAM in their handshake.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include "wish_core.h"
+#include "wish_connection.h"
+
+/* Define the number of bytes the remote end may send on a stream
+ * before it has to wait for more credit */
+#ifndef WISH_PORT_STREAM_WINDOW
+#define WISH_PORT_STREAM_WINDOW ( 64*1024 )
+#endif
+
+/* Define the maximum number of message bytes in one chunk */
+#ifndef WISH_PORT_STREAM_CHUNK_SZ
+#define WISH_PORT_STREAM_CHUNK_SZ ( 8*1024 )
+#endif
+
+/* Define the maximum number of bytes sent per call to wish_stream_schedule().
+ * This bounds how much bulk data can be ahead of a control message in
+ * the transport's send buffer. */
+#ifndef WISH_PORT_STREAM_ROUND_SZ
+#define WISH_PORT_STREAM_ROUND_SZ ( 4*WISH_PORT_STREAM_CHUNK_SZ )
+#endif
+
+/* Define the maximum number of bytes queued for sending on one stream */
+#ifndef WISH_PORT_STREAM_TX_QUEUE_SZ
+#define WISH_PORT_STREAM_TX_QUEUE_SZ ( 4*WISH_PORT_STREAM_WINDOW )
+#endif
+
+/* Define the maximum number of streams per connection, in each direction */
+#ifndef WISH_PORT_MAX_STREAMS
+#define WISH_PORT_MAX_STREAMS 16
+#endif
+
+typedef int32_t wish_stream_id_t;
+
+struct wish_stream_msg {
+    uint8_t* data;
+    int32_t len;
+    /* The number of bytes already sent */
+    int32_t offset;
+    struct wish_stream_msg* next;
+};
+
+typedef struct wish_stream {
+    wish_stream_id_t id;
+    /* Outgoing streams: the local service sending on this stream */
+    uint8_t wsid[WISH_WSID_LEN];
+    /* Outgoing streams: the number of bytes we may still send */
+    int32_t tx_credit;
+    /* Outgoing streams: the number of bytes in tx_queue */
+    int32_t tx_queued;
+    struct wish_stream_msg* tx_queue;
+    /* Outgoing streams: the stream is ended, but sending the end message failed */
+    bool tx_ending;
+    /* Incoming streams: bytes processed, but not yet granted back as credit */
+    int32_t rx_consumed;
+    /* Incoming streams: credit is to be granted, but sending it failed */
+    bool rx_credit_due;
+    /* Incoming streams: reassembly of the current message. rx_total is
+     * 0 when no message is being reassembled. */
+    uint8_t* rx_buf;
+    int32_t rx_len;
+    int32_t rx_total;
+    struct wish_stream* next;
+} wish_stream_t;
+
+/**
+ * Queue a message for sending on the stream of the local service wsid.
+ * The message is copied. Nothing is sent before the next call to
+ * wish_stream_schedule(). If no stream can be opened for wsid, the
+ * message is sent right away without a stream.
+ *
+ * @return 0 if the message was queued or sent, non-zero if the stream
+ * queue is full, memory allocation fails or sending fails
+ */
+int wish_stream_send(wish_core_t* core, wish_connection_t* connection, const uint8_t* wsid, const uint8_t* payload, int payload_len);
+
+/**
+ * Send the credit and end messages which could not be sent earlier,
+ * and then one round of chunks: one chunk from each stream which has both
+ * data queued and credit left, starting from the stream after the one
+ * served last. At most WISH_PORT_STREAM_ROUND_SZ bytes are sent; the
+ * streams which did not get their turn are first in the next round.
+ * No chunks are sent while the transport has bytes kept, see
+ * wish_connection_tx_keep(). Call when the connection can be written to.
+ */
+void wish_stream_schedule(wish_core_t* core, wish_connection_t* connection);
+
+/** Returns true if the connection has stream data or control messages which can be sent now */
+bool wish_stream_tx_pending(wish_connection_t* connection);
+
+/**
+ * Feed an incoming stream message ({ stream, data, total },
+ * { stream, credit } or { stream, end }). Complete messages are submitted to
+ * wish_core_process_inner_message().
+ */
+void wish_stream_feed(wish_core_t* core, wish_connection_t* connection, const uint8_t* msg);
+
+/** Release all streams of a connection */
+void wish_stream_cleanup(wish_core_t* core, wish_connection_t* connection);
+
+#ifdef __cplusplus
+}
+#endif
@@ -15,6 +15,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <string.h>
 
 #include "wish_time.h"
 #include "wish_connection.h"
@@ -25,57 +26,226 @@
 #include "utlist.h"
 
 
+#include "wish_platform.h"
+
+#define WISH_TIMER_SLOT_MASK (WISH_TIMER_SLOTS - 1)
+
+/* Returns the slot for a timer expiring at the given time */
+static wish_timer_db_t** timer_slot(wish_timer_wheel_t* wheel, wish_time_ms_t time) {
+    wish_time_ms_t delta = time - wheel->now;
+    int level = 0;
+    
+    for (level = 0; level < WISH_TIMER_LEVELS - 1; level++) {
+        if (delta < ((wish_time_ms_t) 1 << (WISH_TIMER_SLOT_BITS * (level + 1)))) {
+            break;
+        }
+    }
+    
+    if (level == WISH_TIMER_LEVELS - 1) {
+        wish_time_ms_t range = (wish_time_ms_t) 1 << (WISH_TIMER_SLOT_BITS * WISH_TIMER_LEVELS);
+        if (delta >= range) {
+            /* Beyond the wheel: park in the farthest slot, the timer is
+             * placed again when that slot is cascaded */
+            time = wheel->now + range - 1;
+        }
+    }
+    
+    int index = (time >> (WISH_TIMER_SLOT_BITS * level)) & WISH_TIMER_SLOT_MASK;
+    return &wheel->slots[level][index];
+}
+
+static void timer_insert(wish_timer_wheel_t* wheel, wish_timer_db_t* timer) {
+    if (timer->time < wheel->now) {
+        timer->time = wheel->now;
+    }
+    timer->slot = timer_slot(wheel, timer->time);
+    DL_APPEND(*timer->slot, timer);
+}
+
+static wish_timer_db_t* timer_alloc(wish_timer_wheel_t* wheel) {
+    if (wheel->pool == NULL) {
+        wish_timer_db_t* chunk = wish_platform_malloc(sizeof(wish_timer_db_t) * WISH_TIMER_POOL_CHUNK);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        int i = 0;
+        for (i = 0; i < WISH_TIMER_POOL_CHUNK; i++) {
+            chunk[i].next = wheel->pool;
+            wheel->pool = &chunk[i];
+        }
+    }
+    
+    wish_timer_db_t* timer = wheel->pool;
+    wheel->pool = timer->next;
+    memset(timer, 0, sizeof(wish_timer_db_t));
+    wheel->last_id++;
+    if (wheel->last_id == 0) {
+        /* 0 is the id of a zeroed handle */
+        wheel->last_id++;
+    }
+    timer->id = wheel->last_id;
+    wheel->num_timers++;
+    return timer;
+}
+
+static void timer_release(wish_timer_wheel_t* wheel, wish_timer_db_t* timer) {
+    timer->active = false;
+    timer->next = wheel->pool;
+    wheel->pool = timer;
+    wheel->num_timers--;
+}
+
+/* Move the timers of a higher level slot down to where they now belong */
+static void timer_cascade(wish_timer_wheel_t* wheel, int level, int index) {
+    wish_timer_db_t* list = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    
+    wish_timer_db_t* timer = NULL;
+    wish_timer_db_t* tmp = NULL;
+    DL_FOREACH_SAFE(list, timer, tmp) {
+        timer_insert(wheel, timer);
+    }
+}
+
+/* Advance the wheel by one millisecond, and run the timers which expire */
+static void timer_tick(wish_core_t* core, wish_timer_wheel_t* wheel) {
+    wheel->now++;
+    
+    int level = 0;
+    int index = wheel->now & WISH_TIMER_SLOT_MASK;
+    while (index == 0 && level < WISH_TIMER_LEVELS - 1) {
+        level++;
+        index = (wheel->now >> (WISH_TIMER_SLOT_BITS * level)) & WISH_TIMER_SLOT_MASK;
+        timer_cascade(wheel, level, index);
+    }
+    
+    wish_timer_db_t** slot = &wheel->slots[0][wheel->now & WISH_TIMER_SLOT_MASK];
+    
+    while (*slot != NULL) {
+        wish_timer_db_t* timer = *slot;
+        DL_DELETE(*slot, timer);
+        timer->slot = NULL;
+        
+        timer->cb(core, timer->cb_ctx);
+        
+        if (!timer->active || timer->singleShot) {
+            timer_release(wheel, timer);
+        }
+        else {
+            timer->time = wheel->now + timer->interval;
+            timer_insert(wheel, timer);
+        }
+    }
+}
+
+void wish_time_init(wish_core_t* core) {
+    core->timer_wheel = wish_platform_malloc(sizeof(wish_timer_wheel_t));
+    if (core->timer_wheel == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "Memory allocation fail for timer wheel");
+        return;
+    }
+    memset(core->timer_wheel, 0, sizeof(wish_timer_wheel_t));
+}
+
 /* Report to Wish core that one second has been passed.
  * This function must be called periodically by the porting layer 
- * one second intervals */
+ * one second intervals, unless the port uses wish_time_report_elapsed_ms() */
 void wish_time_report_periodic(wish_core_t* core) {
-    core->core_time++;
+    wish_time_report_elapsed_ms(core, 1000);
+}
 
-    static wish_time_t check_connections_timestamp;
-    if (core->core_time > (check_connections_timestamp + 60)) {
-        check_connections_timestamp = core->core_time;
-        wish_connections_check(core);
+void wish_time_report_elapsed_ms(wish_core_t* core, uint32_t elapsed_ms) {
+    wish_timer_wheel_t* wheel = core->timer_wheel;
+    
+    while (elapsed_ms > 0) {
+        if (wheel->num_timers == 0) {
+            /* Nothing to run, just move the clock */
+            wheel->now += elapsed_ms;
+            elapsed_ms = 0;
+        }
+        else {
+            timer_tick(core, wheel);
+            elapsed_ms--;
+        }
+        core->core_time = (wish_time_t) (wheel->now / 1000);
     }
+}
 
-    wish_timer_db_t* timer = NULL;
-    wish_timer_db_t* tmp = NULL;
+uint32_t wish_time_next_timeout_ms(wish_core_t* core, uint32_t max_ms) {
+    wish_timer_wheel_t* wheel = core->timer_wheel;
     
-    LL_FOREACH_SAFE(core->time_db, timer, tmp) {
-        //WISHDEBUG(LOG_CRITICAL, "timer check %i > %i, int: %i?", core->core_time, timer->time, timer->interval);
-        if (core->core_time >= timer->time) {
-            timer->cb(core, timer->cb_ctx);
-            if (timer->singleShot) {
-                LL_DELETE(core->time_db, timer);
-                wish_platform_free(timer);
-            } else {
-                timer->time = core->core_time + timer->interval;
-            }
+    /* Only the lowest level is looked at: a timer on a higher level
+     * expires WISH_TIMER_SLOTS ms or more from now, but its slot is
+     * cascaded at the latest when the lowest level wraps around */
+    uint32_t ms = 1;
+    for (ms = 1; ms < WISH_TIMER_SLOTS && ms < max_ms; ms++) {
+        if (wheel->slots[0][(wheel->now + ms) & WISH_TIMER_SLOT_MASK] != NULL) {
+            return ms;
         }
     }
+    
+    uint32_t to_wrap = WISH_TIMER_SLOTS - (wheel->now & WISH_TIMER_SLOT_MASK);
+    if (to_wrap < ms) {
+        ms = to_wrap;
+    }
+    return ms;
 }
 
-wish_timer_db_t* wish_core_time_set_interval(wish_core_t* core, timer_cb cb, void* cb_ctx, int interval ) {
-    wish_timer_db_t* timer = wish_platform_malloc(sizeof(wish_timer_db_t));
-    timer->time = core->core_time + interval;
-    timer->interval = interval;
+static wish_timer_handle_t timer_set(wish_core_t* core, timer_cb cb, void* cb_ctx, uint32_t ms, bool single_shot) {
+    wish_timer_wheel_t* wheel = core->timer_wheel;
+    wish_timer_handle_t handle = { NULL, 0 };
+    
+    wish_timer_db_t* timer = timer_alloc(wheel);
+    if (timer == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "Memory allocation fail for timer");
+        return handle;
+    }
     timer->cb = cb;
     timer->cb_ctx = cb_ctx;
-    timer->singleShot = false;
-    LL_APPEND(core->time_db, timer);
+    timer->interval = ms > 0 ? ms : 1;
+    timer->time = wheel->now + timer->interval;
+    timer->singleShot = single_shot;
+    timer->active = true;
+    timer_insert(wheel, timer);
     
-    return timer;
+    handle.node = timer;
+    handle.id = timer->id;
+    return handle;
 }
 
-wish_timer_db_t* wish_core_time_set_timeout(wish_core_t* core, timer_cb cb, void* cb_ctx, int interval ) {
-    wish_timer_db_t* timer = wish_platform_malloc(sizeof(wish_timer_db_t));
-    timer->time = core->core_time + interval;
-    timer->interval = interval;
-    timer->cb = cb;
-    timer->cb_ctx = cb_ctx;
-    timer->singleShot = true;
-    LL_APPEND(core->time_db, timer);
+wish_timer_handle_t wish_core_time_set_interval(wish_core_t* core, timer_cb cb, void* cb_ctx, int interval) {
+    return timer_set(core, cb, cb_ctx, interval * 1000, false);
+}
+
+wish_timer_handle_t wish_core_time_set_timeout(wish_core_t* core, timer_cb cb, void* cb_ctx, int interval) {
+    return timer_set(core, cb, cb_ctx, interval * 1000, true);
+}
+
+wish_timer_handle_t wish_core_time_set_interval_ms(wish_core_t* core, timer_cb cb, void* cb_ctx, uint32_t interval_ms) {
+    return timer_set(core, cb, cb_ctx, interval_ms, false);
+}
+
+wish_timer_handle_t wish_core_time_set_timeout_ms(wish_core_t* core, timer_cb cb, void* cb_ctx, uint32_t timeout_ms) {
+    return timer_set(core, cb, cb_ctx, timeout_ms, true);
+}
+
+void wish_core_time_cancel(wish_core_t* core, wish_timer_handle_t handle) {
+    wish_timer_db_t* timer = handle.node;
     
-    return timer;
+    /* Nodes are never freed, so a stale handle can still be looked at */
+    if (timer == NULL || timer->id != handle.id || !timer->active) {
+        return;
+    }
+    
+    if (timer->slot == NULL) {
+        /* The callback is running, the timer is released when it returns */
+        timer->active = false;
+        return;
+    }
+    
+    DL_DELETE(*timer->slot, timer);
+    timer->slot = NULL;
+    timer_release(core->timer_wheel, timer);
 }
 
 /* Report the number of seconds elapsed since core startup */
@@ -83,4 +253,6 @@ wish_time_t wish_time_get_relative(wish_core_t* core) {
     return core->core_time;
 }
 
-
+wish_time_ms_t wish_time_get_relative_ms(wish_core_t* core) {
+    return core->timer_wheel->now;
+}
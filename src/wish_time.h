@@ -16,25 +16,82 @@
 
 /* Time-related functions for Wish.
  *
- * The Wish core needs a time base for tracking time in one second
- * resultion.
+ * The Wish core needs a time base for tracking time. The porting layer
+ * reports the passing of time with wish_time_report_elapsed_ms(), or
+ * once a second with wish_time_report_periodic().
  *
  * The time is needed for example for connection pinging, for detecting
  * dead connections. 
+ *
+ * Timers are kept in a hierarchical timing wheel of WISH_TIMER_LEVELS
+ * levels of WISH_TIMER_SLOTS slots, with a resolution of one
+ * millisecond. Setting and cancelling a timer is O(1), and advancing
+ * the time by one millisecond looks at one slot, plus a cascade of the
+ * timers of a higher level slot every WISH_TIMER_SLOTS milliseconds.
+ * Timer nodes are taken from a pool, which grows WISH_TIMER_POOL_CHUNK
+ * nodes at a time and is never shrunk.
  */
 
 #include "wish_core.h"
 
+#define WISH_TIMER_LEVELS 4
+#define WISH_TIMER_SLOT_BITS 6
+#define WISH_TIMER_SLOTS (1 << WISH_TIMER_SLOT_BITS)
+#define WISH_TIMER_POOL_CHUNK 32
+
+typedef struct wish_timer_wheel {
+    /* The current time, in milliseconds since core startup */
+    wish_time_ms_t now;
+    wish_timer_db_t* slots[WISH_TIMER_LEVELS][WISH_TIMER_SLOTS];
+    /* Unused timer nodes */
+    wish_timer_db_t* pool;
+    /* The id of the node last taken from the pool */
+    uint32_t last_id;
+    /* The number of timers in the wheel */
+    int num_timers;
+} wish_timer_wheel_t;
+
+/* Set up the timer wheel. Called from wish_core_init(). */
+void wish_time_init(wish_core_t* core);
+
 /* Report to Wish core that one second has been passed.
- * This function must be called periodically by the porting layer 
- * one second intervals */
+ * The porting layer must call this function, or
+ * wish_time_report_elapsed_ms(), periodically. */
 void wish_time_report_periodic(wish_core_t* core);
 
+/* Report to Wish core that elapsed_ms milliseconds have passed since
+ * the previous report. Expired timers are run. */
+void wish_time_report_elapsed_ms(wish_core_t* core, uint32_t elapsed_ms);
+
+/* Returns the number of milliseconds until the next timer may expire,
+ * but at most max_ms. The porting layer can use this as its poll
+ * timeout. */
+uint32_t wish_time_next_timeout_ms(wish_core_t* core, uint32_t max_ms);
+
 typedef void (*timer_cb)(wish_core_t* core, void* cb_ctx);
 
-wish_timer_db_t* wish_core_time_set_interval(wish_core_t* core, timer_cb cb, void* cb_ctx, int interval);
+/* Run cb every interval seconds. The returned timer can be cancelled
+ * with wish_core_time_cancel(). The node of the returned handle is NULL
+ * if the timer could not be set. */
+wish_timer_handle_t wish_core_time_set_interval(wish_core_t* core, timer_cb cb, void* cb_ctx, int interval);
+
+/* Run cb once, after interval seconds. The returned timer can be
+ * cancelled with wish_core_time_cancel() until the callback has run. */
+wish_timer_handle_t wish_core_time_set_timeout(wish_core_t* core, timer_cb cb, void* cb_ctx, int interval);
+
+/* As wish_core_time_set_interval(), with the interval in milliseconds */
+wish_timer_handle_t wish_core_time_set_interval_ms(wish_core_t* core, timer_cb cb, void* cb_ctx, uint32_t interval_ms);
 
-wish_timer_db_t* wish_core_time_set_timeout(wish_core_t* core, timer_cb cb, void* cb_ctx, int interval);
+/* As wish_core_time_set_timeout(), with the timeout in milliseconds */
+wish_timer_handle_t wish_core_time_set_timeout_ms(wish_core_t* core, timer_cb cb, void* cb_ctx, uint32_t timeout_ms);
+
+/* Cancel a timer. A timer may cancel itself from its callback. Nothing
+ * is done if the timer has already run or has been cancelled, even if
+ * its node has since been reused for another timer. */
+void wish_core_time_cancel(wish_core_t* core, wish_timer_handle_t timer);
 
 /* Report the number of seconds elapsed since core startup */
 wish_time_t wish_time_get_relative(wish_core_t* core);
+
+/* Report the number of milliseconds elapsed since core startup */
+wish_time_ms_t wish_time_get_relative_ms(wish_core_t* core);